@@ -0,0 +1,193 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+/*
+
+`./arena_benchmark` for usage.
+
+Simulates request-scoped allocation: each thread repeatedly runs "requests"
+that each make a handful of small allocations, write to them, and then drop
+them all at once. Each row of output gives the average number of TSC ticks per
+allocation (including its share of the end-of-request cleanup) for:
+- malloc: malloc each object, free them all at the end of the request.
+- threadLocal: a bump-pointer arena per thread, reset at the end of each
+  request. Fast, but each thread holds on to its own chunk.
+- perCpu: a PerCpuArena shared by all threads. Requests note the epoch they
+  started in; a background thread advances the epoch every millisecond and
+  releases every epoch that no request is still using.
+
+*/
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+#include <vector>
+
+#include "rseq/PerCpuArena.h"
+#include "rseq/internal/CachelinePadded.h"
+#include "rseq/internal/NumCpus.h"
+
+const int kAllocsPerRequest = 16;
+const std::size_t kAllocSize = 64;
+const std::size_t kChunkSize = 64 * 1024;
+const std::uint64_t kIdle = ~static_cast<std::uint64_t>(0);
+
+std::uint64_t rdtscp() {
+  std::uint32_t ecx;
+  std::uint64_t rax,rdx;
+  asm volatile ( "rdtscp\n" : "=a" (rax), "=d" (rdx), "=c" (ecx) : : );
+  return (rdx << 32) + rax;
+}
+
+void touch(void* ptr) {
+  static_cast<volatile char*>(ptr)[0] = 1;
+}
+
+void mallocRequests(int /* thread */, std::uint64_t numRequests) {
+  void* ptrs[kAllocsPerRequest];
+  for (std::uint64_t i = 0; i < numRequests; ++i) {
+    for (int j = 0; j < kAllocsPerRequest; ++j) {
+      ptrs[j] = std::malloc(kAllocSize);
+      touch(ptrs[j]);
+    }
+    for (int j = 0; j < kAllocsPerRequest; ++j) {
+      std::free(ptrs[j]);
+    }
+  }
+}
+
+void threadLocalRequests(int /* thread */, std::uint64_t numRequests) {
+  char* chunk = static_cast<char*>(std::malloc(kChunkSize));
+  for (std::uint64_t i = 0; i < numRequests; ++i) {
+    char* next = chunk;
+    for (int j = 0; j < kAllocsPerRequest; ++j) {
+      void* ptr = next;
+      next += kAllocSize;
+      touch(ptr);
+    }
+  }
+  std::free(chunk);
+}
+
+rseq::PerCpuArena* arena;
+// The epoch each thread's current request started in, or kIdle.
+std::vector<rseq::internal::CachelinePadded<std::atomic<std::uint64_t>>>*
+    requestEpochs;
+std::atomic<bool> stopReclaimer;
+
+void perCpuRequests(int thread, std::uint64_t numRequests) {
+  std::atomic<std::uint64_t>* myEpoch = (*requestEpochs)[thread].get();
+  for (std::uint64_t i = 0; i < numRequests; ++i) {
+    myEpoch->store(arena->currentEpoch());
+    for (int j = 0; j < kAllocsPerRequest; ++j) {
+      touch(arena->allocate(kAllocSize));
+    }
+    myEpoch->store(kIdle);
+  }
+}
+
+void reclaimer(int numThreads) {
+  // Every epoch before this one has been released.
+  std::uint64_t firstUnreleased = 0;
+  while (!stopReclaimer.load()) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    // Requests that read the epoch after this are in the new one, and shards
+    // have been closed, so nothing more gets allocated in the old one.
+    std::uint64_t oldestInUse = arena->advanceEpoch() + 1;
+    for (int i = 0; i < numThreads; ++i) {
+      std::uint64_t epoch = (*requestEpochs)[i].get()->load();
+      if (epoch < oldestInUse) {
+        oldestInUse = epoch;
+      }
+    }
+    if (oldestInUse > firstUnreleased) {
+      arena->release(oldestInUse - 1);
+      firstUnreleased = oldestInUse;
+    }
+  }
+}
+
+template <typename Func>
+double ticksPerAlloc(int numThreads, std::uint64_t numRequests, Func func) {
+  std::vector<std::thread> threads(numThreads);
+  std::uint64_t beginCycles = rdtscp();
+  for (int i = 0; i < numThreads; ++i) {
+    threads[i] = std::thread(func, i, numRequests);
+  }
+  for (int i = 0; i < numThreads; ++i) {
+    threads[i].join();
+  }
+  std::uint64_t endCycles = rdtscp();
+  return static_cast<double>(endCycles - beginCycles)
+      / (numRequests * kAllocsPerRequest * numThreads);
+}
+
+void runMeasurement(int numThreads, std::uint64_t numRequests) {
+  double mallocTicks =
+      ticksPerAlloc(numThreads, numRequests, mallocRequests);
+  double threadLocalTicks =
+      ticksPerAlloc(numThreads, numRequests, threadLocalRequests);
+
+  arena = new rseq::PerCpuArena(kChunkSize);
+  requestEpochs = new std::vector<
+      rseq::internal::CachelinePadded<std::atomic<std::uint64_t>>>(numThreads);
+  for (int i = 0; i < numThreads; ++i) {
+    (*requestEpochs)[i].get()->store(kIdle);
+  }
+  stopReclaimer.store(false);
+  std::thread reclaimerThread(reclaimer, numThreads);
+  double perCpuTicks = ticksPerAlloc(numThreads, numRequests, perCpuRequests);
+  stopReclaimer.store(true);
+  reclaimerThread.join();
+  delete requestEpochs;
+  delete arena;
+
+  std::printf(
+      "%10d %12.1f %12.1f %12.1f\n",
+      numThreads,
+      mallocTicks,
+      threadLocalTicks,
+      perCpuTicks);
+}
+
+const char* usage = R"(Usage: %s requests_per_thread max_threads
+  For thread counts 1, 2, 4, ..., up to max_threads, runs requests_per_thread
+  simulated requests on each thread with each allocation strategy, and prints
+  the average cost (in TSC ticks) of an allocation.
+)";
+
+int main(int argc, char** argv) {
+  if (argc != 3) {
+    std::printf(usage, argv[0]);
+    std::exit(1);
+  }
+  std::uint64_t numRequests = atol(argv[1]);
+  int maxThreads = atoi(argv[2]);
+  if (numRequests == 0 || maxThreads <= 0) {
+    std::printf("Error: invalid arguments\n");
+    std::exit(1);
+  }
+
+  std::printf("Cpus: %d\n", rseq::internal::numCpus());
+  std::printf(
+      "%10s %12s %12s %12s\n", "threads", "malloc", "threadLocal", "perCpu");
+  for (int threads = 1; ; threads *= 2) {
+    if (threads > maxThreads) {
+      threads = maxThreads;
+    }
+    runMeasurement(threads, numRequests);
+    if (threads == maxThreads) {
+      break;
+    }
+  }
+  return 0;
+}
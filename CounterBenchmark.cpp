@@ -0,0 +1,168 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+/*
+
+`./counter_benchmark` for usage.
+
+Measures the latency of reading a sharded counter while a varying number of
+cpus are writing to it. Each row of output gives the average number of TSC
+ticks a single read took, for:
+- shardSum: the naive approach (what rseq_benchmark does to check its results);
+  walk every cpu's shard and add them up.
+- read: PerCpuCounter::read(), which touches one cacheline per NUMA node.
+- readNode: PerCpuCounter::readNode() for the reader's node; one cacheline.
+- sum: PerCpuCounter::sum(), which is exact, and so must fence and then walk
+  every shard.
+
+*/
+
+#include <sched.h>
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+#include <vector>
+
+#include "rseq/PerCpu.h"
+#include "rseq/PerCpuCounter.h"
+#include "rseq/Rseq.h"
+#include "rseq/internal/NumCpus.h"
+#include "rseq/internal/Topology.h"
+
+rseq::PerCpuCounter* counter;
+rseq::PerCpu<rseq::Value<std::uint64_t>>* shardedCounter;
+std::atomic<bool> stopWriters;
+
+std::uint64_t rdtscp() {
+  std::uint32_t ecx;
+  std::uint64_t rax,rdx;
+  asm volatile ( "rdtscp\n" : "=a" (rax), "=d" (rdx), "=c" (ecx) : : );
+  return (rdx << 32) + rax;
+}
+
+void pinToCpu(int cpu) {
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  if (sched_setaffinity(0, sizeof(set), &set) != 0) {
+    std::printf("Error: couldn't pin to cpu %d\n", cpu);
+    std::exit(1);
+  }
+}
+
+void writerThread(int cpu) {
+  pinToCpu(cpu);
+  while (!stopWriters.load(std::memory_order_relaxed)) {
+    counter->add(1);
+    shardedCounter->withLocal([](rseq::Value<std::uint64_t>& target) {
+      return rseq::store(&target, target.load() + 1);
+    });
+  }
+}
+
+template <typename Func>
+double ticksPerRead(std::uint64_t numReads, Func&& func) {
+  // Keep the compiler from throwing away the reads.
+  volatile std::int64_t sink = 0;
+  std::uint64_t beginCycles = rdtscp();
+  for (std::uint64_t i = 0; i < numReads; ++i) {
+    sink = sink + func();
+  }
+  std::uint64_t endCycles = rdtscp();
+  return static_cast<double>(endCycles - beginCycles) / numReads;
+}
+
+void runMeasurement(int numWriterCpus, std::uint64_t numReads) {
+  int numCpus = rseq::internal::numCpus();
+  int readerCpu = numCpus - 1;
+  int readerNode = rseq::internal::nodeForCpu(readerCpu);
+
+  stopWriters.store(false);
+  std::vector<std::thread> writers(numWriterCpus);
+  for (int i = 0; i < numWriterCpus; ++i) {
+    writers[i] = std::thread(writerThread, i);
+  }
+
+  pinToCpu(readerCpu);
+  double shardSumTicks = ticksPerRead(numReads, [&]() {
+    std::uint64_t result = 0;
+    for (int i = 0; i < numCpus; ++i) {
+      result += shardedCounter->forShard(i)->load();
+    }
+    return result;
+  });
+  double readTicks = ticksPerRead(numReads, [&]() {
+    return counter->read();
+  });
+  double readNodeTicks = ticksPerRead(numReads, [&]() {
+    return counter->readNode(readerNode);
+  });
+  // Each sum() does a heavy fence; scale down the number of iterations so that
+  // this doesn't dominate the runtime.
+  double sumTicks = ticksPerRead(numReads / 100 + 1, [&]() {
+    return counter->sum();
+  });
+
+  stopWriters.store(true);
+  for (int i = 0; i < numWriterCpus; ++i) {
+    writers[i].join();
+  }
+
+  std::printf(
+      "%10d %12.1f %12.1f %12.1f %12.1f\n",
+      numWriterCpus,
+      shardSumTicks,
+      readTicks,
+      readNodeTicks,
+      sumTicks);
+}
+
+const char* usage = R"(Usage: %s reads_per_measurement
+  For writer cpu counts 1, 2, 4, ..., up to the number of cpus, starts one
+  thread per writer cpu incrementing a counter as fast as it can, and measures
+  the average cost (in TSC ticks) of reading the counter in various ways from
+  the last cpu.
+)";
+
+int main(int argc, char** argv) {
+  if (argc != 2) {
+    std::printf(usage, argv[0]);
+    std::exit(1);
+  }
+  std::uint64_t numReads = atol(argv[1]);
+  if (numReads == 0) {
+    std::printf("Error: invalid value for reads_per_measurement\n");
+    std::exit(1);
+  }
+
+  counter = new rseq::PerCpuCounter;
+  shardedCounter = new rseq::PerCpu<rseq::Value<std::uint64_t>>;
+
+  std::printf(
+      "Cpus: %d, NUMA nodes: %d\n",
+      rseq::internal::numCpus(),
+      rseq::internal::numNodes());
+  std::printf(
+      "%10s %12s %12s %12s %12s\n",
+      "writers", "shardSum", "read", "readNode", "sum");
+  int numCpus = rseq::internal::numCpus();
+  for (int writers = 1; ; writers *= 2) {
+    if (writers > numCpus) {
+      writers = numCpus;
+    }
+    runMeasurement(writers, numReads);
+    if (writers == numCpus) {
+      break;
+    }
+  }
+  return 0;
+}
@@ -110,6 +110,7 @@ Global TSC ticks per increment: 1040.727346
 #include <algorithm>
 #include <atomic>
 #include <chrono>
+#include <cinttypes>
 #include <cstdint>
 #include <cstdio>
 #include <cstdlib>
@@ -118,6 +119,8 @@ Global TSC ticks per increment: 1040.727346
 #include <thread>
 #include <vector>
 
+#include "rseq/PerCpu.h"
+#include "rseq/PerCpuRateLimiter.h"
 #include "rseq/Rseq.h"
 #include "rseq/internal/NumCpus.h"
 
@@ -134,7 +137,7 @@ struct PercpuCounter {
           - sizeof(mu)];
 };
 
-std::vector<PercpuCounter> counterByCpu;
+rseq::PerCpu<PercpuCounter>* counterByCpu;
 char padding1[kCachelineSize - sizeof(counterByCpu)];
 
 std::mutex contendedMu;
@@ -142,6 +145,20 @@ char padding2[kCachelineSize - sizeof(contendedMu)];
 
 std::atomic<std::uint64_t> contendedCounter;
 
+// The rate limiter benchmarks count attempts as increments, and separately
+// count how many of them were let through.
+constexpr double kRateLimitPerSecond = 10000000.0;
+constexpr std::int64_t kRateLimitBurst = 100000;
+constexpr std::uint64_t kRateLimitBatch = 64;
+
+rseq::PerCpuRateLimiter* rateLimiter;
+std::atomic<std::uint64_t> tokensGranted;
+
+// A token bucket in a single atomic, refilled by whichever thread finds it
+// empty.
+std::atomic<std::int64_t> contendedTokens;
+std::atomic<std::int64_t> contendedLastRefillNs;
+
 enum TestType {
   kLongCriticalSection,
   kContendedAtomics,
@@ -152,6 +169,8 @@ enum TestType {
   kLocks,
   kLocksCachedCpu,
   kThreadLocal,
+  kRateLimiter,
+  kContendedRateLimiter,
   kTestTypeEnd,
 };
 
@@ -175,6 +194,10 @@ const char* testTypeString(TestType testType) {
         return "Per-cpu locks (with cached sched_getcpu calls)";
     case kThreadLocal:
         return "Thread-local operations only (no sharing)";
+    case kRateLimiter:
+        return "Per-cpu rate limiter";
+    case kContendedRateLimiter:
+        return "Rate limiter with a single atomic token count";
     case kTestTypeEnd:
         /* should never happen */
         return nullptr;
@@ -208,34 +231,30 @@ void doIncrementsContendedLocks(std::uint64_t numIncrements) {
 
 void doIncrementsRseq(std::uint64_t numIncrements) {
   for (std::uint64_t i = 0; i < numIncrements; ++i) {
-    bool success = false;
-    do {
-      int cpu = rseq::begin();
-      std::uint64_t curVal = counterByCpu[cpu].rseqCounter.load();
-      success = rseq::store(&counterByCpu[cpu].rseqCounter, curVal + 1);
-    } while (!success);
+    counterByCpu->withLocal([](PercpuCounter& counter) {
+      std::uint64_t curVal = counter.rseqCounter.load();
+      return rseq::store(&counter.rseqCounter, curVal + 1);
+    });
   }
 }
 
 void doIncrementsAtomics(std::uint64_t numIncrements) {
   for (std::uint64_t i = 0; i < numIncrements; ++i) {
     std::uint64_t old;
-    int cpu;
+    PercpuCounter* counter;
     do {
-      cpu = sched_getcpu();
-      old = counterByCpu[cpu].atomicCounter.load();
-    } while (!counterByCpu[cpu].atomicCounter.compare_exchange_weak(
-          old, old + 1));
+      counter = counterByCpu->forShard(sched_getcpu());
+      old = counter->atomicCounter.load();
+    } while (!counter->atomicCounter.compare_exchange_weak(old, old + 1));
   }
 }
 
 void doIncrementsAtomicsCachedCpu(std::uint64_t numIncrements) {
   for (std::uint64_t i = 0; i < numIncrements;) {
-    int cpu = sched_getcpu();
+    PercpuCounter* counter = counterByCpu->forShard(sched_getcpu());
     for (int j = 0; j < 100 && i < numIncrements; ++i, ++j) {
-      std::uint64_t old = counterByCpu[cpu].atomicCounter.load();
-      if (!counterByCpu[cpu].atomicCounter.compare_exchange_weak(
-            old, old + 1)) {
+      std::uint64_t old = counter->atomicCounter.load();
+      if (!counter->atomicCounter.compare_exchange_weak(old, old + 1)) {
         break;
       }
     }
@@ -244,21 +263,21 @@ void doIncrementsAtomicsCachedCpu(std::uint64_t numIncrements) {
 
 void doIncrementsLocks(std::uint64_t numIncrements) {
   for (std::uint64_t i = 0; i < numIncrements; ++i) {
-    int cpu = sched_getcpu();
-    std::lock_guard<std::mutex> lg(counterByCpu[cpu].mu);
-    counterByCpu[cpu].atomicCounter.store(
-        counterByCpu[cpu].atomicCounter.load(std::memory_order_relaxed) + 1,
+    PercpuCounter* counter = counterByCpu->forShard(sched_getcpu());
+    std::lock_guard<std::mutex> lg(counter->mu);
+    counter->atomicCounter.store(
+        counter->atomicCounter.load(std::memory_order_relaxed) + 1,
         std::memory_order_relaxed);
   }
 }
 
 void doIncrementsLocksCachedCpu(std::uint64_t numIncrements) {
   for (std::uint64_t i = 0; i < numIncrements;) {
-    int cpu = sched_getcpu();
+    PercpuCounter* counter = counterByCpu->forShard(sched_getcpu());
     for (int j = 0; j < 100 && i < numIncrements; ++i, ++j) {
-      std::lock_guard<std::mutex> lg(counterByCpu[cpu].mu);
-      counterByCpu[cpu].atomicCounter.store(
-          counterByCpu[cpu].atomicCounter.load(std::memory_order_relaxed) + 1,
+      std::lock_guard<std::mutex> lg(counter->mu);
+      counter->atomicCounter.store(
+          counter->atomicCounter.load(std::memory_order_relaxed) + 1,
           std::memory_order_relaxed);
     }
   }
@@ -270,7 +289,58 @@ void doIncrementsThreadLocal(std::uint64_t numIncrements) {
     std::uint64_t oldVal = counter;
     counter = oldVal + 1;
   }
-  counterByCpu[0].atomicCounter.fetch_add(counter);
+  counterByCpu->forShard(0)->atomicCounter.fetch_add(counter);
+}
+
+std::int64_t nowNs() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void doIncrementsRateLimiter(std::uint64_t numIncrements) {
+  std::uint64_t granted = 0;
+  for (std::uint64_t i = 0; i < numIncrements; ++i) {
+    if (rateLimiter->tryAcquire()) {
+      ++granted;
+    }
+  }
+  tokensGranted.fetch_add(granted);
+  counterByCpu->forShard(0)->atomicCounter.fetch_add(numIncrements);
+}
+
+bool contendedTryAcquire() {
+  std::int64_t tokens = contendedTokens.load();
+  while (tokens > 0) {
+    if (contendedTokens.compare_exchange_weak(tokens, tokens - 1)) {
+      return true;
+    }
+  }
+  std::int64_t now = nowNs();
+  std::int64_t last = contendedLastRefillNs.load();
+  std::int64_t accrued = static_cast<std::int64_t>(
+      (now - last) * (kRateLimitPerSecond / 1000000000.0));
+  if (accrued <= 0
+      || !contendedLastRefillNs.compare_exchange_strong(last, now)) {
+    return false;
+  }
+  // Keep one of the new tokens for ourselves.
+  tokens = contendedTokens.load();
+  std::int64_t refilled;
+  do {
+    refilled = std::min(tokens + accrued, kRateLimitBurst) - 1;
+  } while (!contendedTokens.compare_exchange_weak(tokens, refilled));
+  return true;
+}
+
+void doIncrementsContendedRateLimiter(std::uint64_t numIncrements) {
+  std::uint64_t granted = 0;
+  for (std::uint64_t i = 0; i < numIncrements; ++i) {
+    if (contendedTryAcquire()) {
+      ++granted;
+    }
+  }
+  tokensGranted.fetch_add(granted);
+  counterByCpu->forShard(0)->atomicCounter.fetch_add(numIncrements);
 }
 
 void printErrorIfNotEqual(std::uint64_t expected, std::uint64_t actual) {
@@ -295,9 +365,9 @@ void runTest(
     std::uint64_t numThreads,
     std::uint64_t numIncrements) {
   contendedCounter.store(0);
-  for (unsigned i = 0; i < counterByCpu.size(); ++i) {
-    counterByCpu[i].atomicCounter.store(0);
-    counterByCpu[i].rseqCounter.store(0);
+  for (int i = 0; i < counterByCpu->numShards(); ++i) {
+    counterByCpu->forShard(i)->atomicCounter.store(0);
+    counterByCpu->forShard(i)->rseqCounter.store(0);
   }
   void (*benchmarkThreadFunc)(std::uint64_t) =
       testType == kLongCriticalSection ? doIncrementsLongCriticalSection :
@@ -309,7 +379,17 @@ void runTest(
       testType == kLocks ? doIncrementsLocks :
       testType == kLocksCachedCpu ? doIncrementsLocksCachedCpu :
       testType == kThreadLocal ? doIncrementsThreadLocal :
+      testType == kRateLimiter ? doIncrementsRateLimiter :
+      testType == kContendedRateLimiter ? doIncrementsContendedRateLimiter :
       nullptr;
+  tokensGranted.store(0);
+  rateLimiter = nullptr;
+  if (testType == kRateLimiter) {
+    rateLimiter = new rseq::PerCpuRateLimiter(
+        kRateLimitPerSecond, kRateLimitBurst, kRateLimitBatch);
+  }
+  contendedTokens.store(kRateLimitBurst);
+  contendedLastRefillNs.store(nowNs());
   std::printf("===========================================================\n");
   std::printf("Benchmarking %s\n", testTypeString(testType));
   auto beginTime = std::chrono::high_resolution_clock::now();
@@ -326,8 +406,8 @@ void runTest(
   std::uint64_t expectedIncrements = numThreads * numIncrements;
   std::uint64_t actualIncrements = contendedCounter.load();
   for (std::uint64_t i = 0; i < rseq::internal::numCpus(); ++i) {
-    actualIncrements += counterByCpu[i].atomicCounter.load();
-    actualIncrements += counterByCpu[i].rseqCounter.load();
+    actualIncrements += counterByCpu->forShard(i)->atomicCounter.load();
+    actualIncrements += counterByCpu->forShard(i)->rseqCounter.load();
   }
   printErrorIfNotEqual(expectedIncrements, actualIncrements);
   std::chrono::nanoseconds duration = endTime - beginTime;
@@ -341,6 +421,15 @@ void runTest(
   std::printf("Single-CPU TSC ticks per increment: %f\n", myCycles);
   std::printf("Global TSC ticks per increment: %f\n",
       rseq::internal::numCpus() * myCycles);
+  if (testType == kRateLimiter || testType == kContendedRateLimiter) {
+    // The most the limiter should have let through in that time.
+    double limit = kRateLimitBurst + kRateLimitPerSecond * seconds;
+    std::uint64_t granted = tokensGranted.load();
+    std::printf("Tokens granted: %" PRIu64 "\n", granted);
+    std::printf("Tokens allowed: %.0f\n", limit);
+    std::printf("Granted / allowed: %f\n", granted / limit);
+  }
+  delete rateLimiter;
   std::printf("===========================================================\n");
 }
 
@@ -373,6 +462,14 @@ const char* usage = R"(Usage: %s benchmarks num_threads increments_per_thread
 
     threadLocal:          Threads increment thread-local counters, with no
                           synchronization.
+
+    rateLimiter:          Each increment is an attempt to take a token from a
+                          PerCpuRateLimiter (10M tokens/second, a burst of 100K,
+                          batches of 64). Also prints how many were granted
+                          against how many the limit allows.
+
+    contendedRateLimiter: As rateLimiter, but with the tokens in a single
+                          atomic counter.
 )";
 
 std::vector<TestType> parseBenchmarks(const char* benchmarks) {
@@ -386,7 +483,9 @@ std::vector<TestType> parseBenchmarks(const char* benchmarks) {
       kAtomicsCachedCpu,
       kLocks,
       kLocksCachedCpu,
-      kThreadLocal
+      kThreadLocal,
+      kRateLimiter,
+      kContendedRateLimiter
     };
   }
 
@@ -414,6 +513,8 @@ std::vector<TestType> parseBenchmarks(const char* benchmarks) {
       matches("locks") ? kLocks :
       matches("locksCachedCpu") ? kLocksCachedCpu :
       matches("threadLocal") ? kThreadLocal :
+      matches("rateLimiter") ? kRateLimiter :
+      matches("contendedRateLimiter") ? kContendedRateLimiter :
       kTestTypeEnd;
 
     if (testType == kTestTypeEnd) {
@@ -451,10 +552,7 @@ int main(int argc, char** argv) {
     std::exit(1);
   }
 
-  // PercpuCounter objects aren't moveable, so we construct a vector then swap
-  // it with the global one.
-  std::vector<PercpuCounter> p(rseq::internal::numCpus());
-  counterByCpu.swap(p);
+  counterByCpu = new rseq::PerCpu<PercpuCounter>;
 
   for (TestType benchmark : benchmarks) {
     runTest(benchmark, numThreads, numIncrements);
@@ -0,0 +1,122 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#include "rseq/Rseq.h"
+
+#include <atomic>
+#include <cstdint>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "rseq/PerCpuCounter.h"
+#include "rseq/internal/CpuLocal.h"
+#include "rseq/internal/NumCpus.h"
+#include "rseq/internal/ShardMode.h"
+#include "rseq/internal/SwitchToCpu.h"
+
+using namespace rseq::internal;
+
+// The mode is process-wide, and has to be chosen before anything else; this
+// test has to run first.
+TEST(ConcurrencyId, CanBeEnabled) {
+  EXPECT_TRUE(rseq::useConcurrencyIds());
+  EXPECT_TRUE(rseq::useConcurrencyIds());
+  EXPECT_EQ(0, rseq::begin());
+}
+
+TEST(ConcurrencyId, IdsGetReused) {
+  // Each of these threads runs alone, and releases its id when it dies; none
+  // of them should need anything past the first.
+  for (int i = 0; i < 10; ++i) {
+    std::thread t([i]() {
+      switchToCpu(i % numCpus());
+      EXPECT_EQ(0, rseq::begin());
+    });
+    t.join();
+  }
+}
+
+TEST(ConcurrencyId, IdsStayDense) {
+  // Only as many ids as threads ever get handed out, regardless of which cpus
+  // the threads run on.
+  const int kNumThreads = numCpus() < 4 ? numCpus() : 4;
+  std::atomic<int> maxId(0);
+  std::vector<std::thread> threads(kNumThreads);
+  for (int i = 0; i < kNumThreads; ++i) {
+    threads[i] = std::thread([&, i]() {
+      switchToCpu((numCpus() - 1 - i) % numCpus());
+      for (int j = 0; j < 1000; ++j) {
+        int id = rseq::begin();
+        int cur = maxId.load();
+        while (id > cur && !maxId.compare_exchange_weak(cur, id)) {
+        }
+      }
+    });
+  }
+  for (int i = 0; i < kNumThreads; ++i) {
+    threads[i].join();
+  }
+  EXPECT_GT(kNumThreads, maxId.load());
+}
+
+TEST(ConcurrencyId, IdsAreExclusive) {
+  const int kNumThreads = 4 * numCpus();
+  const int kIncrementsPerThread = 100000;
+  CpuLocal<rseq::Value<std::uint64_t>> counters;
+  for (int i = 0; i < numCpus(); ++i) {
+    counters.forCpu(i)->store(0);
+  }
+
+  std::vector<std::thread> threads(kNumThreads);
+  for (int i = 0; i < kNumThreads; ++i) {
+    threads[i] = std::thread([&, i]() {
+      switchToCpu(i % numCpus());
+      for (int j = 0; j < kIncrementsPerThread; ++j) {
+        while (true) {
+          int id = rseq::begin();
+          ASSERT_LE(0, id);
+          ASSERT_GT(numCpus(), id);
+          rseq::Value<std::uint64_t>* counter = counters.forCpu(id);
+          if (rseq::store(counter, counter->load() + 1)) {
+            break;
+          }
+        }
+      }
+    });
+  }
+  for (int i = 0; i < kNumThreads; ++i) {
+    threads[i].join();
+  }
+
+  rseq::fence();
+  std::uint64_t sum = 0;
+  for (int i = 0; i < numCpus(); ++i) {
+    sum += counters.forCpu(i)->load();
+  }
+  EXPECT_EQ(
+      static_cast<std::uint64_t>(kNumThreads) * kIncrementsPerThread, sum);
+}
+
+TEST(ConcurrencyId, ShardsHaveNoTopology) {
+  EXPECT_FALSE(shardsAreCpus());
+  for (int i = 0; i < numCpus(); ++i) {
+    EXPECT_EQ(-1, nodeForShard(i));
+    EXPECT_EQ(-1, llcForShard(i));
+  }
+  // So PerCpuCounter puts everything on node 0.
+  rseq::PerCpuCounter counter;
+  for (int i = 0; i < 1000; ++i) {
+    counter.add(1);
+  }
+  EXPECT_EQ(1000, counter.sumNode(0));
+  EXPECT_EQ(counter.read(), counter.readNode(0));
+  EXPECT_EQ(counter.errorBound(), counter.errorBoundForNode(0));
+}
@@ -0,0 +1,310 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <vector>
+
+#include "rseq/PerCpu.h"
+#include "rseq/Rseq.h"
+#include "rseq/internal/Mutex.h"
+#include "rseq/internal/ShardMode.h"
+
+namespace rseq {
+
+// A registry of parked worker threads, for thread pools that want a wakeup to
+// go to a worker whose caches are warm for the waker's cpu, without a global
+// idle list (and its lock).
+//
+// A worker going idle is pushed onto a stack for the cpu it's on, with rseq
+// stores. wakeOne() pops from the caller's cpu's stack; if that's empty, it
+// scans the other cpus, those sharing the caller's last-level cache first,
+// then those on its node, then the rest, popping remotely (with a heavy fence)
+// from the first nonempty stack it finds. Parked workers sleep on a futex.
+//
+// Going idle takes two steps, to avoid lost wakeups:
+//   idleWorkers.prepareToPark(&me);
+//   if (!anyWorkToDo()) {
+//     idleWorkers.park(&me);
+//   }
+// with the producer side doing
+//   addWork();
+//   idleWorkers.wakeOne();
+// wakeOne() returns right away when no worker is registered. Producers whose
+// addWork() is a seq_cst read-modify-write can skip even its fence with
+//   if (idleWorkers.numIdle() > 0) {
+//     idleWorkers.wakeOne();
+//   }
+// since prepareToPark() bumps the count with one before checking for work:
+// either the producer sees the count, or the worker sees the work.
+// If the worker does find work after prepareToPark(), it just goes and does
+// it; it stays registered, and a wakeOne() that picks it while it's busy is
+// wasted on it (it will come back for more work anyway). Its next
+// prepareToPark() then doesn't register it a second time.
+class IdleWorkers {
+ public:
+  // One per worker thread. It must outlive the IdleWorkers it's registered
+  // with (or at least stay alive until it's been woken).
+  class Worker {
+   public:
+    Worker() : wakeups_(0), inStack_(false), parkedAt_(0) {
+      next_.store(nullptr);
+    }
+    Worker(const Worker&) = delete;
+    Worker& operator=(const Worker&) = delete;
+
+   private:
+    friend class IdleWorkers;
+
+    rseq::Value<Worker*> next_;
+    // The futex word; bumped by every wakeup.
+    std::atomic<std::uint32_t> wakeups_;
+    // Set by the worker when it pushes itself, cleared by whoever pops it.
+    std::atomic<bool> inStack_;
+    // The value of wakeups_ as of prepareToPark(). Only used by the worker.
+    std::uint32_t parkedAt_;
+  };
+
+  IdleWorkers() : numIdle_(0) {
+    computeScanOrder();
+  }
+
+  IdleWorkers(const IdleWorkers&) = delete;
+  IdleWorkers& operator=(const IdleWorkers&) = delete;
+
+  // Registers worker as idle on the calling thread's cpu.
+  void prepareToPark(Worker* worker) {
+    worker->parkedAt_ = worker->wakeups_.load();
+    // If inStack_ is still set, whoever clears it bumps wakeups_ afterwards,
+    // so park() won't sleep through it.
+    if (!worker->inStack_.load()) {
+      worker->inStack_.store(true);
+      numIdle_.fetch_add(1);
+      push(worker);
+    }
+    // Orders the push before the caller's last check for work; pairs with
+    // the fence in wakeOne().
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+  }
+
+  // Sleeps until worker has been woken since its prepareToPark().
+  void park(Worker* worker) {
+    while (worker->wakeups_.load() == worker->parkedAt_) {
+      internal::mutex::futexWait(&worker->wakeups_, worker->parkedAt_);
+    }
+  }
+
+  // How many workers are registered. Counts a worker from just before it's
+  // pushed until just after it's popped.
+  int numIdle() const {
+    return numIdle_.load();
+  }
+
+  // Wakes the registered worker nearest the calling thread's cpu. Returns
+  // false if there wasn't one.
+  bool wakeOne() {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (numIdle_.load(std::memory_order_relaxed) == 0) {
+      return false;
+    }
+    Worker* worker = popLocal();
+    if (worker == nullptr) {
+      worker = popNearest();
+    }
+    if (worker == nullptr) {
+      return false;
+    }
+    wake(worker);
+    return true;
+  }
+
+  // Wakes every registered worker; returns how many there were.
+  int wakeAll() {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    int numWoken = 0;
+    for (int shard = 0; shard < stacks_.numShards(); ++shard) {
+      Worker* worker;
+      while ((worker = popRemote(shard)) != nullptr) {
+        wake(worker);
+        ++numWoken;
+      }
+    }
+    return numWoken;
+  }
+
+ private:
+  struct Stack {
+    rseq::Value<Worker*> top;
+  };
+
+  void push(Worker* worker) {
+    while (true) {
+      Stack* stack = stacks_.forShard(rseq::begin());
+      Worker* top = stack->top.load();
+      // Anyone who read worker's link while it was on some earlier stack
+      // fails their commit, since worker has been popped since.
+      worker->next_.store(top);
+      if (rseq::store(&stack->top, worker)) {
+        return;
+      }
+    }
+  }
+
+  Worker* popLocal() {
+    while (true) {
+      Stack* stack = stacks_.forShard(rseq::begin());
+      Worker* top = stack->top.load();
+      if (top == nullptr) {
+        return nullptr;
+      }
+      if (rseq::store(&stack->top, top->next_.load())) {
+        return top;
+      }
+    }
+  }
+
+  Worker* popRemote(int shard) {
+    // Don't pay for a remote rseq on stacks that look empty.
+    if (stacks_.forShard(shard)->top.load(std::memory_order_relaxed)
+        == nullptr) {
+      return nullptr;
+    }
+    Worker* result = nullptr;
+    stacks_.drain(shard, [&](Stack& stack) {
+      Worker* top = stack.top.load();
+      if (top == nullptr) {
+        return true;
+      }
+      if (!rseq::store(&stack.top, top->next_.load())) {
+        return false;
+      }
+      result = top;
+      return true;
+    });
+    return result;
+  }
+
+  // Where a shard sits in the scan order: its last-level cache and node, and
+  // the ranges of byLlc_ and byNode_ holding the shards that share them.
+  struct Place {
+    int llc;
+    int node;
+    int llcBegin;
+    int llcEnd;
+    int nodeBegin;
+    int nodeEnd;
+  };
+
+  // Sorts the shards by last-level cache and by node once, so that scans
+  // don't look up topology. In concurrency id mode, where shards have no
+  // topology, every shard lands in the same group.
+  void computeScanOrder() {
+    int numShards = stacks_.numShards();
+    places_.resize(numShards);
+    for (int shard = 0; shard < numShards; ++shard) {
+      places_[shard].llc = internal::llcForShard(shard);
+      places_[shard].node = internal::nodeForShard(shard);
+      byLlc_.push_back(shard);
+      byNode_.push_back(shard);
+    }
+    std::stable_sort(byLlc_.begin(), byLlc_.end(), [this](int a, int b) {
+      return places_[a].llc < places_[b].llc;
+    });
+    std::stable_sort(byNode_.begin(), byNode_.end(), [this](int a, int b) {
+      return places_[a].node < places_[b].node;
+    });
+    for (int begin = 0, end; begin < numShards; begin = end) {
+      int llc = places_[byLlc_[begin]].llc;
+      for (end = begin; end < numShards && places_[byLlc_[end]].llc == llc;
+           ++end) {
+      }
+      for (int i = begin; i < end; ++i) {
+        places_[byLlc_[i]].llcBegin = begin;
+        places_[byLlc_[i]].llcEnd = end;
+      }
+    }
+    for (int begin = 0, end; begin < numShards; begin = end) {
+      int node = places_[byNode_[begin]].node;
+      for (end = begin; end < numShards && places_[byNode_[end]].node == node;
+           ++end) {
+      }
+      for (int i = begin; i < end; ++i) {
+        places_[byNode_[i]].nodeBegin = begin;
+        places_[byNode_[i]].nodeEnd = end;
+      }
+    }
+  }
+
+  // Pops from the first nonempty stack among shards[begin, end) that
+  // inPass(place) accepts. The range always holds self; starting just after
+  // it spreads different shards' scans out.
+  template <typename Pred>
+  Worker* popFirst(
+      const std::vector<int>& shards, int begin, int end, int self,
+      Pred inPass) {
+    int size = end - begin;
+    int start = static_cast<int>(
+        std::find(shards.begin() + begin, shards.begin() + end, self)
+        - shards.begin() - begin);
+    for (int i = 1; i <= size; ++i) {
+      int shard = shards[begin + (start + i) % size];
+      if (shard == self || !inPass(places_[shard])) {
+        continue;
+      }
+      Worker* worker = popRemote(shard);
+      if (worker != nullptr) {
+        return worker;
+      }
+    }
+    return nullptr;
+  }
+
+  // Scans outwards from the calling thread's cpu: same last-level cache, then
+  // same node, then anywhere.
+  Worker* popNearest() {
+    int self = rseq::begin();
+    const Place& here = places_[self];
+    Worker* worker = popFirst(
+        byLlc_, here.llcBegin, here.llcEnd, self,
+        [](const Place&) { return true; });
+    if (worker == nullptr) {
+      worker = popFirst(
+          byNode_, here.nodeBegin, here.nodeEnd, self,
+          [&](const Place& there) { return there.llc != here.llc; });
+    }
+    if (worker == nullptr) {
+      worker = popFirst(
+          byNode_, 0, static_cast<int>(byNode_.size()), self,
+          [&](const Place& there) {
+            return there.llc != here.llc && there.node != here.node;
+          });
+    }
+    return worker;
+  }
+
+  void wake(Worker* worker) {
+    numIdle_.fetch_sub(1);
+    worker->inStack_.store(false);
+    worker->wakeups_.fetch_add(1);
+    internal::mutex::futexWake(&worker->wakeups_, 1);
+  }
+
+  PerCpu<Stack> stacks_;
+  std::atomic<int> numIdle_;
+  // Indexed by shard.
+  std::vector<Place> places_;
+  // Every shard, grouped by last-level cache and by node respectively.
+  std::vector<int> byLlc_;
+  std::vector<int> byNode_;
+};
+
+} // namespace rseq
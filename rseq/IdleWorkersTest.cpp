@@ -0,0 +1,139 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#include "rseq/IdleWorkers.h"
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "rseq/internal/NumCpus.h"
+#include "rseq/internal/SwitchToCpu.h"
+
+using namespace rseq::internal;
+
+TEST(IdleWorkers, StartsEmpty) {
+  rseq::IdleWorkers idleWorkers;
+  EXPECT_EQ(0, idleWorkers.numIdle());
+  EXPECT_FALSE(idleWorkers.wakeOne());
+  EXPECT_EQ(0, idleWorkers.wakeAll());
+}
+
+TEST(IdleWorkers, ParksUntilWoken) {
+  rseq::IdleWorkers idleWorkers;
+  rseq::IdleWorkers::Worker worker;
+  std::atomic<bool> woken(false);
+  std::thread thread([&]() {
+    idleWorkers.prepareToPark(&worker);
+    idleWorkers.park(&worker);
+    woken.store(true);
+  });
+  while (!idleWorkers.wakeOne()) {
+    std::this_thread::yield();
+  }
+  thread.join();
+  EXPECT_TRUE(woken.load());
+  EXPECT_FALSE(idleWorkers.wakeOne());
+}
+
+TEST(IdleWorkers, WakeupBeforeParkIsntLost) {
+  rseq::IdleWorkers idleWorkers;
+  rseq::IdleWorkers::Worker worker;
+  idleWorkers.prepareToPark(&worker);
+  EXPECT_TRUE(idleWorkers.wakeOne());
+  // Returns immediately.
+  idleWorkers.park(&worker);
+}
+
+TEST(IdleWorkers, RegistersOnlyOnce) {
+  rseq::IdleWorkers idleWorkers;
+  rseq::IdleWorkers::Worker worker;
+  // As if the worker found more work each time, and didn't park.
+  idleWorkers.prepareToPark(&worker);
+  idleWorkers.prepareToPark(&worker);
+  idleWorkers.prepareToPark(&worker);
+  EXPECT_EQ(1, idleWorkers.numIdle());
+  EXPECT_TRUE(idleWorkers.wakeOne());
+  EXPECT_EQ(0, idleWorkers.numIdle());
+  EXPECT_FALSE(idleWorkers.wakeOne());
+  idleWorkers.park(&worker);
+}
+
+TEST(IdleWorkers, WakesLocalWorkerFirst) {
+  if (numCpus() < 2) {
+    return;
+  }
+  rseq::IdleWorkers idleWorkers;
+  rseq::IdleWorkers::Worker workers[2];
+  std::atomic<int> numRegistered(0);
+  std::atomic<bool> woken[2];
+  std::vector<std::thread> threads;
+  for (int i = 0; i < 2; ++i) {
+    woken[i].store(false);
+    threads.emplace_back([&, i]() {
+      switchToCpu(i);
+      idleWorkers.prepareToPark(&workers[i]);
+      ++numRegistered;
+      idleWorkers.park(&workers[i]);
+      woken[i].store(true);
+    });
+  }
+  while (numRegistered.load() < 2) {
+    std::this_thread::yield();
+  }
+  switchToCpu(1);
+  EXPECT_TRUE(idleWorkers.wakeOne());
+  threads[1].join();
+  EXPECT_TRUE(woken[1].load());
+  std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  EXPECT_FALSE(woken[0].load());
+
+  EXPECT_EQ(1, idleWorkers.wakeAll());
+  threads[0].join();
+  EXPECT_TRUE(woken[0].load());
+}
+
+TEST(IdleWorkers, ConcurrentParkAndWake) {
+  const int kNumThreads = 2 * numCpus();
+  const int kParksPerThread = 1000;
+  rseq::IdleWorkers idleWorkers;
+  std::vector<rseq::IdleWorkers::Worker> workers(kNumThreads);
+  std::atomic<int> numDone(0);
+  std::vector<std::thread> threads;
+  for (int i = 0; i < kNumThreads; ++i) {
+    threads.emplace_back([&, i]() {
+      switchToCpu(i % numCpus());
+      for (int j = 0; j < kParksPerThread; ++j) {
+        idleWorkers.prepareToPark(&workers[i]);
+        idleWorkers.park(&workers[i]);
+      }
+      ++numDone;
+    });
+  }
+  std::vector<std::thread> wakers;
+  for (int i = 0; i < numCpus(); ++i) {
+    wakers.emplace_back([&, i]() {
+      switchToCpu(i);
+      while (numDone.load() < kNumThreads) {
+        if (!idleWorkers.wakeOne()) {
+          std::this_thread::yield();
+        }
+      }
+    });
+  }
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+  for (std::thread& waker : wakers) {
+    waker.join();
+  }
+}
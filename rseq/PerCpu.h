@@ -0,0 +1,87 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#pragma once
+
+#include "rseq/Rseq.h"
+#include "rseq/internal/CpuLocal.h"
+#include "rseq/internal/NumCpus.h"
+
+namespace rseq {
+
+// One T per shard, each on its own cacheline(s), placed on the NUMA node of
+// the shard's cpu. Shards are indexed by the return value of rseq::begin().
+//
+// Elements are default-constructed when the PerCpu is, and destroyed with it.
+// Their memory comes zeroed from the OS, so a T made of rseq::Values starts out
+// all zeroes without anything being stored to it; relying on that rather than
+// initializing every shard leaves the pages of shards that are never used
+// (say, those of possible but offline cpus) uncommitted.
+// Access to a shard's mutable state should go through rseq::load and
+// rseq::store (i.e. T should be made of rseq::Values, or of data only reached
+// through them), within an rseq on that shard; withLocal() and drain() set that
+// up. Getting a shard is an index off of a base pointer, as with a plain array.
+template <typename T>
+class PerCpu {
+ public:
+  PerCpu() = default;
+  PerCpu(const PerCpu&) = delete;
+  PerCpu& operator=(const PerCpu&) = delete;
+
+  // Shard indices are in [0, numShards()).
+  int numShards() const {
+    return internal::numCpus();
+  }
+
+  T* forShard(int shard) {
+    return shards_.forCpu(shard);
+  }
+
+  // Calls f(T&) with the calling thread's shard, inside an rseq on that shard,
+  // until it returns true. f should return the result of the rseq::store that
+  // commits its changes (or true, if it decides there's nothing to do). It's
+  // retried from scratch if the rseq ends before then, possibly with a
+  // different shard.
+  template <typename Func>
+  void withLocal(Func&& f) {
+    while (!f(*shards_.forCpu(rseq::begin()))) {
+    }
+  }
+
+  // Calls f(shard, T&) for every shard, outside of any rseq. The view of each
+  // shard is only as consistent as plain loads make it; call rseq::fence()
+  // first to see everything stored by rseqs that ended before the call.
+  template <typename Func>
+  void forEach(Func&& f) {
+    for (int i = 0; i < numShards(); ++i) {
+      f(i, *shards_.forCpu(i));
+    }
+  }
+
+  // Like withLocal(), but on the given shard, which is taken away from whatever
+  // thread is using it (see rseq::beginRemote()). f sees every store committed
+  // on the shard before the call, and can modify the shard the same way an
+  // rseq on its own cpu could. Slow: each attempt does a heavy fence.
+  template <typename Func>
+  void drain(int shard, Func&& f) {
+    while (true) {
+      rseq::beginRemote(shard);
+      if (f(*shards_.forCpu(shard))) {
+        break;
+      }
+    }
+    // Let the shard's own cpu have it back without having to evict us.
+    rseq::end();
+  }
+
+ private:
+  internal::CpuLocal<T> shards_;
+};
+
+} // namespace rseq
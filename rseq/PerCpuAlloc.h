@@ -0,0 +1,72 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#pragma once
+
+#include <type_traits>
+
+#include "rseq/internal/Errors.h"
+#include "rseq/internal/PerCpuAllocator.h"
+#include "rseq/rseq_c.h"
+
+namespace rseq {
+
+// A handle to a per-cpu T, from the same dense allocator as rseq_percpu_alloc.
+// Unlike PerCpu<T>, objects aren't padded out to a cacheline each: many small
+// per-cpu objects pack into the same lines of each cpu's chunk (a cpu only ever
+// writes to its own chunk, so this doesn't cause false sharing).
+//
+// Acts like a raw pointer: copyable, and freed explicitly. The T's start out
+// zero-filled, and are never constructed or destroyed, so T must be a type for
+// which that makes sense (e.g. rseq::Value<int>, or a struct of them).
+template <typename T>
+class PerCpuPtr {
+ public:
+  static_assert(std::is_trivially_destructible<T>::value,
+      "PerCpuPtr objects are never destroyed");
+
+  PerCpuPtr() : handle_(0) {}
+
+  // Returns a null PerCpuPtr if the per-cpu area is exhausted.
+  static PerCpuPtr allocate() {
+    internal::errors::ThrowOnError thrower;
+    return PerCpuPtr(
+        internal::per_cpu_allocator::allocate(sizeof(T), alignof(T)));
+  }
+
+  static PerCpuPtr fromHandle(rseq_percpu_t handle) {
+    return PerCpuPtr(handle);
+  }
+
+  // No thread may be using any shard's copy.
+  void free() {
+    internal::errors::ThrowOnError thrower;
+    internal::per_cpu_allocator::free(handle_);
+    handle_ = 0;
+  }
+
+  T* forShard(int shard) const {
+    return static_cast<T*>(rseq_percpu_ptr(handle_, shard));
+  }
+
+  rseq_percpu_t handle() const {
+    return handle_;
+  }
+
+  explicit operator bool() const {
+    return handle_ != 0;
+  }
+
+ private:
+  explicit PerCpuPtr(rseq_percpu_t handle) : handle_(handle) {}
+
+  rseq_percpu_t handle_;
+};
+
+} // namespace rseq
@@ -0,0 +1,78 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#include "rseq/PerCpuAlloc.h"
+
+#include <cstdint>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "rseq/Rseq.h"
+#include "rseq/internal/NumCpus.h"
+#include "rseq/internal/SwitchToCpu.h"
+
+using namespace rseq::internal;
+
+TEST(PerCpuAlloc, PacksDensely) {
+  std::vector<rseq::PerCpuPtr<rseq::Value<std::uint64_t>>> counters(1000);
+  for (auto& counter : counters) {
+    counter = rseq::PerCpuPtr<rseq::Value<std::uint64_t>>::allocate();
+    ASSERT_TRUE(static_cast<bool>(counter));
+  }
+  // A thousand counters in a few pages per cpu, rather than a thousand
+  // cachelines.
+  char* lowest = reinterpret_cast<char*>(counters[0].forShard(0));
+  char* highest = lowest;
+  for (auto& counter : counters) {
+    char* addr = reinterpret_cast<char*>(counter.forShard(0));
+    lowest = addr < lowest ? addr : lowest;
+    highest = addr > highest ? addr : highest;
+  }
+  EXPECT_GT(3 * 1000 * sizeof(std::uint64_t), highest - lowest);
+  for (auto& counter : counters) {
+    counter.free();
+    EXPECT_FALSE(static_cast<bool>(counter));
+  }
+}
+
+TEST(PerCpuAlloc, CountsExactly) {
+  const int kNumThreads = 4 * numCpus();
+  const int kIncrementsPerThread = 100000;
+  auto counter = rseq::PerCpuPtr<rseq::Value<std::uint64_t>>::allocate();
+  ASSERT_TRUE(static_cast<bool>(counter));
+
+  std::vector<std::thread> threads(kNumThreads);
+  for (int i = 0; i < kNumThreads; ++i) {
+    threads[i] = std::thread([&, i]() {
+      switchToCpu(i % numCpus());
+      for (int j = 0; j < kIncrementsPerThread; ++j) {
+        while (true) {
+          rseq::Value<std::uint64_t>* shard = counter.forShard(rseq::begin());
+          if (rseq::store(shard, shard->load() + 1)) {
+            break;
+          }
+        }
+      }
+    });
+  }
+  for (int i = 0; i < kNumThreads; ++i) {
+    threads[i].join();
+  }
+
+  rseq::fence();
+  std::uint64_t sum = 0;
+  for (int i = 0; i < numCpus(); ++i) {
+    sum += counter.forShard(i)->load();
+  }
+  EXPECT_EQ(
+      static_cast<std::uint64_t>(kNumThreads) * kIncrementsPerThread, sum);
+  counter.free();
+}
@@ -0,0 +1,256 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+#include "rseq/PerCpu.h"
+#include "rseq/Rseq.h"
+#include "rseq/internal/Errors.h"
+#include "rseq/internal/Likely.h"
+#include "rseq/internal/Mutex.h"
+#include "rseq/internal/OsMem.h"
+#include "rseq/internal/ShardMode.h"
+
+namespace rseq {
+
+// A bump-pointer arena for short-lived (e.g. request-scoped) allocations, with
+// one bump pointer per shard. There's no per-object free; memory is released
+// in bulk, an epoch at a time.
+//
+// Every allocation belongs to the epoch that was current when it was made.
+// advanceEpoch() starts a new epoch, and release(e) gives back the memory of
+// every epoch up to and including e, once the caller knows nothing allocated
+// in those epochs is still in use (e.g. all the requests that began before
+// the advance have finished).
+//
+// allocate() is a load of the shard's bump pointer and limit, an add and a
+// compare, and an rseq store of the new bump pointer. When a shard's chunk
+// runs out, it gets a new one: a released chunk if there is one (so that
+// steady-state allocation doesn't keep faulting in fresh pages), otherwise a
+// new mapping on the node of the shard's cpu (if shards are cpus; see
+// rseq::useConcurrencyIds()). Released chunks stay mapped until trim() is
+// called, so the footprint tracks the peak amount of unreleased memory.
+// Allocations bigger than an eighth of a chunk get a mapping of their own,
+// which is unmapped when released.
+class PerCpuArena {
+ public:
+  // Every allocation is aligned to this.
+  static constexpr std::size_t kAlignment = 16;
+
+  explicit PerCpuArena(std::size_t chunkSize = 64 * 1024)
+      : chunkSize_(roundUp(chunkSize, kPageSize)),
+        epoch_(0),
+        chunks_(nullptr),
+        freeChunks_(nullptr) {
+    mu_.init();
+  }
+
+  PerCpuArena(const PerCpuArena&) = delete;
+  PerCpuArena& operator=(const PerCpuArena&) = delete;
+
+  // Frees everything, regardless of epoch.
+  ~PerCpuArena() {
+    unmapChunks(chunks_);
+    unmapChunks(freeChunks_);
+  }
+
+  // Returns memory valid until the current epoch is released.
+  void* allocate(std::size_t bytes) {
+    bytes = roundUp(bytes == 0 ? 1 : bytes, kAlignment);
+    if (RSEQ_UNLIKELY(bytes > maxChunkAllocation())) {
+      return allocateLarge(bytes);
+    }
+    while (true) {
+      Shard* shard = shards_.forShard(rseq::begin());
+      char* next = shard->next.load();
+      char* end = shard->end.load();
+      // A closed shard has a null end, which makes this negative.
+      std::intptr_t room = reinterpret_cast<std::intptr_t>(end)
+          - reinterpret_cast<std::intptr_t>(next);
+      if (RSEQ_LIKELY(room >= static_cast<std::intptr_t>(bytes))) {
+        if (rseq::store(&shard->next, next + bytes)) {
+          return next;
+        }
+      } else {
+        refill();
+      }
+    }
+  }
+
+  std::uint64_t currentEpoch() const {
+    return epoch_.load(std::memory_order_acquire);
+  }
+
+  // Starts a new epoch; returns the one that just ended. Slow: closes every
+  // shard's chunk with a remote rseq.
+  std::uint64_t advanceEpoch() {
+    internal::mutex::LockGuard<internal::mutex::Mutex> lg(mu_);
+    epoch_.store(epoch_.load() + 1);
+    shards_.forEach([&](int shard, Shard& current) {
+      // Only refill() opens a shard, and it holds mu_ to do so.
+      if (current.end.load() == nullptr) {
+        return;
+      }
+      shards_.drain(shard, [](Shard& target) {
+        return rseq::store(&target.end, nullptr);
+      });
+    });
+    return epoch_.load() - 1;
+  }
+
+  // Frees the memory of every epoch <= epoch, which must have ended.
+  void release(std::uint64_t epoch) {
+    Chunk* toUnmap = nullptr;
+    {
+      internal::mutex::LockGuard<internal::mutex::Mutex> lg(mu_);
+      if (epoch >= epoch_.load()) {
+        internal::errors::ThrowOnError thrower;
+        internal::errors::fatalError("Releasing an epoch that hasn't ended.\n");
+      }
+      // chunks_ is sorted newest first.
+      Chunk** link = &chunks_;
+      while (*link != nullptr && (*link)->epoch > epoch) {
+        link = &(*link)->next;
+      }
+      Chunk* released = *link;
+      *link = nullptr;
+      while (released != nullptr) {
+        Chunk* next = released->next;
+        if (released->bytes == chunkSize_) {
+          released->next = freeChunks_;
+          freeChunks_ = released;
+        } else {
+          released->next = toUnmap;
+          toUnmap = released;
+        }
+        released = next;
+      }
+    }
+    unmapChunks(toUnmap);
+  }
+
+  // Unmaps the released chunks kept for reuse.
+  void trim() {
+    Chunk* toUnmap;
+    {
+      internal::mutex::LockGuard<internal::mutex::Mutex> lg(mu_);
+      toUnmap = freeChunks_;
+      freeChunks_ = nullptr;
+    }
+    unmapChunks(toUnmap);
+  }
+
+ private:
+  static constexpr std::size_t kPageSize = 4096;
+
+  struct Shard {
+    rseq::Value<char*> next;
+    rseq::Value<char*> end;
+  };
+
+  // Lives at the start of each mapping.
+  struct Chunk {
+    Chunk* next;
+    std::size_t bytes;
+    std::uint64_t epoch;
+  };
+
+  static constexpr std::size_t kChunkHeaderSize =
+      (sizeof(Chunk) + kAlignment - 1) & ~(kAlignment - 1);
+
+  static std::size_t roundUp(std::size_t n, std::size_t multiple) {
+    return (n + multiple - 1) & ~(multiple - 1);
+  }
+
+  Chunk* mapChunk(std::size_t bytes, int node) {
+    internal::errors::ThrowOnError thrower;
+    void* mem = internal::os_mem::allocate(bytes);
+    if (node >= 0) {
+      internal::os_mem::bindToNode(mem, bytes, node);
+    }
+    Chunk* chunk = static_cast<Chunk*>(mem);
+    chunk->bytes = bytes;
+    return chunk;
+  }
+
+  // Must hold mu_.
+  void addChunkLocked(Chunk* chunk) {
+    chunk->epoch = epoch_.load();
+    chunk->next = chunks_;
+    chunks_ = chunk;
+  }
+
+  std::size_t maxChunkAllocation() const {
+    return (chunkSize_ - kChunkHeaderSize) / 8;
+  }
+
+  // Gives the calling thread's shard a fresh chunk.
+  void refill() {
+    Chunk* chunk;
+    {
+      internal::mutex::LockGuard<internal::mutex::Mutex> lg(mu_);
+      chunk = freeChunks_;
+      if (chunk != nullptr) {
+        freeChunks_ = chunk->next;
+      }
+    }
+    if (chunk == nullptr) {
+      chunk = mapChunk(chunkSize_, internal::nodeForShard(rseq::begin()));
+    }
+    char* begin = reinterpret_cast<char*>(chunk) + kChunkHeaderSize;
+    char* end = reinterpret_cast<char*>(chunk) + chunkSize_;
+    // Holding the lock keeps advanceEpoch() from closing the shards between
+    // our recording the chunk's epoch and installing it.
+    internal::mutex::LockGuard<internal::mutex::Mutex> lg(mu_);
+    addChunkLocked(chunk);
+    while (true) {
+      Shard* target = shards_.forShard(rseq::begin());
+      // Close the shard first, so that a failure partway through never leaves
+      // it with the limit of one chunk and the bump pointer of another.
+      if (rseq::store(&target->end, nullptr)
+          && rseq::store(&target->next, begin)
+          && rseq::store(&target->end, end)) {
+        return;
+      }
+    }
+  }
+
+  void* allocateLarge(std::size_t bytes) {
+    Chunk* chunk = mapChunk(roundUp(bytes + kChunkHeaderSize, kPageSize), -1);
+    internal::mutex::LockGuard<internal::mutex::Mutex> lg(mu_);
+    addChunkLocked(chunk);
+    return reinterpret_cast<char*>(chunk) + kChunkHeaderSize;
+  }
+
+  void unmapChunks(Chunk* chunk) {
+    internal::errors::ThrowOnError thrower;
+    while (chunk != nullptr) {
+      Chunk* next = chunk->next;
+      internal::os_mem::free(chunk, chunk->bytes);
+      chunk = next;
+    }
+  }
+
+  std::size_t chunkSize_;
+  PerCpu<Shard> shards_;
+
+  internal::mutex::Mutex mu_;
+  // Only modified with mu_ held, but readable without it.
+  std::atomic<std::uint64_t> epoch_;
+  // Chunks holding memory of unreleased epochs, newest first.
+  Chunk* chunks_;
+  // Released chunks of the standard size, for reuse.
+  Chunk* freeChunks_;
+};
+
+} // namespace rseq
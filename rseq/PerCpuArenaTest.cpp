@@ -0,0 +1,120 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#include "rseq/PerCpuArena.h"
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "rseq/internal/NumCpus.h"
+#include "rseq/internal/SwitchToCpu.h"
+
+using namespace rseq::internal;
+
+TEST(PerCpuArena, AllocatesAlignedDisjointMemory) {
+  rseq::PerCpuArena arena(4096);
+  std::vector<std::pair<unsigned char*, std::size_t>> allocs;
+  for (int i = 0; i < 10000; ++i) {
+    // Mostly small, with the occasional one too big for a chunk.
+    std::size_t size = i % 100 == 0 ? 10000 : i % 300;
+    unsigned char* ptr = static_cast<unsigned char*>(arena.allocate(size));
+    ASSERT_NE(nullptr, ptr);
+    std::uintptr_t address = reinterpret_cast<std::uintptr_t>(ptr);
+    EXPECT_EQ(0, address % rseq::PerCpuArena::kAlignment);
+    std::memset(ptr, i % 256, size);
+    allocs.emplace_back(ptr, size);
+  }
+  for (std::size_t i = 0; i < allocs.size(); ++i) {
+    for (std::size_t j = 0; j < allocs[i].second; ++j) {
+      ASSERT_EQ(i % 256, allocs[i].first[j]);
+    }
+  }
+}
+
+TEST(PerCpuArena, BumpsWithinAChunk) {
+  switchToCpu(0);
+  rseq::PerCpuArena arena;
+  char* first = static_cast<char*>(arena.allocate(16));
+  char* second = static_cast<char*>(arena.allocate(16));
+  EXPECT_EQ(first + 16, second);
+}
+
+TEST(PerCpuArena, AdvancesAndReleasesEpochs) {
+  switchToCpu(0);
+  rseq::PerCpuArena arena(4096);
+  EXPECT_EQ(0, arena.currentEpoch());
+  char* old = static_cast<char*>(arena.allocate(16));
+  std::memset(old, 1, 16);
+
+  EXPECT_EQ(0, arena.advanceEpoch());
+  EXPECT_EQ(1, arena.currentEpoch());
+  // The shard was closed, so this comes from a chunk of the new epoch.
+  char* cur = static_cast<char*>(arena.allocate(16));
+  EXPECT_NE(old + 16, cur);
+  std::memset(cur, 2, 16);
+
+  arena.release(0);
+  // The new epoch's memory is still there.
+  for (int i = 0; i < 16; ++i) {
+    EXPECT_EQ(2, cur[i]);
+  }
+  char* next = static_cast<char*>(arena.allocate(16));
+  EXPECT_EQ(cur + 16, next);
+
+  // The released chunk gets reused, unless it's been trimmed.
+  arena.advanceEpoch();
+  EXPECT_EQ(old, arena.allocate(16));
+  arena.advanceEpoch();
+  arena.release(2);
+  arena.trim();
+  arena.advanceEpoch();
+  char* fresh = static_cast<char*>(arena.allocate(16));
+  std::memset(fresh, 3, 16);
+}
+
+TEST(PerCpuArena, ConcurrentAllocationsAndEpochs) {
+  const int kNumThreads = 4 * numCpus();
+  const int kAllocsPerThread = 100000;
+  rseq::PerCpuArena arena(4096);
+  std::atomic<bool> done(false);
+
+  std::thread advancer([&]() {
+    while (!done.load()) {
+      arena.advanceEpoch();
+      std::this_thread::yield();
+    }
+  });
+
+  std::vector<std::thread> threads(kNumThreads);
+  for (int i = 0; i < kNumThreads; ++i) {
+    threads[i] = std::thread([&, i]() {
+      switchToCpu(i % numCpus());
+      std::vector<std::uint64_t*> recent(16);
+      for (int j = 0; j < kAllocsPerThread; ++j) {
+        std::uint64_t*& slot = recent[j % recent.size()];
+        if (slot != nullptr) {
+          // Nobody else got handed our memory.
+          ASSERT_EQ(static_cast<std::uint64_t>(i), slot[0]);
+        }
+        slot = static_cast<std::uint64_t*>(arena.allocate(16 + j % 64));
+        slot[0] = i;
+      }
+    });
+  }
+  for (int i = 0; i < kNumThreads; ++i) {
+    threads[i].join();
+  }
+  done.store(true);
+  advancer.join();
+}
@@ -0,0 +1,177 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <type_traits>
+
+#include "rseq/Rseq.h"
+#include "rseq/internal/CachelinePadded.h"
+#include "rseq/internal/NumCpus.h"
+#include "rseq/internal/OsMem.h"
+
+namespace rseq {
+
+// A fixed-size array of numeric values, each of which has a per-cpu shard.
+//
+// CpuLocal<T[N]> would give each cpu its own contiguous copy of the array,
+// which makes summing one element across cpus a strided gather. Putting each
+// element's shards next to each other instead would make the writes of
+// different cpus false-share. We split the difference: the array is cut into
+// blocks of one cacheline's worth of elements, and each block gets one
+// cacheline per cpu, with the cpus' lines for a block laid out contiguously:
+//
+//   [block 0: cpu 0 line][block 0: cpu 1 line]...[block 1: cpu 0 line]...
+//
+// A cpu's writes only ever touch its own lines, and reducing a block across
+// cpus is a run of whole-line, lane-wise operations over contiguous memory.
+// The reductions are written as fixed-width loops over a line's lanes, which
+// the compiler turns into SSE / AVX2 / AVX-512 code (depending on -march)
+// without needing any architecture-specific code here.
+//
+// The reductions read shards with relaxed atomic loads (which compile to plain
+// moves), copying each line into a local T array before combining it, so it's
+// the combining that vectorizes. They're not linearizable with respect to
+// concurrent writes (call rseq::fence() first to make every write that
+// completed before the call visible).
+template <typename T>
+class PerCpuArray {
+ public:
+  // rseq stores are always 8 bytes wide; narrower elements would have their
+  // neighbors clobbered.
+  static_assert(sizeof(T) == 8, "PerCpuArray elements must be 8 bytes");
+  static_assert(std::is_arithmetic<T>::value,
+      "PerCpuArray elements must be numeric");
+
+  constexpr static std::size_t kLanes = internal::kCachelineSize / sizeof(T);
+
+  explicit PerCpuArray(std::size_t size)
+      : size_(size),
+        numBlocks_((size + kLanes - 1) / kLanes),
+        numCpus_(internal::numCpus()) {
+    // os_mem memory is zeroed, and Value<T> is trivially constructible.
+    elements_ = static_cast<Value<T>*>(internal::os_mem::allocate(bytes()));
+  }
+
+  ~PerCpuArray() {
+    internal::os_mem::free(elements_, bytes());
+  }
+
+  PerCpuArray(const PerCpuArray&) = delete;
+  PerCpuArray& operator=(const PerCpuArray&) = delete;
+
+  std::size_t size() const {
+    return size_;
+  }
+
+  // The given cpu's shard of element index. Suitable for use with rseq::load
+  // and rseq::store.
+  Value<T>* forCpu(int cpu, std::size_t index) {
+    return &elements_[
+        (index / kLanes * numCpus_ + cpu) * kLanes + index % kLanes];
+  }
+
+  // Adds delta to the calling cpu's shard of element index.
+  void add(std::size_t index, T delta) {
+    while (true) {
+      int cpu = rseq::begin();
+      Value<T>* shard = forCpu(cpu, index);
+      if (rseq::store(shard, shard->load() + delta)) {
+        return;
+      }
+    }
+  }
+
+  // Reductions of a single element across all cpus.
+  T sum(std::size_t index) {
+    return reduce(index, [](T a, T b) { return a + b; });
+  }
+
+  T min(std::size_t index) {
+    return reduce(index, [](T a, T b) { return b < a ? b : a; });
+  }
+
+  T max(std::size_t index) {
+    return reduce(index, [](T a, T b) { return a < b ? b : a; });
+  }
+
+  // Reductions of every element across all cpus. out must have room for size()
+  // elements.
+  void sumAll(T* out) {
+    reduceAll(out, [](T a, T b) { return a + b; });
+  }
+
+  void minAll(T* out) {
+    reduceAll(out, [](T a, T b) { return b < a ? b : a; });
+  }
+
+  void maxAll(T* out) {
+    reduceAll(out, [](T a, T b) { return a < b ? b : a; });
+  }
+
+  // Reductions with an arbitrary op(T, T) -> T, which should be associative
+  // and commutative. Keep op branch-free to let the lane-wise loops vectorize.
+  template <typename Op>
+  T reduce(std::size_t index, Op op) {
+    const Value<T>* shard = blockLine(index / kLanes, 0) + index % kLanes;
+    T result = shard[0].load(std::memory_order_relaxed);
+    for (int cpu = 1; cpu < numCpus_; ++cpu) {
+      result = op(result, shard[cpu * kLanes].load(std::memory_order_relaxed));
+    }
+    return result;
+  }
+
+  template <typename Op>
+  void reduceAll(T* out, Op op) {
+    for (std::size_t block = 0; block < numBlocks_; ++block) {
+      T acc[kLanes];
+      loadLine(blockLine(block, 0), acc);
+      for (int cpu = 1; cpu < numCpus_; ++cpu) {
+        T line[kLanes];
+        loadLine(blockLine(block, cpu), line);
+        for (std::size_t lane = 0; lane < kLanes; ++lane) {
+          acc[lane] = op(acc[lane], line[lane]);
+        }
+      }
+      std::size_t base = block * kLanes;
+      std::size_t lanesUsed = size_ - base < kLanes ? size_ - base : kLanes;
+      for (std::size_t lane = 0; lane < lanesUsed; ++lane) {
+        out[base + lane] = acc[lane];
+      }
+    }
+  }
+
+ private:
+  std::size_t bytes() const {
+    return numBlocks_ * numCpus_ * internal::kCachelineSize;
+  }
+
+  // The kLanes shards of a block that belong to cpu.
+  const Value<T>* blockLine(std::size_t block, int cpu) const {
+    return &elements_[(block * numCpus_ + cpu) * kLanes];
+  }
+
+  static void loadLine(const Value<T>* line, T* out) {
+    for (std::size_t lane = 0; lane < kLanes; ++lane) {
+      out[lane] = line[lane].load(std::memory_order_relaxed);
+    }
+  }
+
+  std::size_t size_;
+  std::size_t numBlocks_;
+  int numCpus_;
+  Value<T>* elements_;
+};
+
+template <typename T>
+constexpr std::size_t PerCpuArray<T>::kLanes;
+
+} // namespace rseq
@@ -0,0 +1,109 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#include "rseq/PerCpuArray.h"
+
+#include <cstdint>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "rseq/internal/NumCpus.h"
+#include "rseq/internal/SwitchToCpu.h"
+
+using namespace rseq::internal;
+
+TEST(PerCpuArray, ReducesAcrossCpus) {
+  // Not a multiple of the number of lanes, to exercise the partial last block.
+  const int kSize = 21;
+  rseq::PerCpuArray<std::int64_t> array(kSize);
+  EXPECT_EQ(kSize, array.size());
+
+  for (int cpu = 0; cpu < numCpus(); ++cpu) {
+    switchToCpu(cpu);
+    for (int i = 0; i < kSize; ++i) {
+      // Alternate signs across cpus so that min and max are interesting.
+      array.add(i, cpu % 2 == 0 ? i * (cpu + 1) : -i * (cpu + 1));
+    }
+  }
+
+  std::vector<std::int64_t> sums(kSize);
+  std::vector<std::int64_t> mins(kSize);
+  std::vector<std::int64_t> maxes(kSize);
+  array.sumAll(sums.data());
+  array.minAll(mins.data());
+  array.maxAll(maxes.data());
+  for (int i = 0; i < kSize; ++i) {
+    std::int64_t expectedSum = 0;
+    std::int64_t expectedMin = 0;
+    std::int64_t expectedMax = 0;
+    for (int cpu = 0; cpu < numCpus(); ++cpu) {
+      std::int64_t val = cpu % 2 == 0 ? i * (cpu + 1) : -i * (cpu + 1);
+      EXPECT_EQ(val, array.forCpu(cpu, i)->load());
+      expectedSum += val;
+      expectedMin = cpu == 0 || val < expectedMin ? val : expectedMin;
+      expectedMax = cpu == 0 || val > expectedMax ? val : expectedMax;
+    }
+    EXPECT_EQ(expectedSum, sums[i]);
+    EXPECT_EQ(expectedSum, array.sum(i));
+    EXPECT_EQ(expectedMin, mins[i]);
+    EXPECT_EQ(expectedMin, array.min(i));
+    EXPECT_EQ(expectedMax, maxes[i]);
+    EXPECT_EQ(expectedMax, array.max(i));
+  }
+}
+
+TEST(PerCpuArray, CpusDontShareCachelines) {
+  rseq::PerCpuArray<double> array(100);
+  auto line = [&](int cpu, int index) {
+    return reinterpret_cast<std::uintptr_t>(array.forCpu(cpu, index))
+        / kCachelineSize;
+  };
+  for (int cpu = 0; cpu < numCpus(); ++cpu) {
+    // Neighboring elements in a block share their cpu's line...
+    EXPECT_EQ(line(cpu, 0), line(cpu, 1));
+    EXPECT_EQ(line(cpu, 0), line(cpu, rseq::PerCpuArray<double>::kLanes - 1));
+    for (int other = 0; other < cpu; ++other) {
+      // ... but no line is shared across cpus.
+      EXPECT_NE(line(cpu, 0), line(other, 0));
+      EXPECT_NE(line(cpu, 99), line(other, 99));
+    }
+  }
+}
+
+TEST(PerCpuArray, ConcurrentAddsSumExactly) {
+  const int kSize = 1000;
+  const int kNumThreads = 4 * numCpus();
+  const int kRoundsPerThread = 100;
+  rseq::PerCpuArray<std::uint64_t> array(kSize);
+
+  std::vector<std::thread> threads(kNumThreads);
+  for (int i = 0; i < kNumThreads; ++i) {
+    threads[i] = std::thread([&, i]() {
+      switchToCpu(i % numCpus());
+      for (int round = 0; round < kRoundsPerThread; ++round) {
+        for (int j = 0; j < kSize; ++j) {
+          array.add(j, j);
+        }
+      }
+    });
+  }
+  for (int i = 0; i < kNumThreads; ++i) {
+    threads[i].join();
+  }
+
+  std::vector<std::uint64_t> sums(kSize);
+  array.sumAll(sums.data());
+  for (int j = 0; j < kSize; ++j) {
+    EXPECT_EQ(
+        static_cast<std::uint64_t>(j) * kNumThreads * kRoundsPerThread,
+        sums[j]);
+  }
+}
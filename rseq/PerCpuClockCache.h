@@ -0,0 +1,273 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "rseq/PerCpu.h"
+#include "rseq/Rseq.h"
+#include "rseq/internal/Hash.h"
+#include "rseq/internal/ShardMode.h"
+
+namespace rseq {
+
+// A bounded cache from 64-bit keys to small values (anything that fits in an
+// rseq::Value: pointers, ids, ...), with a partition of kCapacity entries per
+// cpu. get() and put() work on the calling cpu's partition with rseq loads and
+// stores only; no locks, no atomic read-modify-writes.
+//
+// Each partition is set-associative, with kWays entries per set and CLOCK
+// replacement within a set. A set's metadata (which ways are valid, their
+// reference bits, the clock hand, and a version) is a single word:
+// - A hit sets the entry's reference bit, with one rseq store (or, if it was
+//   already set, just checks that the rseq is still going).
+// - A miss in put() advances the hand past referenced entries (clearing their
+//   bits) to pick a victim, then stores: the metadata with the victim invalid
+//   and the version bumped, the key, the value, and the metadata with the
+//   victim valid. Each prefix of that leaves a consistent set.
+//
+// Partitions are independent, so the same key can be cached on several cpus,
+// possibly with different values; put() only updates the local copy, and
+// erase() is the way to get rid of a key everywhere. This suits caches of data
+// that doesn't change in place (or where readers tolerate staleness).
+//
+// With neighborsToProbe > 0, a local miss in get() reads that many other
+// partitions (cpus sharing a last-level cache first, if shards are cpus),
+// without an rseq: the version makes the set's metadata a seqlock for such
+// readers. A hit there is copied into the local partition.
+template <typename V, int kCapacity = 1024>
+class PerCpuClockCache {
+ public:
+  constexpr static int kWays = 8;
+  static_assert(
+      kCapacity % kWays == 0, "kCapacity must be a multiple of kWays");
+
+  explicit PerCpuClockCache(int neighborsToProbe = 0) {
+    int numShards = shards_.numShards();
+    if (neighborsToProbe > numShards - 1) {
+      neighborsToProbe = numShards - 1;
+    }
+    neighborsToProbe_ = neighborsToProbe;
+    neighbors_.resize(numShards * neighborsToProbe);
+    for (int shard = 0; shard < numShards; ++shard) {
+      int* neighbors = &neighbors_[shard * neighborsToProbe];
+      int numFound = 0;
+      int llc = internal::llcForShard(shard);
+      for (int pass = 0; pass < 2; ++pass) {
+        for (int i = 1; i < numShards && numFound < neighborsToProbe; ++i) {
+          int other = (shard + i) % numShards;
+          if ((internal::llcForShard(other) == llc) == (pass == 0)) {
+            neighbors[numFound++] = other;
+          }
+        }
+      }
+    }
+  }
+
+  PerCpuClockCache(const PerCpuClockCache&) = delete;
+  PerCpuClockCache& operator=(const PerCpuClockCache&) = delete;
+
+  bool get(std::uint64_t key, V* value) {
+    std::uint64_t hash = internal::mixHash(key);
+    if (getLocal(key, hash, value)) {
+      return true;
+    }
+    if (neighborsToProbe_ == 0) {
+      return false;
+    }
+    const int* neighbors = &neighbors_[rseq::begin() * neighborsToProbe_];
+    for (int i = 0; i < neighborsToProbe_; ++i) {
+      if (getRemote(neighbors[i], key, hash, value)) {
+        put(key, *value);
+        return true;
+      }
+    }
+    return false;
+  }
+
+  void put(std::uint64_t key, V value) {
+    std::uint64_t hash = internal::mixHash(key);
+    while (true) {
+      Set* set = setFor(rseq::begin(), hash);
+      std::uint64_t meta = set->meta.load();
+      int way = find(set, meta, key);
+      if (way >= 0) {
+        if (rseq::store(&set->values[way], value)) {
+          rseq::store(&set->meta, meta | refBit(way));
+          return;
+        }
+        continue;
+      }
+      std::uint64_t valid = meta & kWayMask;
+      std::uint64_t refs = (meta >> kRefShift) & kWayMask;
+      int hand = static_cast<int>((meta >> kHandShift) & (kWays - 1));
+      if (valid != kWayMask) {
+        way = __builtin_ctzl(~valid & kWayMask);
+      } else {
+        while (refs & (std::uint64_t(1) << hand)) {
+          refs &= ~(std::uint64_t(1) << hand);
+          hand = (hand + 1) % kWays;
+        }
+        way = hand;
+        hand = (hand + 1) % kWays;
+      }
+      std::uint64_t bit = std::uint64_t(1) << way;
+      valid &= ~bit;
+      refs &= ~bit;
+      std::uint64_t version = (meta >> kVersionShift) + 1;
+      std::uint64_t invalidated = pack(valid, refs, hand, version);
+      std::uint64_t filled = pack(valid | bit, refs, hand, version);
+      if (rseq::store(&set->meta, invalidated)
+          && rseq::store(&set->keys[way], key)
+          && rseq::store(&set->values[way], value)
+          && rseq::store(&set->meta, filled)) {
+        return;
+      }
+    }
+  }
+
+  // Removes key from every partition. Slow: a remote rseq on each partition
+  // that might have it.
+  void erase(std::uint64_t key) {
+    std::uint64_t hash = internal::mixHash(key);
+    for (int shard = 0; shard < shards_.numShards(); ++shard) {
+      // Only a read that no replacement in the set raced with can rule the
+      // shard out; any other miss in the set bumps the version, so on a busy
+      // cache a torn read is common, not a rare race with an insert of key.
+      if (isAbsentRemote(shard, key, hash)) {
+        continue;
+      }
+      shards_.drain(shard, [&](Shard& /* shard */) {
+        Set* set = setFor(shard, hash);
+        std::uint64_t meta = set->meta.load();
+        int way = find(set, meta, key);
+        if (way < 0) {
+          return true;
+        }
+        std::uint64_t bit = std::uint64_t(1) << way;
+        return rseq::store(
+            &set->meta,
+            pack(
+                meta & kWayMask & ~bit,
+                (meta >> kRefShift) & kWayMask & ~bit,
+                (meta >> kHandShift) & (kWays - 1),
+                (meta >> kVersionShift) + 1));
+      });
+    }
+  }
+
+ private:
+  constexpr static int kSets = kCapacity / kWays;
+
+  // Metadata layout: valid bits, reference bits, hand, version.
+  constexpr static std::uint64_t kWayMask = (1 << kWays) - 1;
+  constexpr static int kRefShift = 8;
+  constexpr static int kHandShift = 16;
+  constexpr static int kVersionShift = 24;
+
+  struct Set {
+    rseq::Value<std::uint64_t> meta;
+    rseq::Value<std::uint64_t> keys[kWays];
+    rseq::Value<V> values[kWays];
+  };
+
+  struct Shard {
+    Set sets[kSets];
+  };
+
+  static std::uint64_t pack(
+      std::uint64_t valid,
+      std::uint64_t refs,
+      std::uint64_t hand,
+      std::uint64_t version) {
+    return valid | (refs << kRefShift) | (hand << kHandShift)
+        | (version << kVersionShift);
+  }
+
+  static std::uint64_t refBit(int way) {
+    return std::uint64_t(1) << (kRefShift + way);
+  }
+
+  Set* setFor(int shard, std::uint64_t hash) {
+    return &shards_.forShard(shard)->sets[hash % kSets];
+  }
+
+  static int find(Set* set, std::uint64_t meta, std::uint64_t key) {
+    for (int way = 0; way < kWays; ++way) {
+      if ((meta & (std::uint64_t(1) << way)) && set->keys[way].load() == key) {
+        return way;
+      }
+    }
+    return -1;
+  }
+
+  bool getLocal(std::uint64_t key, std::uint64_t hash, V* value) {
+    while (true) {
+      Set* set = setFor(rseq::begin(), hash);
+      std::uint64_t meta = set->meta.load();
+      int way = find(set, meta, key);
+      if (way < 0) {
+        // Possibly a torn read; but a spurious miss is fine for a cache.
+        return false;
+      }
+      V result = set->values[way].load();
+      // Either way, confirms the rseq was ongoing through the loads.
+      bool stillOurs = (meta & refBit(way))
+          ? rseq::validate()
+          : rseq::store(&set->meta, meta | refBit(way));
+      if (stillOurs) {
+        *value = result;
+        return true;
+      }
+    }
+  }
+
+  // Reads another shard's set as a seqlock: any replacement of an entry bumps
+  // the version before it touches the entry's key or value.
+  bool getRemote(
+      int shard,
+      std::uint64_t key,
+      std::uint64_t hash,
+      V* value) {
+    Set* set = setFor(shard, hash);
+    std::uint64_t before = set->meta.load(std::memory_order_acquire);
+    int way = find(set, before, key);
+    if (way < 0) {
+      return false;
+    }
+    V result = set->values[way].load(std::memory_order_acquire);
+    if (set->meta.load(std::memory_order_acquire) >> kVersionShift
+        != before >> kVersionShift) {
+      return false;
+    }
+    *value = result;
+    return true;
+  }
+
+  // Whether another shard's set was seen without key by a read that no
+  // replacement raced with. False means key may be there.
+  bool isAbsentRemote(int shard, std::uint64_t key, std::uint64_t hash) {
+    Set* set = setFor(shard, hash);
+    std::uint64_t before = set->meta.load(std::memory_order_acquire);
+    if (find(set, before, key) >= 0) {
+      return false;
+    }
+    return set->meta.load(std::memory_order_acquire) >> kVersionShift
+        == before >> kVersionShift;
+  }
+
+  int neighborsToProbe_;
+  // Shard i probes neighbors_[i * neighborsToProbe_, ...].
+  std::vector<int> neighbors_;
+  PerCpu<Shard> shards_;
+};
+
+} // namespace rseq
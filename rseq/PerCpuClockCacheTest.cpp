@@ -0,0 +1,141 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#include "rseq/PerCpuClockCache.h"
+
+#include <atomic>
+#include <cstdint>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "rseq/internal/NumCpus.h"
+#include "rseq/internal/SwitchToCpu.h"
+
+using namespace rseq::internal;
+
+TEST(PerCpuClockCache, GetsWhatWasPut) {
+  rseq::PerCpuClockCache<std::uint64_t> cache;
+  std::uint64_t value;
+  EXPECT_FALSE(cache.get(1, &value));
+  cache.put(1, 100);
+  cache.put(2, 200);
+  ASSERT_TRUE(cache.get(1, &value));
+  EXPECT_EQ(100, value);
+  ASSERT_TRUE(cache.get(2, &value));
+  EXPECT_EQ(200, value);
+  cache.put(1, 101);
+  ASSERT_TRUE(cache.get(1, &value));
+  EXPECT_EQ(101, value);
+  cache.erase(1);
+  EXPECT_FALSE(cache.get(1, &value));
+  EXPECT_TRUE(cache.get(2, &value));
+}
+
+TEST(PerCpuClockCache, KeepsReferencedEntries) {
+  const int kCapacity = 64;
+  rseq::PerCpuClockCache<std::uint64_t, kCapacity> cache;
+  std::uint64_t value;
+  // Key 0 is hot; everything else is touched once. Key 0 should survive
+  // being cycled through its set many times over.
+  cache.put(0, 0);
+  for (std::uint64_t key = 1; key < 100 * kCapacity; ++key) {
+    cache.put(key, key);
+    ASSERT_TRUE(cache.get(0, &value));
+  }
+  // Only the most recent ones are left, and never more than fit.
+  int numHits = 0;
+  for (std::uint64_t key = 1; key < 100 * kCapacity; ++key) {
+    if (cache.get(key, &value)) {
+      EXPECT_EQ(key, value);
+      ++numHits;
+    }
+  }
+  EXPECT_GT(kCapacity, numHits);
+  EXPECT_LT(kCapacity / 2, numHits);
+}
+
+TEST(PerCpuClockCache, ProbesNeighbors) {
+  if (numCpus() < 2) {
+    return;
+  }
+  rseq::PerCpuClockCache<std::uint64_t> isolated;
+  rseq::PerCpuClockCache<std::uint64_t> shared(numCpus() - 1);
+  switchToCpu(0);
+  isolated.put(1, 10);
+  shared.put(1, 10);
+  std::uint64_t value;
+  switchToCpu(1);
+  EXPECT_FALSE(isolated.get(1, &value));
+  ASSERT_TRUE(shared.get(1, &value));
+  EXPECT_EQ(10, value);
+  // It's local now, too.
+  shared.erase(1);
+  EXPECT_FALSE(shared.get(1, &value));
+}
+
+TEST(PerCpuClockCache, EraseRacesWithReplacementsInTheSameSet) {
+  if (numCpus() < 2) {
+    return;
+  }
+  // A single set, so every put of another key on cpu 0 bumps the set's version
+  // while erase() reads it from cpu 1.
+  rseq::PerCpuClockCache<std::uint64_t, 8> cache;
+  std::atomic<bool> done(false);
+  std::thread churner([&]() {
+    switchToCpu(0);
+    for (std::uint64_t key = 1; !done.load(); ++key) {
+      cache.put(key % 1000 + 1, key);
+    }
+  });
+  for (int i = 0; i < 10000; ++i) {
+    std::uint64_t value;
+    switchToCpu(0);
+    cache.put(0, 1);
+    switchToCpu(1);
+    cache.erase(0);
+    switchToCpu(0);
+    ASSERT_FALSE(cache.get(0, &value));
+  }
+  done.store(true);
+  churner.join();
+}
+
+TEST(PerCpuClockCache, ConcurrentGetsAndPuts) {
+  const int kNumThreads = 2 * numCpus();
+  const int kIterations = 200000;
+  // Values are always a function of the key, so any hit can be checked.
+  rseq::PerCpuClockCache<std::uint64_t, 256> cache(1);
+  std::vector<std::thread> threads;
+  for (int i = 0; i < kNumThreads; ++i) {
+    threads.emplace_back([&, i]() {
+      std::mt19937 rng(i);
+      for (int j = 0; j < kIterations; ++j) {
+        if (j % 1000 == 0) {
+          switchToCpu((i + j / 1000) % numCpus());
+        }
+        std::uint64_t key = rng() % 1000;
+        std::uint64_t value;
+        if (cache.get(key, &value)) {
+          ASSERT_EQ(key * 3, value);
+        } else {
+          cache.put(key, key * 3);
+        }
+        if (j % 100 == 0) {
+          cache.erase(rng() % 1000);
+        }
+      }
+    });
+  }
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+}
@@ -0,0 +1,122 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#pragma once
+
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "rseq/PerCpuArray.h"
+#include "rseq/Rseq.h"
+#include "rseq/internal/Hash.h"
+
+namespace rseq {
+
+// A Count-Min sketch of key frequencies, with a set of counters per cpu. add()
+// does one rseq increment on the calling cpu per row of the sketch.
+//
+// estimate() never underestimates the total count added for a key (among the
+// adds that completed before it), and overestimates it by at most
+// e / width * (the total count of all keys) with probability
+// 1 - exp(-depth).
+//
+// The rows of an add() are separate rseqs, so an estimate() concurrent with
+// it may see some of them and not others (and so may miss it).
+class PerCpuCountMin {
+ public:
+  // A merged copy of the counters; cheaper than PerCpuCountMin::estimate() when
+  // querying many keys.
+  class Snapshot {
+   public:
+    Snapshot(std::size_t width, int depth)
+        : width_(width), depth_(depth), counters_(width * depth) {}
+
+    std::uint64_t estimate(std::uint64_t key) const {
+      std::uint64_t hash = internal::mixHash(key);
+      std::uint64_t result = ~std::uint64_t(0);
+      for (int row = 0; row < depth_; ++row) {
+        std::uint64_t count = counters_[indexFor(hash, row, width_)];
+        result = count < result ? count : result;
+      }
+      return result;
+    }
+
+    // Adds in the counters of other, which must have the same dimensions.
+    void merge(const Snapshot& other) {
+      assert(other.width_ == width_ && other.depth_ == depth_);
+      for (std::size_t i = 0; i < counters_.size(); ++i) {
+        counters_[i] += other.counters_[i];
+      }
+    }
+
+   private:
+    friend class PerCpuCountMin;
+
+    std::size_t width_;
+    int depth_;
+    std::vector<std::uint64_t> counters_;
+  };
+
+  explicit PerCpuCountMin(std::size_t width = 2048, int depth = 4)
+      : width_(width), depth_(depth), counters_(width * depth) {
+    assert(width > 0 && depth > 0);
+  }
+
+  PerCpuCountMin(const PerCpuCountMin&) = delete;
+  PerCpuCountMin& operator=(const PerCpuCountMin&) = delete;
+
+  // key needn't be a good hash; it gets mixed first.
+  void add(std::uint64_t key, std::uint64_t count = 1) {
+    std::uint64_t hash = internal::mixHash(key);
+    for (int row = 0; row < depth_; ++row) {
+      counters_.add(indexFor(hash, row, width_), count);
+    }
+  }
+
+  // If exact is true, reflects every add() that completed before the call;
+  // otherwise, recent ones may be missed.
+  std::uint64_t estimate(std::uint64_t key, bool exact = true) {
+    if (exact) {
+      rseq::fence();
+    }
+    std::uint64_t hash = internal::mixHash(key);
+    std::uint64_t result = ~std::uint64_t(0);
+    for (int row = 0; row < depth_; ++row) {
+      std::uint64_t count = counters_.sum(indexFor(hash, row, width_));
+      result = count < result ? count : result;
+    }
+    return result;
+  }
+
+  Snapshot snapshot(bool exact = true) {
+    if (exact) {
+      rseq::fence();
+    }
+    Snapshot result(width_, depth_);
+    counters_.sumAll(result.counters_.data());
+    return result;
+  }
+
+ private:
+  // Row i uses the hash h1 + i * h2, with h1 and h2 the halves of one 64-bit
+  // hash (Kirsch and Mitzenmacher); rows are laid out one after another.
+  static std::size_t indexFor(std::uint64_t hash, int row, std::size_t width) {
+    std::uint64_t h1 = hash & 0xffffffff;
+    std::uint64_t h2 = (hash >> 32) | 1;
+    return row * width + (h1 + row * h2) % width;
+  }
+
+  const std::size_t width_;
+  const int depth_;
+  PerCpuArray<std::uint64_t> counters_;
+};
+
+} // namespace rseq
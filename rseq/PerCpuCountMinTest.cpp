@@ -0,0 +1,83 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#include "rseq/PerCpuCountMin.h"
+
+#include <cstdint>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "rseq/internal/NumCpus.h"
+#include "rseq/internal/SwitchToCpu.h"
+
+using namespace rseq::internal;
+
+TEST(PerCpuCountMin, NeverUnderestimates) {
+  const std::uint64_t kNumKeys = 10000;
+  rseq::PerCpuCountMin sketch(1024, 4);
+  std::uint64_t total = 0;
+  for (std::uint64_t key = 0; key < kNumKeys; ++key) {
+    switchToCpu(key % numCpus());
+    sketch.add(key, key % 10 + 1);
+    total += key % 10 + 1;
+  }
+  rseq::PerCpuCountMin::Snapshot snapshot = sketch.snapshot();
+  int numFarOff = 0;
+  for (std::uint64_t key = 0; key < kNumKeys; ++key) {
+    std::uint64_t estimate = sketch.estimate(key);
+    ASSERT_LE(key % 10 + 1, estimate);
+    ASSERT_EQ(estimate, snapshot.estimate(key));
+    // Past the error bound of e / width * total.
+    if (estimate - (key % 10 + 1) > 2.72 / 1024 * total) {
+      ++numFarOff;
+    }
+  }
+  // The bound holds with probability 1 - e^-4.
+  EXPECT_GT(kNumKeys * 0.05, numFarOff);
+}
+
+TEST(PerCpuCountMin, MergesSnapshots) {
+  rseq::PerCpuCountMin a;
+  rseq::PerCpuCountMin b;
+  a.add(1, 10);
+  b.add(1, 5);
+  b.add(2);
+  rseq::PerCpuCountMin::Snapshot snapshot = a.snapshot();
+  snapshot.merge(b.snapshot());
+  EXPECT_EQ(15, snapshot.estimate(1));
+  EXPECT_EQ(1, snapshot.estimate(2));
+  EXPECT_EQ(0, snapshot.estimate(3));
+}
+
+TEST(PerCpuCountMin, ConcurrentAdds) {
+  const int kNumThreads = 2 * numCpus();
+  const int kAddsPerThread = 100000;
+  rseq::PerCpuCountMin sketch;
+  std::vector<std::thread> threads;
+  for (int i = 0; i < kNumThreads; ++i) {
+    threads.emplace_back([&, i]() {
+      for (int j = 0; j < kAddsPerThread; ++j) {
+        if (j % 1000 == 0) {
+          switchToCpu((i + j / 1000) % numCpus());
+        }
+        sketch.add(j % 3);
+      }
+    });
+  }
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+  std::uint64_t expected = std::uint64_t(kNumThreads) * kAddsPerThread / 3;
+  for (std::uint64_t key = 0; key < 3; ++key) {
+    EXPECT_LE(expected, sketch.estimate(key));
+    EXPECT_GE(expected + kNumThreads, sketch.estimate(key));
+  }
+}
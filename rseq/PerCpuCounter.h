@@ -0,0 +1,154 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+#include "rseq/Rseq.h"
+#include "rseq/internal/CpuLocal.h"
+#include "rseq/internal/NodeLocal.h"
+#include "rseq/internal/NumCpus.h"
+#include "rseq/internal/ShardMode.h"
+#include "rseq/internal/Topology.h"
+
+namespace rseq {
+
+// A counter in the style of the kernel's percpu_counter: adds go to a cpu-local
+// shard, and reads come from per-NUMA-node partial sums that shards
+// periodically fold themselves into.
+//
+// Each shard tracks the total of every add done on it, along with how much of
+// that total has already been folded into its node's partial sum. An add that
+// leaves the unfolded part of its shard at or above batchSize (in absolute
+// value) folds it. This gives:
+// - add(): an rseq load and store in the common case, plus an atomic add to a
+//   node-local cacheline once every ~batchSize units.
+// - read(): one atomic load per node (and readNode(), a single one). Once
+//   every add() call has returned, the result differs from the exact value by
+//   less than errorBound() (resp. errorBoundForNode()). (A thread that
+//   migrates between its add and the subsequent fold check may leave one shard
+//   unfolded past the batch size until the next add on that cpu).
+// - sum(): exact, but visits every shard.
+// In concurrency id mode (see rseq::useConcurrencyIds()), shards don't belong
+// to nodes, so everything is attributed to node 0: read() and sum() are
+// unaffected, but the per-node functions treat the machine as a single node.
+class PerCpuCounter {
+ public:
+  explicit PerCpuCounter(std::int64_t batchSize = 32)
+      : batchSize_(batchSize) {
+    for (int i = 0; i < internal::numNodes(); ++i) {
+      nodeSums_.forNode(i)->store(0);
+    }
+  }
+
+  PerCpuCounter(const PerCpuCounter&) = delete;
+  PerCpuCounter& operator=(const PerCpuCounter&) = delete;
+
+  void add(std::int64_t delta) {
+    while (true) {
+      int cpu = rseq::begin();
+      Shard* shard = shards_.forCpu(cpu);
+      if (rseq::store(&shard->total, shard->total.load() + delta)) {
+        break;
+      }
+    }
+    // Usually the rseq is still ongoing, in which case this looks at the same
+    // shard we just added to.
+    maybeFold();
+  }
+
+  // Approximate; see above.
+  std::int64_t read() {
+    std::int64_t result = 0;
+    for (int i = 0; i < internal::numNodes(); ++i) {
+      result += readNode(i);
+    }
+    return result;
+  }
+
+  // Approximates the sum of the adds done on the cpus of the given node.
+  std::int64_t readNode(int node) {
+    return nodeSums_.forNode(node)->load(std::memory_order_relaxed);
+  }
+
+  // Exact with respect to every add() that completed before the call.
+  std::int64_t sum() {
+    // Makes the stores of any rseq that committed an add before this point
+    // visible to us.
+    rseq::fence();
+    std::int64_t result = 0;
+    for (int i = 0; i < internal::numCpus(); ++i) {
+      result += shards_.forCpu(i)->total.load();
+    }
+    return result;
+  }
+
+  // Exact, but only counts the adds done on the cpus of the given node.
+  std::int64_t sumNode(int node) {
+    rseq::fence();
+    std::int64_t result = 0;
+    for (int i = 0; i < internal::numCpus(); ++i) {
+      if (nodeForShard(i) == node) {
+        result += shards_.forCpu(i)->total.load();
+      }
+    }
+    return result;
+  }
+
+  // The maximum difference between read() and sum() in the steady state.
+  std::int64_t errorBound() const {
+    return batchSize_ * internal::numCpus();
+  }
+
+  // Likewise, for readNode() and sumNode().
+  std::int64_t errorBoundForNode(int node) const {
+    if (!internal::shardsAreCpus()) {
+      return node == 0 ? errorBound() : 0;
+    }
+    return batchSize_ * internal::numCpusInNode(node);
+  }
+
+ private:
+  struct Shard {
+    rseq::Value<std::int64_t> total;
+    rseq::Value<std::int64_t> folded;
+  };
+
+  static int nodeForShard(int shard) {
+    int node = internal::nodeForShard(shard);
+    return node < 0 ? 0 : node;
+  }
+
+  void maybeFold() {
+    while (true) {
+      int cpu = rseq::begin();
+      Shard* shard = shards_.forCpu(cpu);
+      std::int64_t total = shard->total.load();
+      std::int64_t unfolded = total - shard->folded.load();
+      if (unfolded < batchSize_ && unfolded > -batchSize_) {
+        return;
+      }
+      // Once this store succeeds, no one else can fold this part of the total;
+      // we're responsible for getting it into the node sum.
+      if (rseq::store(&shard->folded, total)) {
+        nodeSums_.forNode(nodeForShard(cpu))->fetch_add(
+            unfolded, std::memory_order_relaxed);
+        return;
+      }
+    }
+  }
+
+  std::int64_t batchSize_;
+  internal::CpuLocal<Shard> shards_;
+  internal::NodeLocal<std::atomic<std::int64_t>> nodeSums_;
+};
+
+} // namespace rseq
@@ -0,0 +1,107 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#include "rseq/PerCpuCounter.h"
+
+#include <cstdint>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "rseq/internal/NumCpus.h"
+#include "rseq/internal/SwitchToCpu.h"
+#include "rseq/internal/Topology.h"
+
+using namespace rseq::internal;
+
+TEST(PerCpuCounter, ReadsLagByLessThanBatch) {
+  switchToCpu(0);
+  rseq::PerCpuCounter counter(10);
+  for (int i = 0; i < 9; ++i) {
+    counter.add(1);
+  }
+  EXPECT_EQ(0, counter.read());
+  EXPECT_EQ(9, counter.sum());
+
+  counter.add(1);
+  EXPECT_EQ(10, counter.read());
+  EXPECT_EQ(10, counter.sum());
+
+  counter.add(-3);
+  EXPECT_EQ(10, counter.read());
+  EXPECT_EQ(7, counter.sum());
+
+  counter.add(-20);
+  EXPECT_EQ(-13, counter.read());
+  EXPECT_EQ(-13, counter.sum());
+}
+
+TEST(PerCpuCounter, SumsExactly) {
+  const int kNumThreads = 4 * numCpus();
+  const int kAddsPerThread = 100000;
+  rseq::PerCpuCounter counter(100);
+
+  std::vector<std::thread> threads(kNumThreads);
+  for (int i = 0; i < kNumThreads; ++i) {
+    threads[i] = std::thread([&, i]() {
+      switchToCpu(i % numCpus());
+      for (int j = 0; j < kAddsPerThread; ++j) {
+        // Mix in some subtractions, so that we fold in both directions.
+        counter.add(j % 4 == 3 ? -1 : 2);
+      }
+    });
+  }
+  for (int i = 0; i < kNumThreads; ++i) {
+    threads[i].join();
+  }
+
+  std::int64_t expected =
+      static_cast<std::int64_t>(kNumThreads) * kAddsPerThread / 4 * 5;
+  EXPECT_EQ(expected, counter.sum());
+  std::int64_t error = counter.sum() - counter.read();
+  // The bound only holds in the absence of migrations; we pinned our threads
+  // above, so we should be in the clear.
+  EXPECT_LT(error, counter.errorBound());
+  EXPECT_GT(error, -counter.errorBound());
+}
+
+TEST(PerCpuCounter, NodeSumsAddUp) {
+  const int kNumThreads = 2 * numCpus();
+  const int kAddsPerThread = 10000;
+  rseq::PerCpuCounter counter(16);
+
+  std::vector<std::thread> threads(kNumThreads);
+  for (int i = 0; i < kNumThreads; ++i) {
+    threads[i] = std::thread([&, i]() {
+      switchToCpu(i % numCpus());
+      for (int j = 0; j < kAddsPerThread; ++j) {
+        counter.add(1);
+      }
+    });
+  }
+  for (int i = 0; i < kNumThreads; ++i) {
+    threads[i].join();
+  }
+
+  std::int64_t sumOfNodeSums = 0;
+  std::int64_t sumOfNodeReads = 0;
+  for (int node = 0; node < numNodes(); ++node) {
+    std::int64_t nodeSum = counter.sumNode(node);
+    std::int64_t nodeRead = counter.readNode(node);
+    EXPECT_LE(nodeRead, nodeSum);
+    EXPECT_LT(nodeSum - nodeRead, counter.errorBoundForNode(node));
+    sumOfNodeSums += nodeSum;
+    sumOfNodeReads += nodeRead;
+  }
+  EXPECT_EQ(counter.sum(), sumOfNodeSums);
+  EXPECT_EQ(counter.read(), sumOfNodeReads);
+  EXPECT_EQ(
+      static_cast<std::int64_t>(kNumThreads) * kAddsPerThread, sumOfNodeSums);
+}
@@ -0,0 +1,263 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "rseq/IdleWorkers.h"
+#include "rseq/PerCpu.h"
+#include "rseq/Rseq.h"
+
+namespace rseq {
+
+// A task executor with one deque of tasks per shard, rather than per worker
+// thread. submit() pushes onto the deque of whatever cpu the caller is on, and
+// workers take from the deque of whatever cpu they're on, so tasks tend to run
+// where they were produced (and where their data is cache-hot), even when
+// threads migrate.
+//
+// The owning cpu pushes and pops at the tail of its deque with rseq stores;
+// there's no CAS on that path, unlike a Chase-Lev deque. A worker that finds
+// its own deque empty steals the oldest half of another shard's tasks by
+// taking the shard over with rseq::beginRemote() (see PerCpu::drain()), which
+// costs a heavy fence, so it only happens when the worker would otherwise go
+// idle. Tasks that don't fit in a full deque go to a mutex-protected overflow
+// queue.
+//
+// A worker with nothing to take parks in an IdleWorkers registry: it pushes
+// itself onto its cpu's idle stack, rechecks for pending tasks, and sleeps on
+// its own futex. submit() checks the registry's idle count, which is a single
+// load when no one is parked; otherwise it wakes the worker that went idle
+// nearest its cpu, so tasks go to a warm cache rather than to any sleeper.
+//
+// The destructor runs every task submitted before it's called (including ones
+// those tasks submit) before returning.
+template <int kCapacity = 256>
+class PerCpuExecutor {
+ public:
+  explicit PerCpuExecutor(
+      int numWorkers = std::thread::hardware_concurrency())
+      : pending_(0), overflowSize_(0), stopping_(false) {
+    if (numWorkers < 1) {
+      numWorkers = 1;
+    }
+    idlers_.reset(new IdleWorkers::Worker[numWorkers]);
+    for (int i = 0; i < numWorkers; ++i) {
+      IdleWorkers::Worker* idler = &idlers_[i];
+      workers_.emplace_back([this, idler]() { work(idler); });
+    }
+  }
+
+  PerCpuExecutor(const PerCpuExecutor&) = delete;
+  PerCpuExecutor& operator=(const PerCpuExecutor&) = delete;
+
+  ~PerCpuExecutor() {
+    stopping_.store(true);
+    idleWorkers_.wakeAll();
+    for (std::thread& worker : workers_) {
+      worker.join();
+    }
+  }
+
+  // May be called from any thread, including from within a task.
+  template <typename Func>
+  void submit(Func&& func) {
+    Task* task = new TaskImpl<typename std::decay<Func>::type>(
+        std::forward<Func>(func));
+    // Counted before it's visible, so that no one sees it taken before it was
+    // added.
+    pending_.fetch_add(1);
+    if (!tryPushLocal(task)) {
+      std::lock_guard<std::mutex> lg(overflowMu_);
+      overflow_.push_back(task);
+      overflowSize_.fetch_add(1);
+    }
+    // Workers bump numIdle() before checking pending_, and we bumped pending_
+    // before checking numIdle(); one of us sees the other.
+    if (idleWorkers_.numIdle() > 0) {
+      idleWorkers_.wakeOne();
+    }
+  }
+
+ private:
+  struct Task {
+    virtual ~Task() {}
+    virtual void run() = 0;
+  };
+
+  template <typename Func>
+  struct TaskImpl : Task {
+    explicit TaskImpl(Func&& f) : func(std::move(f)) {}
+    explicit TaskImpl(const Func& f) : func(f) {}
+    void run() override {
+      func();
+    }
+    Func func;
+  };
+
+  // Tasks are in items[head % kCapacity, tail % kCapacity); the owner works
+  // at the tail, thieves at the head.
+  struct Shard {
+    rseq::Value<std::uint64_t> head;
+    rseq::Value<std::uint64_t> tail;
+    rseq::Value<Task*> items[kCapacity];
+  };
+
+  static constexpr int kMaxSteal = kCapacity / 2 > 0 ? kCapacity / 2 : 1;
+
+  bool tryPushLocal(Task* task) {
+    while (true) {
+      Shard* shard = shards_.forShard(rseq::begin());
+      std::uint64_t head = shard->head.load();
+      std::uint64_t tail = shard->tail.load();
+      if (tail - head >= kCapacity) {
+        return false;
+      }
+      // If the second store fails, the first one only wrote garbage.
+      if (rseq::store(&shard->items[tail % kCapacity], task)
+          && rseq::store(&shard->tail, tail + 1)) {
+        return true;
+      }
+    }
+  }
+
+  // Newest first, for locality.
+  Task* tryPopLocal() {
+    while (true) {
+      Shard* shard = shards_.forShard(rseq::begin());
+      std::uint64_t head = shard->head.load();
+      std::uint64_t tail = shard->tail.load();
+      if (head == tail) {
+        return nullptr;
+      }
+      Task* task = shard->items[(tail - 1) % kCapacity].load();
+      if (rseq::store(&shard->tail, tail - 1)) {
+        return task;
+      }
+    }
+  }
+
+  Task* tryPopOverflow() {
+    if (overflowSize_.load() == 0) {
+      return nullptr;
+    }
+    std::lock_guard<std::mutex> lg(overflowMu_);
+    if (overflow_.empty()) {
+      return nullptr;
+    }
+    Task* task = overflow_.front();
+    overflow_.pop_front();
+    overflowSize_.fetch_sub(1);
+    return task;
+  }
+
+  // Takes the older half of some other shard's tasks; returns one of them and
+  // queues the rest locally.
+  Task* trySteal() {
+    int numShards = shards_.numShards();
+    int self = rseq::begin();
+    Task* stolen[kMaxSteal];
+    int numStolen = 0;
+    for (int i = 1; i <= numShards && numStolen == 0; ++i) {
+      int victim = (self + i) % numShards;
+      Shard* shard = shards_.forShard(victim);
+      // Don't pay for a remote rseq on shards that look empty.
+      if (shard->tail.load(std::memory_order_relaxed)
+          == shard->head.load(std::memory_order_relaxed)) {
+        continue;
+      }
+      shards_.drain(victim, [&](Shard& target) {
+        std::uint64_t head = target.head.load();
+        std::uint64_t tail = target.tail.load();
+        std::uint64_t count = (tail - head + 1) / 2;
+        if (count > static_cast<std::uint64_t>(kMaxSteal)) {
+          count = kMaxSteal;
+        }
+        for (std::uint64_t j = 0; j < count; ++j) {
+          stolen[j] = target.items[(head + j) % kCapacity].load();
+        }
+        if (!rseq::store(&target.head, head + count)) {
+          return false;
+        }
+        numStolen = static_cast<int>(count);
+        return true;
+      });
+    }
+    if (numStolen == 0) {
+      return nullptr;
+    }
+    for (int i = 1; i < numStolen; ++i) {
+      if (!tryPushLocal(stolen[i])) {
+        std::lock_guard<std::mutex> lg(overflowMu_);
+        overflow_.push_back(stolen[i]);
+        overflowSize_.fetch_add(1);
+      }
+    }
+    return stolen[0];
+  }
+
+  Task* tryTake() {
+    Task* task = tryPopLocal();
+    if (task == nullptr) {
+      task = tryPopOverflow();
+    }
+    if (task == nullptr) {
+      task = trySteal();
+    }
+    return task;
+  }
+
+  void work(IdleWorkers::Worker* idler) {
+    while (true) {
+      Task* task = tryTake();
+      if (task != nullptr) {
+        pending_.fetch_sub(1);
+        task->run();
+        delete task;
+        continue;
+      }
+      // submit() bumps pending_ before waking anyone, and the destructor sets
+      // stopping_ before waking everyone; either way we either see it here or
+      // get woken.
+      idleWorkers_.prepareToPark(idler);
+      if (pending_.load() != 0) {
+        continue;
+      }
+      if (stopping_.load()) {
+        return;
+      }
+      idleWorkers_.park(idler);
+    }
+  }
+
+  PerCpu<Shard> shards_;
+  // Tasks submitted but not yet taken by a worker.
+  std::atomic<std::uint64_t> pending_;
+
+  IdleWorkers idleWorkers_;
+  // One per worker thread.
+  std::unique_ptr<IdleWorkers::Worker[]> idlers_;
+
+  std::mutex overflowMu_;
+  std::deque<Task*> overflow_;
+  std::atomic<std::uint64_t> overflowSize_;
+
+  std::atomic<bool> stopping_;
+  std::vector<std::thread> workers_;
+};
+
+} // namespace rseq
@@ -0,0 +1,126 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#include "rseq/PerCpuExecutor.h"
+
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "rseq/internal/NumCpus.h"
+#include "rseq/internal/SwitchToCpu.h"
+
+using namespace rseq::internal;
+
+TEST(PerCpuExecutor, RunsSubmittedTasks) {
+  const int kNumTasks = 10000;
+  std::atomic<int> numRun(0);
+  {
+    rseq::PerCpuExecutor<> executor(4);
+    for (int i = 0; i < kNumTasks; ++i) {
+      executor.submit([&]() { ++numRun; });
+    }
+  }
+  EXPECT_EQ(kNumTasks, numRun.load());
+}
+
+TEST(PerCpuExecutor, RunsMoveOnlyTasks) {
+  std::atomic<int> sum(0);
+  {
+    rseq::PerCpuExecutor<> executor(1);
+    std::unique_ptr<int> value(new int(17));
+    struct AddTask {
+      std::unique_ptr<int> value;
+      std::atomic<int>* sum;
+      void operator()() {
+        *sum += *value;
+      }
+    };
+    executor.submit(AddTask{std::move(value), &sum});
+  }
+  EXPECT_EQ(17, sum.load());
+}
+
+// A deque capacity of 4 makes most of these go through the overflow queue.
+TEST(PerCpuExecutor, OverflowsFullDeques) {
+  const int kNumTasks = 1000;
+  std::atomic<int> numRun(0);
+  {
+    rseq::PerCpuExecutor<4> executor(2);
+    for (int i = 0; i < kNumTasks; ++i) {
+      executor.submit([&]() { ++numRun; });
+    }
+  }
+  EXPECT_EQ(kNumTasks, numRun.load());
+}
+
+static void spawnTree(
+    rseq::PerCpuExecutor<>* executor,
+    std::atomic<int>* numRun,
+    int depth) {
+  ++*numRun;
+  if (depth == 0) {
+    return;
+  }
+  for (int i = 0; i < 2; ++i) {
+    executor->submit([executor, numRun, depth]() {
+      spawnTree(executor, numRun, depth - 1);
+    });
+  }
+}
+
+TEST(PerCpuExecutor, RunsTasksSubmittedByTasks) {
+  const int kDepth = 12;
+  std::atomic<int> numRun(0);
+  {
+    rseq::PerCpuExecutor<> executor(4);
+    executor.submit([&]() { spawnTree(&executor, &numRun, kDepth); });
+  }
+  EXPECT_EQ((1 << (kDepth + 1)) - 1, numRun.load());
+}
+
+TEST(PerCpuExecutor, StealsFromBusyCpus) {
+  const int kNumTasks = 1000;
+  std::atomic<int> numRun(0);
+  {
+    rseq::PerCpuExecutor<1024> executor(2 * numCpus());
+    // All the tasks land on one cpu's deque; workers elsewhere have to steal
+    // them.
+    switchToCpu(0);
+    for (int i = 0; i < kNumTasks; ++i) {
+      executor.submit([&]() { ++numRun; });
+    }
+  }
+  EXPECT_EQ(kNumTasks, numRun.load());
+}
+
+TEST(PerCpuExecutor, ConcurrentSubmitters) {
+  const int kNumThreads = 4 * numCpus();
+  const int kTasksPerThread = 10000;
+  std::atomic<int> numRun(0);
+  {
+    rseq::PerCpuExecutor<> executor(numCpus());
+    std::vector<std::thread> threads(kNumThreads);
+    for (int i = 0; i < kNumThreads; ++i) {
+      threads[i] = std::thread([&, i]() {
+        switchToCpu(i % numCpus());
+        for (int j = 0; j < kTasksPerThread; ++j) {
+          executor.submit([&]() { ++numRun; });
+        }
+      });
+    }
+    for (int i = 0; i < kNumThreads; ++i) {
+      threads[i].join();
+    }
+  }
+  EXPECT_EQ(kNumThreads * kTasksPerThread, numRun.load());
+}
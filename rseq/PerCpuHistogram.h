@@ -0,0 +1,225 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#pragma once
+
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "rseq/PerCpuArray.h"
+#include "rseq/Rseq.h"
+
+namespace rseq {
+
+// A histogram of 64-bit values (typically latencies), in which record() is an
+// rseq increment of one bucket in the calling cpu's shard, and reading merges
+// the shards.
+//
+// Buckets are log-linear, as in HdrHistogram: values below 2^precisionBits
+// get a bucket each, and every power-of-two range above that is split into
+// 2^(precisionBits - 1) equal-width buckets. So a bucket's width is at most
+// 1 / 2^(precisionBits - 1) of its lower bound; with the default of 4, any
+// percentile is within 12.5% of the truth, using 496 buckets per cpu.
+//
+// The shards live in a PerCpuArray, so snapshot() is a lane-wise sum of whole
+// cachelines.
+class PerCpuHistogram {
+ public:
+  // A merged copy of the bucket counts.
+  class Snapshot {
+   public:
+    explicit Snapshot(int precisionBits)
+        : precisionBits_(precisionBits),
+          counts_(numBucketsFor(precisionBits)) {}
+
+    int precisionBits() const {
+      return precisionBits_;
+    }
+
+    std::size_t numBuckets() const {
+      return counts_.size();
+    }
+
+    std::uint64_t countAt(std::size_t bucket) const {
+      return counts_[bucket];
+    }
+
+    // The smallest and largest values that land in the given bucket.
+    std::uint64_t lowerBound(std::size_t bucket) const {
+      return lowerBoundFor(precisionBits_, bucket);
+    }
+
+    std::uint64_t upperBound(std::size_t bucket) const {
+      return lowerBound(bucket) + (widthFor(precisionBits_, bucket) - 1);
+    }
+
+    std::uint64_t count() const {
+      std::uint64_t result = 0;
+      for (std::uint64_t count : counts_) {
+        result += count;
+      }
+      return result;
+    }
+
+    // The largest value that could be at the given percentile (in [0, 100]),
+    // or 0 if nothing was recorded.
+    std::uint64_t percentile(double percent) const {
+      std::uint64_t total = count();
+      if (total == 0) {
+        return 0;
+      }
+      double exactRank = percent / 100.0 * total;
+      std::uint64_t rank = static_cast<std::uint64_t>(exactRank);
+      if (rank < exactRank || rank == 0) {
+        ++rank;
+      }
+      if (rank > total) {
+        rank = total;
+      }
+      std::uint64_t seen = 0;
+      for (std::size_t i = 0; i < counts_.size(); ++i) {
+        seen += counts_[i];
+        if (seen >= rank) {
+          return upperBound(i);
+        }
+      }
+      // Unreachable; seen ends at total.
+      return upperBound(counts_.size() - 1);
+    }
+
+    // Treats each value as the midpoint of its bucket.
+    double mean() const {
+      std::uint64_t total = count();
+      if (total == 0) {
+        return 0.0;
+      }
+      double sum = 0.0;
+      for (std::size_t i = 0; i < counts_.size(); ++i) {
+        if (counts_[i] != 0) {
+          double lower = static_cast<double>(lowerBound(i));
+          double upper = static_cast<double>(upperBound(i));
+          sum += counts_[i] * (lower + (upper - lower) / 2);
+        }
+      }
+      return sum / total;
+    }
+
+    // Adds in the counts of other, which must have the same precision (e.g.
+    // to combine the histograms of several processes).
+    void merge(const Snapshot& other) {
+      assert(other.precisionBits_ == precisionBits_);
+      for (std::size_t i = 0; i < counts_.size(); ++i) {
+        counts_[i] += other.counts_[i];
+      }
+    }
+
+   private:
+    friend class PerCpuHistogram;
+
+    int precisionBits_;
+    std::vector<std::uint64_t> counts_;
+  };
+
+  // precisionBits must be in [1, 16].
+  explicit PerCpuHistogram(int precisionBits = 4)
+      : precisionBits_(precisionBits),
+        buckets_(numBucketsFor(precisionBits)) {
+    assert(precisionBits >= 1 && precisionBits <= 16);
+  }
+
+  PerCpuHistogram(const PerCpuHistogram&) = delete;
+  PerCpuHistogram& operator=(const PerCpuHistogram&) = delete;
+
+  void record(std::uint64_t value) {
+    buckets_.add(bucketFor(value), 1);
+  }
+
+  // Like record(), for count occurrences of value.
+  void record(std::uint64_t value, std::uint64_t count) {
+    buckets_.add(bucketFor(value), count);
+  }
+
+  // Merges the buckets of every cpu. If exact is true, the result includes
+  // every record() that completed before the call (at the cost of an
+  // rseq::fence(), which is equivalent to an rseq::fenceWith() on each shard).
+  // Otherwise, it may miss recent ones, and a record() concurrent with the
+  // call may or may not be seen.
+  Snapshot snapshot(bool exact = true) {
+    if (exact) {
+      rseq::fence();
+    }
+    Snapshot result(precisionBits_);
+    buckets_.sumAll(result.counts_.data());
+    return result;
+  }
+
+  // The buckets of a single cpu, e.g. to spot a misbehaving core. exact has the
+  // same meaning as in snapshot(), fencing with that cpu only.
+  Snapshot snapshotCpu(int cpu, bool exact = true) {
+    if (exact) {
+      rseq::fenceWith(cpu);
+    }
+    Snapshot result(precisionBits_);
+    for (std::size_t i = 0; i < result.counts_.size(); ++i) {
+      result.counts_[i] = buckets_.forCpu(cpu, i)->load();
+    }
+    return result;
+  }
+
+  std::size_t bucketFor(std::uint64_t value) const {
+    const std::uint64_t linearLimit = std::uint64_t(1) << precisionBits_;
+    if (value < linearLimit) {
+      return value;
+    }
+    // value's top precisionBits bits pick the bucket within its power of two.
+    int shift = 63 - __builtin_clzl(value) - (precisionBits_ - 1);
+    std::uint64_t halfLimit = linearLimit / 2;
+    return linearLimit + (shift - 1) * halfLimit
+        + ((value >> shift) - halfLimit);
+  }
+
+ private:
+  // Values below 2^p get a bucket each; each of the 64 - p powers of two above
+  // that gets 2^(p - 1).
+  static std::size_t numBucketsFor(int precisionBits) {
+    return (std::size_t(1) << precisionBits)
+        + (64 - precisionBits) * (std::size_t(1) << (precisionBits - 1));
+  }
+
+  // The log2 of the width of the given bucket.
+  static int shiftFor(int precisionBits, std::size_t bucket) {
+    std::size_t linearLimit = std::size_t(1) << precisionBits;
+    if (bucket < linearLimit) {
+      return 0;
+    }
+    return static_cast<int>(
+        (bucket - linearLimit) >> (precisionBits - 1)) + 1;
+  }
+
+  static std::uint64_t widthFor(int precisionBits, std::size_t bucket) {
+    return std::uint64_t(1) << shiftFor(precisionBits, bucket);
+  }
+
+  static std::uint64_t lowerBoundFor(int precisionBits, std::size_t bucket) {
+    std::size_t linearLimit = std::size_t(1) << precisionBits;
+    if (bucket < linearLimit) {
+      return bucket;
+    }
+    std::size_t halfLimit = linearLimit / 2;
+    std::uint64_t top = halfLimit + (bucket - linearLimit) % halfLimit;
+    return top << shiftFor(precisionBits, bucket);
+  }
+
+  const int precisionBits_;
+  PerCpuArray<std::uint64_t> buckets_;
+};
+
+} // namespace rseq
@@ -0,0 +1,114 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#include "rseq/PerCpuHistogram.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "rseq/internal/NumCpus.h"
+#include "rseq/internal/SwitchToCpu.h"
+
+using namespace rseq::internal;
+
+TEST(PerCpuHistogram, BucketsTileTheRange) {
+  for (int precisionBits = 1; precisionBits <= 8; ++precisionBits) {
+    rseq::PerCpuHistogram histogram(precisionBits);
+    rseq::PerCpuHistogram::Snapshot snapshot = histogram.snapshot();
+    EXPECT_EQ(0, snapshot.lowerBound(0));
+    EXPECT_EQ(~std::uint64_t(0),
+        snapshot.upperBound(snapshot.numBuckets() - 1));
+    for (std::size_t i = 0; i < snapshot.numBuckets(); ++i) {
+      std::uint64_t lower = snapshot.lowerBound(i);
+      std::uint64_t upper = snapshot.upperBound(i);
+      ASSERT_LE(lower, upper);
+      if (i + 1 < snapshot.numBuckets()) {
+        ASSERT_EQ(upper + 1, snapshot.lowerBound(i + 1));
+      }
+      ASSERT_EQ(i, histogram.bucketFor(lower));
+      ASSERT_EQ(i, histogram.bucketFor(upper));
+      // The relative error bound.
+      ASSERT_LE((upper - lower) >> (precisionBits - 1), lower);
+    }
+  }
+}
+
+TEST(PerCpuHistogram, Percentiles) {
+  rseq::PerCpuHistogram histogram;
+  EXPECT_EQ(0, histogram.snapshot().percentile(50));
+  for (std::uint64_t i = 1; i <= 1000; ++i) {
+    histogram.record(i);
+  }
+  rseq::PerCpuHistogram::Snapshot snapshot = histogram.snapshot();
+  EXPECT_EQ(1000, snapshot.count());
+  for (double percent : {0.0, 1.0, 50.0, 90.0, 99.0, 99.9, 100.0}) {
+    std::uint64_t exact = std::max<std::uint64_t>(1, percent * 10);
+    std::uint64_t estimate = snapshot.percentile(percent);
+    EXPECT_LE(exact, estimate);
+    EXPECT_GE(exact + exact / 8, estimate);
+  }
+  EXPECT_NEAR(500.5, snapshot.mean(), 500.5 / 8);
+}
+
+TEST(PerCpuHistogram, MergesCpusAndSnapshots) {
+  rseq::PerCpuHistogram histogram;
+  for (int cpu = 0; cpu < numCpus(); ++cpu) {
+    switchToCpu(cpu);
+    histogram.record(cpu, cpu + 1);
+  }
+  rseq::PerCpuHistogram::Snapshot snapshot = histogram.snapshot();
+  for (int cpu = 0; cpu < numCpus(); ++cpu) {
+    rseq::PerCpuHistogram::Snapshot local = histogram.snapshotCpu(cpu);
+    EXPECT_EQ(cpu + 1, local.count());
+    EXPECT_EQ(cpu + 1, local.countAt(histogram.bucketFor(cpu)));
+    EXPECT_EQ(cpu + 1, snapshot.countAt(histogram.bucketFor(cpu)));
+  }
+
+  rseq::PerCpuHistogram other;
+  other.record(1000000);
+  snapshot.merge(other.snapshot());
+  EXPECT_EQ(numCpus() * (numCpus() + 1) / 2 + 1, snapshot.count());
+  EXPECT_LE(1000000, snapshot.percentile(100));
+}
+
+TEST(PerCpuHistogram, ConcurrentRecords) {
+  const int kNumThreads = 2 * numCpus();
+  const int kRecordsPerThread = 200000;
+  rseq::PerCpuHistogram histogram;
+  std::vector<std::thread> threads;
+  for (int i = 0; i < kNumThreads; ++i) {
+    threads.emplace_back([&, i]() {
+      std::mt19937_64 rng(i);
+      for (int j = 0; j < kRecordsPerThread; ++j) {
+        if (j % 1000 == 0) {
+          switchToCpu((i + j / 1000) % numCpus());
+        }
+        histogram.record(rng() >> (rng() % 64));
+      }
+    });
+  }
+  // Approximate snapshots only ever grow.
+  std::uint64_t lastCount = 0;
+  for (int i = 0; i < 100; ++i) {
+    std::uint64_t count = histogram.snapshot(false).count();
+    EXPECT_LE(lastCount, count);
+    lastCount = count;
+  }
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+  EXPECT_EQ(
+      std::uint64_t(kNumThreads) * kRecordsPerThread,
+      histogram.snapshot().count());
+}
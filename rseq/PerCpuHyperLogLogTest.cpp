@@ -0,0 +1,75 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#include "rseq/PerCpuHyperLogLog.h"
+
+#include <cstdint>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "rseq/internal/NumCpus.h"
+#include "rseq/internal/SwitchToCpu.h"
+
+using namespace rseq::internal;
+
+TEST(PerCpuHyperLogLog, EstimatesSmallAndLargeCardinalities) {
+  rseq::PerCpuHyperLogLog hll;
+  EXPECT_EQ(0.0, hll.estimate());
+  for (std::uint64_t i = 0; i < 100; ++i) {
+    hll.add(i);
+  }
+  EXPECT_NEAR(100.0, hll.estimate(), 3.0);
+  for (std::uint64_t i = 0; i < 1000000; ++i) {
+    hll.add(i);
+  }
+  // Six standard errors.
+  EXPECT_NEAR(1000000.0, hll.estimate(), 1000000.0 * 0.1);
+}
+
+TEST(PerCpuHyperLogLog, DuplicatesOnOtherCpusDontCount) {
+  rseq::PerCpuHyperLogLog hll(10);
+  for (int cpu = 0; cpu < numCpus(); ++cpu) {
+    switchToCpu(cpu);
+    for (std::uint64_t i = 0; i < 10000; ++i) {
+      hll.add(i);
+    }
+  }
+  double estimate = hll.estimate();
+  EXPECT_NEAR(10000.0, estimate, 10000.0 * 0.2);
+
+  // The registers merged across processes work the same way.
+  std::vector<std::uint8_t> registers = hll.registers();
+  EXPECT_EQ(1024, registers.size());
+  rseq::PerCpuHyperLogLog::merge(&registers, hll.registers());
+  EXPECT_EQ(estimate, rseq::PerCpuHyperLogLog::estimate(registers));
+}
+
+TEST(PerCpuHyperLogLog, MergesDisjointSetsAcrossCpus) {
+  const int kNumThreads = 2 * numCpus();
+  const std::uint64_t kKeysPerThread = 50000;
+  rseq::PerCpuHyperLogLog hll;
+  std::vector<std::thread> threads;
+  for (int i = 0; i < kNumThreads; ++i) {
+    threads.emplace_back([&, i]() {
+      for (std::uint64_t j = 0; j < kKeysPerThread; ++j) {
+        if (j % 1000 == 0) {
+          switchToCpu((i + j / 1000) % numCpus());
+        }
+        hll.add(i * kKeysPerThread + j);
+      }
+    });
+  }
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+  double expected = static_cast<double>(kNumThreads * kKeysPerThread);
+  EXPECT_NEAR(expected, hll.estimate(), expected * 0.1);
+}
@@ -0,0 +1,159 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+#include "rseq/PerCpu.h"
+#include "rseq/Rseq.h"
+#include "rseq/internal/CachelinePadded.h"
+#include "rseq/internal/Likely.h"
+
+namespace rseq {
+
+// Hands out unique 64-bit ids (request ids, object ids, sequence numbers).
+// Each cpu reserves a block of blockSize ids at a time from a global counter,
+// and hands them out with an rseq store; so the global counter is touched once
+// per block rather than once per id.
+//
+// Ids are unique, but not dense: the rest of a block can be thrown away when a
+// thread races with another one refilling the same cpu's block. The ordering
+// guarantee depends on the Ordering passed at construction:
+// - kUnordered: none beyond uniqueness. A refill hands its caller the first id
+//   of the new block right away, whatever happens to the rest of it.
+// - kMonotonicPerCpu: the ids handed out on a given cpu increase, in the order
+//   of the rseqs that hand them out. A refill hands out its first id in the
+//   same rseq that installs the block, and abandons its block if the cpu has
+//   moved on to a later one in the meantime.
+// In both cases, ids from different cpus interleave arbitrarily.
+class PerCpuIdGenerator {
+ public:
+  enum Ordering {
+    kUnordered,
+    kMonotonicPerCpu,
+  };
+
+  explicit PerCpuIdGenerator(
+      std::uint64_t blockSize = 1024,
+      Ordering ordering = kUnordered,
+      std::uint64_t firstId = 0)
+      : blockSize_(blockSize == 0 ? 1 : blockSize), ordering_(ordering) {
+    nextBlock_.get()->store(firstId);
+    // Shards start out as [0, 0), which is empty.
+  }
+
+  PerCpuIdGenerator(const PerCpuIdGenerator&) = delete;
+  PerCpuIdGenerator& operator=(const PerCpuIdGenerator&) = delete;
+
+  // For tests: hook(kReserved) runs after a refill reserves its block, and
+  // hook(kInstalling) between the two stores that install it.
+  enum RefillStage {
+    kReserved,
+    kInstalling,
+  };
+  void setRefillHookForTesting(void (*hook)(RefillStage)) {
+    refillHook_ = hook;
+  }
+
+  std::uint64_t next() {
+    while (true) {
+      Shard* shard = shards_.forShard(rseq::begin());
+      std::uint64_t id = shard->next.load();
+      if (RSEQ_UNLIKELY(id >= shard->end.load())) {
+        break;
+      }
+      if (RSEQ_LIKELY(rseq::store(&shard->next, id + 1))) {
+        return id;
+      }
+    }
+    return ordering_ == kUnordered ? refillUnordered() : refillMonotonic();
+  }
+
+ private:
+  // A shard's ids are [next, end). Installing a block stores next, then end:
+  // in between, next is at or past the old end (both refills refuse to install
+  // a block that isn't later than the shard's end), so the shard looks empty
+  // rather than handing out ids from the wrong block.
+  struct Shard {
+    rseq::Value<std::uint64_t> next;
+    rseq::Value<std::uint64_t> end;
+  };
+
+  std::uint64_t reserveBlock() {
+    std::uint64_t block =
+        nextBlock_.get()->fetch_add(blockSize_, std::memory_order_relaxed);
+    runRefillHook(kReserved);
+    return block;
+  }
+
+  void runRefillHook(RefillStage stage) {
+    if (RSEQ_UNLIKELY(refillHook_ != nullptr)) {
+      refillHook_(stage);
+    }
+  }
+
+  bool install(Shard* shard, std::uint64_t block) {
+    if (!rseq::store(&shard->next, block + 1)) {
+      return false;
+    }
+    runRefillHook(kInstalling);
+    return rseq::store(&shard->end, block + blockSize_);
+  }
+
+  std::uint64_t refillUnordered() {
+    std::uint64_t block = reserveBlock();
+    // Keep the rest of the block if the shard has one. If the shard has
+    // already moved past our block (we were slow to get here after reserving
+    // it), the caller still gets the first id, but the rest is thrown away.
+    shards_.withLocal([&](Shard& shard) {
+      std::uint64_t end = shard.end.load();
+      if (shard.next.load() < end || end > block) {
+        return true;
+      }
+      return install(&shard, block);
+    });
+    return block;
+  }
+
+  std::uint64_t refillMonotonic() {
+    std::uint64_t block = reserveBlock();
+    while (true) {
+      Shard* shard = shards_.forShard(rseq::begin());
+      std::uint64_t next = shard->next.load();
+      std::uint64_t end = shard->end.load();
+      if (next < end) {
+        // Someone else refilled the shard (or we moved to a shard that had ids
+        // left); ours is no longer needed.
+        if (rseq::store(&shard->next, next + 1)) {
+          return next;
+        }
+        continue;
+      }
+      if (end > block) {
+        // The shard has already used up a later block than ours, so our ids
+        // would go backwards. Get a new one.
+        block = reserveBlock();
+        continue;
+      }
+      if (install(shard, block)) {
+        return block;
+      }
+    }
+  }
+
+  const std::uint64_t blockSize_;
+  const Ordering ordering_;
+  void (*refillHook_)(RefillStage) = nullptr;
+  internal::CachelinePadded<std::atomic<std::uint64_t>> nextBlock_;
+  PerCpu<Shard> shards_;
+};
+
+} // namespace rseq
@@ -0,0 +1,124 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#include "rseq/PerCpuIdGenerator.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "rseq/internal/NumCpus.h"
+#include "rseq/internal/SwitchToCpu.h"
+
+using namespace rseq::internal;
+
+TEST(PerCpuIdGenerator, HandsOutBlocks) {
+  rseq::PerCpuIdGenerator generator(10, rseq::PerCpuIdGenerator::kUnordered, 5);
+  switchToCpu(0);
+  for (std::uint64_t i = 5; i < 25; ++i) {
+    EXPECT_EQ(i, generator.next());
+  }
+  if (numCpus() > 1) {
+    switchToCpu(1);
+    EXPECT_EQ(25, generator.next());
+    switchToCpu(0);
+    EXPECT_EQ(35, generator.next());
+  }
+}
+
+TEST(PerCpuIdGenerator, MonotonicPerCpu) {
+  rseq::PerCpuIdGenerator generator(
+      7, rseq::PerCpuIdGenerator::kMonotonicPerCpu);
+  std::vector<std::uint64_t> last(numCpus());
+  for (int i = 0; i < 1000; ++i) {
+    int cpu = i / 3 % numCpus();
+    switchToCpu(cpu);
+    std::uint64_t id = generator.next();
+    if (i >= numCpus() * 3) {
+      EXPECT_LT(last[cpu], id);
+    }
+    last[cpu] = id;
+  }
+}
+
+void expectUniqueIds(rseq::PerCpuIdGenerator::Ordering ordering) {
+  const int kNumThreads = 2 * numCpus();
+  const int kIdsPerThread = 200000;
+  rseq::PerCpuIdGenerator generator(64, ordering);
+  std::vector<std::vector<std::uint64_t>> ids(kNumThreads);
+  std::vector<std::thread> threads;
+  for (int i = 0; i < kNumThreads; ++i) {
+    threads.emplace_back([&, i]() {
+      for (int j = 0; j < kIdsPerThread; ++j) {
+        if (j % 1000 == 0) {
+          switchToCpu((i + j / 1000) % numCpus());
+        }
+        ids[i].push_back(generator.next());
+      }
+    });
+  }
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+  std::vector<std::uint64_t> all;
+  for (auto& threadIds : ids) {
+    all.insert(all.end(), threadIds.begin(), threadIds.end());
+  }
+  std::sort(all.begin(), all.end());
+  EXPECT_TRUE(std::adjacent_find(all.begin(), all.end()) == all.end());
+}
+
+TEST(PerCpuIdGenerator, ConcurrentIdsAreUnique) {
+  expectUniqueIds(rseq::PerCpuIdGenerator::kUnordered);
+}
+
+TEST(PerCpuIdGenerator, ConcurrentMonotonicIdsAreUnique) {
+  expectUniqueIds(rseq::PerCpuIdGenerator::kMonotonicPerCpu);
+}
+
+static rseq::PerCpuIdGenerator* hookedGenerator;
+static std::vector<std::uint64_t> idsFromHook;
+static bool inHook;
+
+// Makes the refill that calls it stale (by using up two later blocks on this
+// cpu), then evicts it between the stores that install its block.
+static void makeStaleAndEvict(rseq::PerCpuIdGenerator::RefillStage stage) {
+  if (inHook) {
+    return;
+  }
+  inHook = true;
+  if (stage == rseq::PerCpuIdGenerator::kReserved) {
+    idsFromHook.push_back(hookedGenerator->next());
+    idsFromHook.push_back(hookedGenerator->next());
+  } else {
+    std::thread([]() { rseq::fenceWith(0); }).join();
+  }
+  inHook = false;
+}
+
+TEST(PerCpuIdGenerator, StaleRefillSurvivesPartialCommit) {
+  rseq::PerCpuIdGenerator generator(1);
+  switchToCpu(0);
+  generator.next();
+  std::vector<std::uint64_t> ids = {generator.next()};
+  hookedGenerator = &generator;
+  generator.setRefillHookForTesting(makeStaleAndEvict);
+  ids.push_back(generator.next());
+  generator.setRefillHookForTesting(nullptr);
+  ASSERT_EQ(2, idsFromHook.size());
+  ids.insert(ids.end(), idsFromHook.begin(), idsFromHook.end());
+  for (int i = 0; i < 5; ++i) {
+    ids.push_back(generator.next());
+  }
+  std::sort(ids.begin(), ids.end());
+  EXPECT_TRUE(std::adjacent_find(ids.begin(), ids.end()) == ids.end());
+}
@@ -0,0 +1,218 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "rseq/PerCpu.h"
+#include "rseq/Rseq.h"
+#include "rseq/internal/Likely.h"
+#include "rseq/internal/Mutex.h"
+
+namespace rseq {
+
+// Counters keyed by arbitrary strings (per endpoint, per tenant, ...), where
+// updates are combined in a small per-cpu table before they reach the global
+// map.
+//
+// The global map owns one node per key, holding the key and its flushed total
+// in an atomic; nodes live as long as the PerCpuKeyedCounter. Each cpu has an
+// open-addressed table of kSlots (node, hash, pending delta) slots:
+// - add() probes the local table for the key (comparing against the node's
+//   key, which is immutable, so it's safe to read even if the rseq has ended),
+//   and adds to the slot's delta with an rseq store. Only a key missing from
+//   the table takes the global map's lock, to find or create its node; the
+//   node is then installed in a free slot (hash, delta, and node, in that
+//   order; a slot is in use once its node is set).
+// - If the key's probe sequence is too long, the local table is flushed first:
+//   each slot's delta is taken with an rseq store, added to its node's total,
+//   and the slot is freed.
+// - flush() does the same to every cpu's table with a remote rseq (see
+//   PerCpu::drain()); call it periodically to bound how stale the global
+//   totals get.
+// A slot that's freed while later slots in its probe sequence aren't (because
+// the flushing thread got preempted) can lead to the same key getting two
+// slots; that's harmless, since they're just two deltas.
+template <int kSlots = 64>
+class PerCpuKeyedCounter {
+ public:
+  PerCpuKeyedCounter() {
+    mu_.init();
+  }
+
+  PerCpuKeyedCounter(const PerCpuKeyedCounter&) = delete;
+  PerCpuKeyedCounter& operator=(const PerCpuKeyedCounter&) = delete;
+
+  void add(const std::string& key, std::int64_t delta = 1) {
+    std::uint64_t hash = std::hash<std::string>()(key);
+    Node* node = nullptr;
+    while (true) {
+      Shard* shard = shards_.forShard(rseq::begin());
+      Slot* free = nullptr;
+      for (int i = 0; i < kMaxProbes; ++i) {
+        Slot* slot = &shard->slots[(hash + i) % kSlots];
+        Node* slotNode = slot->node.load();
+        if (slotNode == nullptr) {
+          free = slot;
+          break;
+        }
+        if (slot->hash.load() == hash && slotNode->key == key) {
+          std::int64_t updated = slot->delta.load() + delta;
+          if (RSEQ_LIKELY(rseq::store(&slot->delta, updated))) {
+            return;
+          }
+          break;
+        }
+      }
+      if (free == nullptr) {
+        if (rseq::validate()) {
+          flushLocal();
+        }
+        continue;
+      }
+      // A miss. Find the node (without holding up the rseq on the lock, if we
+      // can help it), then install it.
+      if (node == nullptr) {
+        node = findOrCreate(key);
+        continue;
+      }
+      if (rseq::store(&free->hash, hash)
+          && rseq::store(&free->delta, delta)
+          && rseq::store(&free->node, node)) {
+        return;
+      }
+    }
+  }
+
+  // Moves every cpu's pending deltas into the global totals.
+  void flush() {
+    for (int shard = 0; shard < shards_.numShards(); ++shard) {
+      int next = 0;
+      shards_.drain(shard, [&](Shard& target) {
+        for (; next < kSlots; ++next) {
+          if (!flushSlot(&target.slots[next])) {
+            return false;
+          }
+        }
+        return true;
+      });
+    }
+  }
+
+  // The flushed total plus the deltas pending on each cpu. Includes every
+  // add() of key that completed before the call, unless a flush was moving it
+  // concurrently.
+  std::int64_t read(const std::string& key) {
+    Node* node;
+    {
+      internal::mutex::LockGuard<internal::mutex::Mutex> lg(mu_);
+      auto it = nodes_.find(key);
+      if (it == nodes_.end()) {
+        return 0;
+      }
+      node = it->second.get();
+    }
+    // Makes the stores of any rseq that committed before this point visible
+    // to us.
+    rseq::fence();
+    std::int64_t result = node->total.load();
+    shards_.forEach([&](int /* shard */, Shard& shard) {
+      for (int i = 0; i < kSlots; ++i) {
+        if (shard.slots[i].node.load() == node) {
+          result += shard.slots[i].delta.load();
+        }
+      }
+    });
+    return result;
+  }
+
+  // Flushes, then returns every key with its total.
+  std::vector<std::pair<std::string, std::int64_t>> snapshot() {
+    flush();
+    std::vector<std::pair<std::string, std::int64_t>> result;
+    internal::mutex::LockGuard<internal::mutex::Mutex> lg(mu_);
+    for (auto& kv : nodes_) {
+      result.emplace_back(kv.first, kv.second->total.load());
+    }
+    return result;
+  }
+
+ private:
+  struct Node {
+    explicit Node(const std::string& k) : key(k), total(0) {}
+
+    const std::string key;
+    std::atomic<std::int64_t> total;
+  };
+
+  struct Slot {
+    rseq::Value<Node*> node;
+    rseq::Value<std::uint64_t> hash;
+    rseq::Value<std::int64_t> delta;
+  };
+
+  struct Shard {
+    Slot slots[kSlots];
+  };
+
+  // How far add() looks for a key (or a free slot) before flushing.
+  constexpr static int kMaxProbes = kSlots < 8 ? kSlots : 8;
+
+  Node* findOrCreate(const std::string& key) {
+    internal::mutex::LockGuard<internal::mutex::Mutex> lg(mu_);
+    std::unique_ptr<Node>& node = nodes_[key];
+    if (node == nullptr) {
+      node.reset(new Node(key));
+    }
+    return node.get();
+  }
+
+  // Must be called in an rseq on the slot's shard. Returns false if the rseq
+  // ended first; any delta taken before then has been accounted for.
+  bool flushSlot(Slot* slot) {
+    Node* node = slot->node.load();
+    if (node == nullptr) {
+      return true;
+    }
+    std::int64_t delta = slot->delta.load();
+    if (!rseq::store(&slot->delta, 0)) {
+      return false;
+    }
+    // The delta is ours now, even if the rseq ends before we get to use it.
+    if (delta != 0) {
+      node->total.fetch_add(delta);
+    }
+    return rseq::store(&slot->node, nullptr);
+  }
+
+  // Flushes the calling thread's table, one slot at a time (so if the thread
+  // migrates partway through, the rest happens on whichever shard it's on).
+  void flushLocal() {
+    for (int i = 0; i < kSlots; ++i) {
+      shards_.withLocal([&](Shard& shard) {
+        return flushSlot(&shard.slots[i]);
+      });
+    }
+  }
+
+  internal::mutex::Mutex mu_;
+  std::unordered_map<std::string, std::unique_ptr<Node>> nodes_;
+  PerCpu<Shard> shards_;
+};
+
+} // namespace rseq
@@ -0,0 +1,104 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#include "rseq/PerCpuKeyedCounter.h"
+
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "rseq/internal/NumCpus.h"
+#include "rseq/internal/SwitchToCpu.h"
+
+using namespace rseq::internal;
+
+TEST(PerCpuKeyedCounter, CountsPerKey) {
+  rseq::PerCpuKeyedCounter<> counter;
+  EXPECT_EQ(0, counter.read("a"));
+  for (int cpu = 0; cpu < numCpus(); ++cpu) {
+    switchToCpu(cpu);
+    counter.add("a");
+    counter.add("b", 10);
+    counter.add("a", -3);
+  }
+  EXPECT_EQ(-2 * numCpus(), counter.read("a"));
+  EXPECT_EQ(10 * numCpus(), counter.read("b"));
+  counter.flush();
+  EXPECT_EQ(-2 * numCpus(), counter.read("a"));
+  EXPECT_EQ(10 * numCpus(), counter.read("b"));
+  counter.add("a", 5);
+  EXPECT_EQ(-2 * numCpus() + 5, counter.read("a"));
+
+  auto snapshot = counter.snapshot();
+  std::map<std::string, std::int64_t> totals(snapshot.begin(), snapshot.end());
+  EXPECT_EQ(2, totals.size());
+  EXPECT_EQ(-2 * numCpus() + 5, totals["a"]);
+  EXPECT_EQ(10 * numCpus(), totals["b"]);
+}
+
+TEST(PerCpuKeyedCounter, OverflowsIntoTheGlobalMap) {
+  const int kNumKeys = 1000;
+  rseq::PerCpuKeyedCounter<16> counter;
+  for (int round = 0; round < 3; ++round) {
+    for (int i = 0; i < kNumKeys; ++i) {
+      counter.add("key" + std::to_string(i), i);
+    }
+  }
+  for (int i = 0; i < kNumKeys; ++i) {
+    ASSERT_EQ(3 * i, counter.read("key" + std::to_string(i)));
+  }
+  EXPECT_EQ(kNumKeys, counter.snapshot().size());
+}
+
+TEST(PerCpuKeyedCounter, ConcurrentAddsAndFlushes) {
+  const int kNumThreads = 2 * numCpus();
+  const int kAddsPerThread = 100000;
+  const int kNumKeys = 40;
+  rseq::PerCpuKeyedCounter<32> counter;
+  std::atomic<bool> done(false);
+  std::thread flusher([&]() {
+    while (!done.load()) {
+      counter.flush();
+      std::this_thread::yield();
+    }
+  });
+  std::vector<std::string> keys;
+  for (int i = 0; i < kNumKeys; ++i) {
+    keys.push_back("tenant/" + std::to_string(i));
+  }
+  std::vector<std::thread> threads;
+  for (int i = 0; i < kNumThreads; ++i) {
+    threads.emplace_back([&, i]() {
+      for (int j = 0; j < kAddsPerThread; ++j) {
+        if (j % 1000 == 0) {
+          switchToCpu((i + j / 1000) % numCpus());
+        }
+        counter.add(keys[j % kNumKeys]);
+      }
+    });
+  }
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+  done.store(true);
+  flusher.join();
+  std::int64_t expected = std::int64_t(kNumThreads) * kAddsPerThread / kNumKeys;
+  for (int i = 0; i < kNumKeys; ++i) {
+    EXPECT_EQ(expected, counter.read(keys[i]));
+  }
+  for (auto& kv : counter.snapshot()) {
+    EXPECT_EQ(expected, kv.second);
+  }
+}
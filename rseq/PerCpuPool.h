@@ -0,0 +1,320 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <memory>
+
+#include "rseq/PerCpu.h"
+#include "rseq/Rseq.h"
+#include "rseq/internal/Mutex.h"
+#include "rseq/internal/NumCpus.h"
+
+namespace rseq {
+
+// A pool of T*'s (buffers, RPC contexts, ...), in the style of a magazine
+// allocator. Each shard keeps a small stack of objects, which get() and put()
+// pop and push with rseq operations. Past that:
+// - put() on a full shard moves a magazine's worth of objects (the top half of
+//   the stack) to a shared depot, and get() on an empty one takes a magazine
+//   back. The depot is protected by a mutex, which we take once per
+//   kMagazineSize objects at most.
+// - get() with an empty shard and an empty depot steals half of the objects
+//   from some other shard (using rseq::beginRemote(), so the shard's owner
+//   needn't cooperate). This costs a heavy fence per shard tried, so it's a
+//   last resort.
+//
+// The pool holds at most 2 * kMagazineSize objects per shard plus
+// maxDepotMagazines magazines (numCpus() by default), so how much it keeps
+// around scales with the number of cpus, not with the number of threads that
+// use it. Objects put() past that are handed to the Deleter, as are any still
+// pooled when the pool is destroyed. get() returns nullptr if the pool is
+// empty; it's up to the caller to make a new object then.
+template <
+    typename T,
+    int kMagazineSize = 16,
+    typename Deleter = std::default_delete<T>>
+class PerCpuPool {
+ public:
+  static_assert(kMagazineSize > 0, "Magazines must hold something");
+
+  explicit PerCpuPool(
+      int maxDepotMagazines = internal::numCpus(),
+      Deleter deleter = Deleter())
+      : maxDepotMagazines_(maxDepotMagazines),
+        deleter_(deleter),
+        fullMagazines_(nullptr),
+        numFullMagazines_(0),
+        emptyMagazines_(nullptr) {
+    depotMu_.init();
+  }
+
+  PerCpuPool(const PerCpuPool&) = delete;
+  PerCpuPool& operator=(const PerCpuPool&) = delete;
+
+  // No other thread may be using the pool.
+  ~PerCpuPool() {
+    rseq::fence();
+    shards_.forEach([&](int /* shard */, Shard& shard) {
+      for (std::uint64_t i = 0; i < shard.size.load(); ++i) {
+        deleter_(shard.items[i].load());
+      }
+    });
+    freeMagazineList(fullMagazines_);
+    freeMagazineList(emptyMagazines_);
+  }
+
+  T* get() {
+    T* result;
+    if (tryPopLocal(&result)) {
+      return result;
+    }
+    Magazine* magazine = takeFullMagazine();
+    if (magazine == nullptr) {
+      magazine = steal();
+      if (magazine == nullptr) {
+        return nullptr;
+      }
+    }
+    result = magazine->items[--magazine->size];
+    refillLocal(magazine);
+    return result;
+  }
+
+  void put(T* item) {
+    while (true) {
+      if (tryPushLocal(item)) {
+        return;
+      }
+      if (!spillLocal()) {
+        deleter_(item);
+        return;
+      }
+    }
+  }
+
+ private:
+  static constexpr std::uint64_t kShardCapacity = 2 * kMagazineSize;
+
+  struct Shard {
+    // items[0, size) are pooled; the ones above are garbage.
+    rseq::Value<std::uint64_t> size;
+    rseq::Value<T*> items[kShardCapacity];
+  };
+
+  struct Magazine {
+    Magazine* next;
+    int size;
+    T* items[kMagazineSize];
+  };
+
+  bool tryPopLocal(T** result) {
+    while (true) {
+      Shard* shard = shards_.forShard(rseq::begin());
+      std::uint64_t size = shard->size.load();
+      if (size == 0) {
+        return false;
+      }
+      T* item = shard->items[size - 1].load();
+      if (rseq::store(&shard->size, size - 1)) {
+        *result = item;
+        return true;
+      }
+    }
+  }
+
+  bool tryPushLocal(T* item) {
+    while (true) {
+      Shard* shard = shards_.forShard(rseq::begin());
+      std::uint64_t size = shard->size.load();
+      if (size == kShardCapacity) {
+        return false;
+      }
+      // If the second store fails, the first one only wrote garbage.
+      if (rseq::store(&shard->items[size], item)
+          && rseq::store(&shard->size, size + 1)) {
+        return true;
+      }
+    }
+  }
+
+  // Moves the top kMagazineSize objects of a full local shard to the depot.
+  // Returns false if the depot has no room for them.
+  bool spillLocal() {
+    Magazine* magazine = takeEmptyMagazine();
+    if (magazine == nullptr) {
+      return false;
+    }
+    while (true) {
+      Shard* shard = shards_.forShard(rseq::begin());
+      std::uint64_t size = shard->size.load();
+      if (size < kShardCapacity) {
+        // We moved to a shard with room after all.
+        returnEmptyMagazine(magazine);
+        return true;
+      }
+      for (int i = 0; i < kMagazineSize; ++i) {
+        magazine->items[i] = shard->items[size - kMagazineSize + i].load();
+      }
+      if (rseq::store(&shard->size, size - kMagazineSize)) {
+        break;
+      }
+    }
+    magazine->size = kMagazineSize;
+    returnFullMagazine(magazine);
+    return true;
+  }
+
+  // Pushes as many of the magazine's objects onto the local shard as fit, and
+  // gives whatever's left to the depot.
+  void refillLocal(Magazine* magazine) {
+    while (magazine->size > 0) {
+      Shard* shard = shards_.forShard(rseq::begin());
+      std::uint64_t size = shard->size.load();
+      std::uint64_t count = kShardCapacity - size;
+      if (count > static_cast<std::uint64_t>(magazine->size)) {
+        count = magazine->size;
+      }
+      if (count == 0) {
+        break;
+      }
+      bool success = true;
+      for (std::uint64_t i = 0; i < count && success; ++i) {
+        success = rseq::store(
+            &shard->items[size + i], magazine->items[magazine->size - 1 - i]);
+      }
+      if (success && rseq::store(&shard->size, size + count)) {
+        magazine->size -= count;
+      }
+    }
+    if (magazine->size == 0) {
+      returnEmptyMagazine(magazine);
+    } else {
+      // This can take the depot over its limit by a magazine, but only
+      // transiently: the objects came out of the pool a moment ago.
+      returnFullMagazine(magazine);
+    }
+  }
+
+  // Takes up to half (rounded up) of some other shard's objects. Returns
+  // nullptr if every shard is empty.
+  Magazine* steal() {
+    int numShards = shards_.numShards();
+    int self = rseq::begin();
+    Magazine* magazine = nullptr;
+    for (int i = 1; i <= numShards && magazine == nullptr; ++i) {
+      int victim = (self + i) % numShards;
+      // Don't pay for a remote rseq on shards that look empty.
+      if (shards_.forShard(victim)->size.load(std::memory_order_relaxed) == 0) {
+        continue;
+      }
+      shards_.drain(victim, [&](Shard& shard) {
+        std::uint64_t size = shard.size.load();
+        std::uint64_t count = (size + 1) / 2;
+        if (count > kMagazineSize) {
+          count = kMagazineSize;
+        }
+        if (count == 0) {
+          return true;
+        }
+        if (magazine == nullptr) {
+          magazine = allocateMagazine();
+        }
+        for (std::uint64_t j = 0; j < count; ++j) {
+          magazine->items[j] = shard.items[size - count + j].load();
+        }
+        if (!rseq::store(&shard.size, size - count)) {
+          return false;
+        }
+        magazine->size = count;
+        return true;
+      });
+      if (magazine != nullptr && magazine->size == 0) {
+        returnEmptyMagazine(magazine);
+        magazine = nullptr;
+      }
+    }
+    return magazine;
+  }
+
+  Magazine* allocateMagazine() {
+    {
+      internal::mutex::LockGuard<internal::mutex::Mutex> lg(depotMu_);
+      if (emptyMagazines_ != nullptr) {
+        Magazine* magazine = emptyMagazines_;
+        emptyMagazines_ = magazine->next;
+        magazine->size = 0;
+        return magazine;
+      }
+    }
+    Magazine* magazine = new Magazine;
+    magazine->size = 0;
+    return magazine;
+  }
+
+  // Like allocateMagazine, but returns nullptr if a full magazine would have
+  // nowhere to go in the depot.
+  Magazine* takeEmptyMagazine() {
+    {
+      internal::mutex::LockGuard<internal::mutex::Mutex> lg(depotMu_);
+      if (numFullMagazines_ >= maxDepotMagazines_) {
+        return nullptr;
+      }
+    }
+    return allocateMagazine();
+  }
+
+  Magazine* takeFullMagazine() {
+    internal::mutex::LockGuard<internal::mutex::Mutex> lg(depotMu_);
+    Magazine* magazine = fullMagazines_;
+    if (magazine != nullptr) {
+      fullMagazines_ = magazine->next;
+      --numFullMagazines_;
+    }
+    return magazine;
+  }
+
+  void returnFullMagazine(Magazine* magazine) {
+    internal::mutex::LockGuard<internal::mutex::Mutex> lg(depotMu_);
+    magazine->next = fullMagazines_;
+    fullMagazines_ = magazine;
+    ++numFullMagazines_;
+  }
+
+  void returnEmptyMagazine(Magazine* magazine) {
+    internal::mutex::LockGuard<internal::mutex::Mutex> lg(depotMu_);
+    magazine->next = emptyMagazines_;
+    emptyMagazines_ = magazine;
+  }
+
+  void freeMagazineList(Magazine* magazine) {
+    while (magazine != nullptr) {
+      Magazine* next = magazine->next;
+      for (int i = 0; i < magazine->size; ++i) {
+        deleter_(magazine->items[i]);
+      }
+      delete magazine;
+      magazine = next;
+    }
+  }
+
+  int maxDepotMagazines_;
+  Deleter deleter_;
+  PerCpu<Shard> shards_;
+
+  internal::mutex::Mutex depotMu_;
+  // Both lists are protected by depotMu_. Magazines on the full list may be
+  // partially full; ones on the empty list hold nothing.
+  Magazine* fullMagazines_;
+  int numFullMagazines_;
+  Magazine* emptyMagazines_;
+};
+
+} // namespace rseq
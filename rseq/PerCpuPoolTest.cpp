@@ -0,0 +1,138 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#include "rseq/PerCpuPool.h"
+
+#include <atomic>
+#include <set>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "rseq/internal/NumCpus.h"
+#include "rseq/internal/SwitchToCpu.h"
+
+using namespace rseq::internal;
+
+struct Item {
+  int id;
+};
+
+static std::atomic<int> numDeleted;
+
+struct CountingDeleter {
+  void operator()(Item* item) {
+    ++numDeleted;
+    delete item;
+  }
+};
+
+typedef rseq::PerCpuPool<Item, 4, CountingDeleter> Pool;
+
+TEST(PerCpuPool, StartsEmpty) {
+  Pool pool;
+  EXPECT_EQ(nullptr, pool.get());
+}
+
+TEST(PerCpuPool, ReturnsWhatWasPut) {
+  switchToCpu(0);
+  numDeleted.store(0);
+  {
+    Pool pool;
+    Item* item = new Item;
+    pool.put(item);
+    EXPECT_EQ(item, pool.get());
+    EXPECT_EQ(nullptr, pool.get());
+    pool.put(item);
+  }
+  EXPECT_EQ(1, numDeleted.load());
+}
+
+TEST(PerCpuPool, SpillsToDepotAndBoundsSize) {
+  switchToCpu(0);
+  numDeleted.store(0);
+  const int kMaxDepotMagazines = 2;
+  // Two magazines' worth in the shard, plus two in the depot.
+  const int kCapacity = 2 * 4 + kMaxDepotMagazines * 4;
+  {
+    Pool pool(kMaxDepotMagazines);
+    std::set<Item*> items;
+    for (int i = 0; i < kCapacity + 10; ++i) {
+      Item* item = new Item;
+      items.insert(item);
+      pool.put(item);
+    }
+    EXPECT_EQ(10, numDeleted.load());
+
+    int numGot = 0;
+    while (Item* item = pool.get()) {
+      EXPECT_EQ(1, items.count(item));
+      ++numGot;
+      delete item;
+    }
+    EXPECT_EQ(kCapacity, numGot);
+  }
+  EXPECT_EQ(10, numDeleted.load());
+}
+
+TEST(PerCpuPool, StealsFromOtherCpus) {
+  if (numCpus() < 2) {
+    return;
+  }
+  Pool pool;
+  switchToCpu(0);
+  Item* item = new Item;
+  pool.put(item);
+  switchToCpu(1);
+  EXPECT_EQ(item, pool.get());
+  delete item;
+}
+
+TEST(PerCpuPool, ConservesObjects) {
+  const int kNumThreads = 2 * numCpus();
+  const int kItemsPerThread = 20;
+  const int kItersPerThread = 20000;
+  numDeleted.store(0);
+  std::atomic<int> numCreated(0);
+  {
+    // Big enough that nothing gets deleted before the pool is.
+    Pool pool(kNumThreads * kItemsPerThread);
+    std::vector<std::thread> threads(kNumThreads);
+    for (int i = 0; i < kNumThreads; ++i) {
+      threads[i] = std::thread([&, i]() {
+        switchToCpu(i % numCpus());
+        std::vector<Item*> held;
+        for (int j = 0; j < kItersPerThread; ++j) {
+          if (held.size() < kItemsPerThread && (j / kItemsPerThread) % 2 == 0) {
+            Item* item = pool.get();
+            if (item == nullptr) {
+              item = new Item;
+              ++numCreated;
+            }
+            item->id = i;
+            held.push_back(item);
+          } else if (!held.empty()) {
+            EXPECT_EQ(i, held.back()->id);
+            pool.put(held.back());
+            held.pop_back();
+          }
+        }
+        for (Item* item : held) {
+          pool.put(item);
+        }
+      });
+    }
+    for (int i = 0; i < kNumThreads; ++i) {
+      threads[i].join();
+    }
+    EXPECT_EQ(0, numDeleted.load());
+  }
+  EXPECT_EQ(numCreated.load(), numDeleted.load());
+}
@@ -0,0 +1,226 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <limits>
+
+#include "rseq/PerCpu.h"
+#include "rseq/Rseq.h"
+#include "rseq/internal/Likely.h"
+#include "rseq/internal/Mutex.h"
+
+namespace rseq {
+
+// A token-bucket rate limiter: tokens accrue at tokensPerSecond into a bucket
+// holding at most burst of them, and tryAcquire(n) succeeds (taking n tokens)
+// if there are n to take.
+//
+// The bucket itself is global and protected by a mutex, but callers don't
+// take tokens from it directly. Each shard holds an allowance of tokens it has
+// already borrowed from the bucket, and tryAcquire() spends the local
+// allowance with an rseq store. Only when that runs dry does it borrow
+// another batch (batchSize tokens) from the bucket.
+//
+// Tokens are never created by the borrowing, so the total granted never
+// exceeds what the bucket has handed out. The cost is accuracy over short
+// windows: up to numShards() * batchSize tokens can be sitting in allowances.
+// They're unavailable to other cpus (so a request can be refused while the
+// global limit hasn't been reached), and they can be spent in a burst on top
+// of the bucket's own. Pick batchSize to trade contention on the bucket for
+// that error; reclaim() returns all the allowances to the bucket.
+//
+// Once the bucket runs dry, it notes when the next batch will have accrued,
+// and until then a tryAcquire() for more than what was left fails without
+// touching the bucket (just a clock read and loads of rarely-written
+// variables), so a throttled caller doesn't hammer the mutex.
+class PerCpuRateLimiter {
+ public:
+  // The bucket starts full.
+  PerCpuRateLimiter(
+      double tokensPerSecond,
+      std::uint64_t burst,
+      std::uint64_t batchSize = 64)
+      : tokensPerSecond_(tokensPerSecond),
+        burst_(static_cast<double>(burst)),
+        batchSize_(batchSize == 0 ? 1 : batchSize),
+        tokens_(static_cast<double>(burst)),
+        lastRefill_(Clock::now()),
+        emptyUntil_(0),
+        leftWhenEmpty_(0) {
+    mu_.init();
+  }
+
+  PerCpuRateLimiter(const PerCpuRateLimiter&) = delete;
+  PerCpuRateLimiter& operator=(const PerCpuRateLimiter&) = delete;
+
+  bool tryAcquire(std::uint64_t tokens = 1) {
+    while (true) {
+      Shard* shard = shards_.forShard(rseq::begin());
+      std::uint64_t allowance = shard->allowance.load();
+      if (RSEQ_UNLIKELY(allowance < tokens)) {
+        break;
+      }
+      if (RSEQ_LIKELY(rseq::store(&shard->allowance, allowance - tokens))) {
+        return true;
+      }
+    }
+    return borrowAndAcquire(tokens);
+  }
+
+  // Moves every shard's allowance back into the global bucket. Slow: does a
+  // remote rseq on each shard with an allowance.
+  void reclaim() {
+    shards_.forEach([&](int shard, Shard& current) {
+      if (current.allowance.load() == 0) {
+        return;
+      }
+      std::uint64_t reclaimed = 0;
+      shards_.drain(shard, [&](Shard& target) {
+        reclaimed = target.allowance.load();
+        return rseq::store(&target.allowance, 0);
+      });
+      giveBack(reclaimed);
+    });
+  }
+
+ private:
+  typedef std::chrono::steady_clock Clock;
+
+  struct Shard {
+    rseq::Value<std::uint64_t> allowance;
+  };
+
+  // Takes tokens (counting whatever's left of the local allowance) plus, if
+  // available, a fresh batch from the bucket, keeping the batch as the local
+  // allowance.
+  bool borrowAndAcquire(std::uint64_t tokens) {
+    if (tokens > leftWhenEmpty_.load(std::memory_order_relaxed)
+        && nowTicks() < emptyUntil_.load(std::memory_order_relaxed)) {
+      return false;
+    }
+    std::uint64_t local = 0;
+    shards_.withLocal([&](Shard& shard) {
+      local = shard.allowance.load();
+      return local == 0 || rseq::store(&shard.allowance, 0);
+    });
+    std::uint64_t needed = tokens > local ? tokens - local : 0;
+    std::uint64_t borrowed;
+    {
+      internal::mutex::LockGuard<internal::mutex::Mutex> lg(mu_);
+      refillLocked();
+      if (tokens_ < static_cast<double>(needed)) {
+        // The allowance we took goes to the bucket rather than back to the
+        // shard; it's all the same tokens.
+        tokens_ += static_cast<double>(local);
+        if (tokens_ > burst_) {
+          tokens_ = burst_;
+        }
+        markEmptyLocked(needed);
+        return false;
+      }
+      double extra = tokens_ - static_cast<double>(needed);
+      if (extra > static_cast<double>(batchSize_)) {
+        extra = static_cast<double>(batchSize_);
+      }
+      borrowed = static_cast<std::uint64_t>(extra);
+      tokens_ -= static_cast<double>(needed + borrowed);
+      if (borrowed < batchSize_) {
+        // Otherwise we'd come back for every few tokens as they trickle in.
+        markEmptyLocked(0);
+      }
+    }
+    // If someone refilled the allowance after our fast path failed, it may
+    // have covered the whole request; keep the rest of it.
+    borrowed += local + needed - tokens;
+    if (borrowed == 0) {
+      return true;
+    }
+    std::uint64_t excess = 0;
+    shards_.withLocal([&](Shard& shard) {
+      std::uint64_t allowance = shard.allowance.load();
+      std::uint64_t total = allowance + borrowed;
+      // Someone else may have refilled this shard while we were borrowing;
+      // don't let it grow past a batch.
+      excess = total > batchSize_ ? total - batchSize_ : 0;
+      return rseq::store(&shard.allowance, total - excess);
+    });
+    giveBack(excess);
+    return true;
+  }
+
+  void giveBack(std::uint64_t tokens) {
+    if (tokens == 0) {
+      return;
+    }
+    internal::mutex::LockGuard<internal::mutex::Mutex> lg(mu_);
+    refillLocked();
+    tokens_ += static_cast<double>(tokens);
+    if (tokens_ > burst_) {
+      tokens_ = burst_;
+    }
+    emptyUntil_.store(0, std::memory_order_relaxed);
+  }
+
+  static std::int64_t nowTicks() {
+    return Clock::now().time_since_epoch().count();
+  }
+
+  // Must hold mu_, just after a refill that left fewer than needed plus a
+  // batch's worth of tokens. Notes when there will be that many.
+  void markEmptyLocked(std::uint64_t needed) {
+    leftWhenEmpty_.store(
+        static_cast<std::uint64_t>(tokens_), std::memory_order_relaxed);
+    if (tokensPerSecond_ <= 0) {
+      emptyUntil_.store(
+          std::numeric_limits<std::int64_t>::max(), std::memory_order_relaxed);
+      return;
+    }
+    double deficit =
+        static_cast<double>(needed + batchSize_) - tokens_;
+    if (deficit > burst_) {
+      deficit = burst_;
+    }
+    std::chrono::duration<double> wait(deficit / tokensPerSecond_);
+    emptyUntil_.store(
+        (lastRefill_ + std::chrono::duration_cast<Clock::duration>(wait))
+            .time_since_epoch()
+            .count(),
+        std::memory_order_relaxed);
+  }
+
+  // Must hold mu_.
+  void refillLocked() {
+    Clock::time_point now = Clock::now();
+    double elapsed = std::chrono::duration<double>(now - lastRefill_).count();
+    lastRefill_ = now;
+    tokens_ += elapsed * tokensPerSecond_;
+    if (tokens_ > burst_) {
+      tokens_ = burst_;
+    }
+  }
+
+  const double tokensPerSecond_;
+  const double burst_;
+  const std::uint64_t batchSize_;
+  PerCpu<Shard> shards_;
+
+  internal::mutex::Mutex mu_;
+  double tokens_;
+  Clock::time_point lastRefill_;
+  // In Clock ticks; tryAcquire() doesn't bother the bucket before then, unless
+  // it wants no more than leftWhenEmpty_ tokens.
+  std::atomic<std::int64_t> emptyUntil_;
+  std::atomic<std::uint64_t> leftWhenEmpty_;
+};
+
+} // namespace rseq
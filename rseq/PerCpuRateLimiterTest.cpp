@@ -0,0 +1,90 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#include "rseq/PerCpuRateLimiter.h"
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "rseq/internal/NumCpus.h"
+#include "rseq/internal/SwitchToCpu.h"
+
+using namespace rseq::internal;
+
+// With no refill, these tests see exactly the initial burst.
+
+TEST(PerCpuRateLimiter, GrantsTheBurst) {
+  rseq::PerCpuRateLimiter limiter(0, 100, 8);
+  for (int i = 0; i < 100; ++i) {
+    ASSERT_TRUE(limiter.tryAcquire());
+  }
+  EXPECT_FALSE(limiter.tryAcquire());
+}
+
+TEST(PerCpuRateLimiter, AcquiresMoreThanABatch) {
+  rseq::PerCpuRateLimiter limiter(0, 100, 8);
+  EXPECT_TRUE(limiter.tryAcquire(60));
+  EXPECT_FALSE(limiter.tryAcquire(41));
+  EXPECT_TRUE(limiter.tryAcquire(40));
+  EXPECT_FALSE(limiter.tryAcquire());
+}
+
+TEST(PerCpuRateLimiter, ReclaimsAllowances) {
+  rseq::PerCpuRateLimiter limiter(0, 100, 50);
+  switchToCpu(0);
+  // Leaves most of a batch in cpu 0's allowance.
+  EXPECT_TRUE(limiter.tryAcquire());
+  limiter.reclaim();
+  // Whatever cpu we're on, we can get all of it back.
+  EXPECT_TRUE(limiter.tryAcquire(99));
+  EXPECT_FALSE(limiter.tryAcquire());
+}
+
+TEST(PerCpuRateLimiter, Refills) {
+  rseq::PerCpuRateLimiter limiter(1000000, 10, 1);
+  for (int i = 0; i < 10; ++i) {
+    ASSERT_TRUE(limiter.tryAcquire());
+  }
+  std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  // Refilled, but only up to the burst.
+  EXPECT_TRUE(limiter.tryAcquire(10));
+  EXPECT_FALSE(limiter.tryAcquire(1000));
+}
+
+TEST(PerCpuRateLimiter, ConcurrentAcquiresNeverOvershoot) {
+  const int kNumThreads = 4 * numCpus();
+  const std::uint64_t kBurst = 100000;
+  rseq::PerCpuRateLimiter limiter(0, kBurst, 16);
+  std::atomic<std::uint64_t> granted(0);
+  std::vector<std::thread> threads(kNumThreads);
+  for (int i = 0; i < kNumThreads; ++i) {
+    threads[i] = std::thread([&, i]() {
+      switchToCpu(i % numCpus());
+      std::uint64_t myGranted = 0;
+      while (limiter.tryAcquire()) {
+        ++myGranted;
+      }
+      granted += myGranted;
+    });
+  }
+  for (int i = 0; i < kNumThreads; ++i) {
+    threads[i].join();
+  }
+  EXPECT_GE(kBurst, granted.load());
+  // Everything not granted is in some allowance.
+  limiter.reclaim();
+  while (limiter.tryAcquire()) {
+    ++granted;
+  }
+  EXPECT_EQ(kBurst, granted.load());
+}
@@ -0,0 +1,157 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+#include "rseq/PerCpu.h"
+#include "rseq/Rseq.h"
+#include "rseq/internal/Likely.h"
+
+namespace rseq {
+
+// A counting semaphore for admission control (e.g. a cap on in-flight
+// requests), where acquiring and releasing a permit is usually an rseq load
+// and store on the local shard.
+//
+// Each shard caches a slice of the permits. A shard that runs dry takes a
+// batch (batchSize permits) from a global pool, and one that accumulates more
+// than two batches (because permits get released on a different cpu than the
+// one they were acquired on) gives a batch back. Only if both the shard and
+// the pool are empty does tryAcquire() look at other shards, taking half of
+// the first nonempty one's permits with a remote rseq; so it fails only if no
+// permits were available anywhere when it looked.
+//
+// There's no blocking acquire; callers that are refused are expected to shed
+// or queue the work themselves.
+class PerCpuSemaphore {
+ public:
+  explicit PerCpuSemaphore(std::uint64_t permits, std::uint64_t batchSize = 8)
+      : batchSize_(batchSize == 0 ? 1 : batchSize),
+        pool_(permits) {}
+
+  PerCpuSemaphore(const PerCpuSemaphore&) = delete;
+  PerCpuSemaphore& operator=(const PerCpuSemaphore&) = delete;
+
+  bool tryAcquire() {
+    while (true) {
+      Shard* shard = shards_.forShard(rseq::begin());
+      std::uint64_t permits = shard->permits.load();
+      if (RSEQ_UNLIKELY(permits == 0)) {
+        break;
+      }
+      if (RSEQ_LIKELY(rseq::store(&shard->permits, permits - 1))) {
+        return true;
+      }
+    }
+    return acquireSlow();
+  }
+
+  void release() {
+    std::uint64_t excess = 0;
+    shards_.withLocal([&](Shard& shard) {
+      std::uint64_t permits = shard.permits.load() + 1;
+      excess = permits > 2 * batchSize_ ? batchSize_ : 0;
+      return rseq::store(&shard.permits, permits - excess);
+    });
+    if (RSEQ_UNLIKELY(excess != 0)) {
+      pool_.fetch_add(excess);
+    }
+  }
+
+  // The number of permits not currently held. Exact with respect to every
+  // tryAcquire() and release() that completed before the call, if none are
+  // in progress during it (otherwise, permits on their way between a shard and
+  // the pool may be missed).
+  std::uint64_t available() {
+    // Makes the stores of any rseq that committed before this point visible
+    // to us.
+    rseq::fence();
+    std::uint64_t result = pool_.load();
+    shards_.forEach([&](int /* shard */, Shard& shard) {
+      result += shard.permits.load();
+    });
+    return result;
+  }
+
+ private:
+  struct Shard {
+    rseq::Value<std::uint64_t> permits;
+  };
+
+  bool acquireSlow() {
+    std::uint64_t taken = takeFromPool();
+    if (taken == 0) {
+      taken = steal();
+    }
+    if (taken == 0) {
+      return false;
+    }
+    // Keep one for the caller, and the rest locally.
+    if (taken > 1) {
+      deposit(taken - 1);
+    }
+    return true;
+  }
+
+  std::uint64_t takeFromPool() {
+    std::uint64_t pool = pool_.load();
+    while (pool != 0) {
+      std::uint64_t taken = pool < batchSize_ ? pool : batchSize_;
+      if (pool_.compare_exchange_weak(pool, pool - taken)) {
+        return taken;
+      }
+    }
+    return 0;
+  }
+
+  // Takes half (rounded up) of the permits of the first nonempty shard.
+  std::uint64_t steal() {
+    int numShards = shards_.numShards();
+    int self = rseq::begin();
+    for (int i = 0; i < numShards; ++i) {
+      int victim = (self + i) % numShards;
+      // Don't pay for a remote rseq on shards that look empty.
+      if (shards_.forShard(victim)->permits.load(std::memory_order_relaxed)
+          == 0) {
+        continue;
+      }
+      std::uint64_t stolen = 0;
+      shards_.drain(victim, [&](Shard& target) {
+        std::uint64_t permits = target.permits.load();
+        stolen = (permits + 1) / 2;
+        return rseq::store(&target.permits, permits - stolen);
+      });
+      if (stolen != 0) {
+        return stolen;
+      }
+    }
+    return 0;
+  }
+
+  void deposit(std::uint64_t permits) {
+    std::uint64_t excess = 0;
+    shards_.withLocal([&](Shard& shard) {
+      std::uint64_t total = shard.permits.load() + permits;
+      excess = total > 2 * batchSize_ ? total - batchSize_ : 0;
+      return rseq::store(&shard.permits, total - excess);
+    });
+    if (excess != 0) {
+      pool_.fetch_add(excess);
+    }
+  }
+
+  const std::uint64_t batchSize_;
+  PerCpu<Shard> shards_;
+  std::atomic<std::uint64_t> pool_;
+};
+
+} // namespace rseq
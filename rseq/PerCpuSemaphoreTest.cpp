@@ -0,0 +1,96 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#include "rseq/PerCpuSemaphore.h"
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "rseq/internal/NumCpus.h"
+#include "rseq/internal/SwitchToCpu.h"
+
+using namespace rseq::internal;
+
+TEST(PerCpuSemaphore, AcquiresUpToTheLimit) {
+  rseq::PerCpuSemaphore semaphore(10, 4);
+  EXPECT_EQ(10, semaphore.available());
+  for (int i = 0; i < 10; ++i) {
+    ASSERT_TRUE(semaphore.tryAcquire());
+  }
+  EXPECT_FALSE(semaphore.tryAcquire());
+  EXPECT_EQ(0, semaphore.available());
+  for (int i = 0; i < 10; ++i) {
+    semaphore.release();
+  }
+  EXPECT_EQ(10, semaphore.available());
+}
+
+TEST(PerCpuSemaphore, ZeroPermits) {
+  rseq::PerCpuSemaphore semaphore(0);
+  EXPECT_FALSE(semaphore.tryAcquire());
+  semaphore.release();
+  EXPECT_TRUE(semaphore.tryAcquire());
+  EXPECT_FALSE(semaphore.tryAcquire());
+}
+
+TEST(PerCpuSemaphore, FindsPermitsOnOtherCpus) {
+  if (numCpus() < 2) {
+    return;
+  }
+  rseq::PerCpuSemaphore semaphore(100, 100);
+  switchToCpu(0);
+  for (int i = 0; i < 100; ++i) {
+    ASSERT_TRUE(semaphore.tryAcquire());
+  }
+  switchToCpu(1);
+  for (int i = 0; i < 100; ++i) {
+    semaphore.release();
+  }
+  // Cpu 1's shard holds them all now.
+  switchToCpu(0);
+  for (int i = 0; i < 100; ++i) {
+    ASSERT_TRUE(semaphore.tryAcquire());
+  }
+  EXPECT_FALSE(semaphore.tryAcquire());
+}
+
+TEST(PerCpuSemaphore, ConcurrentAcquiresRespectTheLimit) {
+  const int kNumThreads = 4 * numCpus();
+  const int kIterations = 100000;
+  const std::uint64_t kPermits = 10;
+  rseq::PerCpuSemaphore semaphore(kPermits, 2);
+  std::atomic<std::uint64_t> inFlight(0);
+  std::vector<std::thread> threads(kNumThreads);
+  for (int i = 0; i < kNumThreads; ++i) {
+    threads[i] = std::thread([&, i]() {
+      // Acquire on one cpu, release on another, so that permits have to move.
+      for (int j = 0; j < kIterations; ++j) {
+        if (j % 100 == 0) {
+          switchToCpu((i + j / 100) % numCpus());
+        }
+        if (!semaphore.tryAcquire()) {
+          continue;
+        }
+        ASSERT_GE(kPermits, ++inFlight);
+        --inFlight;
+        if (j % 100 == 99) {
+          switchToCpu((i + j / 100 + 1) % numCpus());
+        }
+        semaphore.release();
+      }
+    });
+  }
+  for (int i = 0; i < kNumThreads; ++i) {
+    threads[i].join();
+  }
+  EXPECT_EQ(kPermits, semaphore.available());
+}
@@ -0,0 +1,118 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+#include "rseq/PerCpu.h"
+#include "rseq/Rseq.h"
+
+namespace rseq {
+
+// Like PerCpu<T>, but each shard also has a sequence count that update() makes
+// odd for the duration of each update, seqlock-style. That lets other threads
+// (say, a monitoring thread that looks at every shard every few milliseconds)
+// read a consistent snapshot of a shard that's updated with several stores,
+// without a remote rseq or rseq::fenceWith(), and so without evicting the
+// owner or paying for a heavy fence.
+//
+// As with PerCpu, T should be made of rseq::Values. An update that ends early
+// (its rseq got evicted partway) leaves the count odd; like any multi-store
+// rseq, it must leave the shard in a valid state after any prefix of its
+// stores. The next update of the shard carries on from the odd count, and a
+// reader that keeps finding it odd falls back to a remote rseq, which closes
+// it.
+template <typename T>
+class PerCpuSeqlocked {
+ public:
+  // Shards start with a count of 0, which is even: readable, with T's
+  // default-constructed value.
+  PerCpuSeqlocked() = default;
+
+  PerCpuSeqlocked(const PerCpuSeqlocked&) = delete;
+  PerCpuSeqlocked& operator=(const PerCpuSeqlocked&) = delete;
+
+  int numShards() const {
+    return shards_.numShards();
+  }
+
+  // Calls f(T&) with the calling thread's shard, inside an rseq on that shard,
+  // with the shard's count odd. As with PerCpu::withLocal(), f should return
+  // the result of the rseq::store that commits its changes, and is retried
+  // from scratch (possibly on a different shard) until it returns true.
+  template <typename Func>
+  void update(Func&& f) {
+    while (true) {
+      Shard* shard = shards_.forShard(rseq::begin());
+      std::uint64_t seq = shard->seq.load();
+      // The next odd count; if an earlier update never closed its count, this
+      // carries on from it.
+      std::uint64_t open = (seq + 1) | 1;
+      if (!rseq::store(&shard->seq, open)) {
+        continue;
+      }
+      if (!f(shard->value)) {
+        continue;
+      }
+      // f's changes are in; don't retry them, even if this fails (a later
+      // update or read will close the count instead).
+      rseq::store(&shard->seq, open + 1);
+      return;
+    }
+  }
+
+  // Calls f(const T&) with the given shard, possibly several times, until one
+  // call saw a snapshot of the shard between updates. f should only copy out
+  // what it needs (it may see torn values on the calls that get retried).
+  // Doesn't disturb the shard's owner, unless the shard's count stays odd for
+  // kMaxAttempts tries in a row, in which case this takes the shard with a
+  // remote rseq (see PerCpu::drain()).
+  template <typename Func>
+  void read(int shard, Func&& f) {
+    Shard* target = shards_.forShard(shard);
+    for (int attempt = 0; attempt < kMaxAttempts; ++attempt) {
+      std::uint64_t before = target->seq.load(std::memory_order_acquire);
+      if (before & 1) {
+        continue;
+      }
+      f(static_cast<const T&>(target->value));
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if (target->seq.load(std::memory_order_relaxed) == before) {
+        return;
+      }
+    }
+    shards_.drain(shard, [&](Shard& owned) {
+      f(static_cast<const T&>(owned.value));
+      std::uint64_t seq = owned.seq.load();
+      return (seq & 1) ? rseq::store(&owned.seq, seq + 1) : rseq::validate();
+    });
+  }
+
+  // The shard's count, rounded up to even. It changes whenever the shard may
+  // have; handy for skipping shards that haven't since they were last read.
+  std::uint64_t sequence(int shard) {
+    std::uint64_t seq =
+        shards_.forShard(shard)->seq.load(std::memory_order_acquire);
+    return (seq + 1) & ~std::uint64_t(1);
+  }
+
+ private:
+  constexpr static int kMaxAttempts = 64;
+
+  struct Shard {
+    rseq::Value<std::uint64_t> seq;
+    T value;
+  };
+
+  PerCpu<Shard> shards_;
+};
+
+} // namespace rseq
@@ -0,0 +1,125 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#include "rseq/PerCpuSeqlocked.h"
+
+#include <atomic>
+#include <cstdint>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "rseq/internal/NumCpus.h"
+#include "rseq/internal/SwitchToCpu.h"
+
+using namespace rseq::internal;
+
+// Updates keep first == second, but change them one store at a time. An
+// update that ends after its first store leaves first == second + 1; the next
+// one redoes it from second.
+struct Pair {
+  rseq::Value<std::uint64_t> first;
+  rseq::Value<std::uint64_t> second;
+};
+
+bool increment(Pair& pair) {
+  std::uint64_t next = pair.second.load() + 1;
+  return rseq::store(&pair.first, next) && rseq::store(&pair.second, next);
+}
+
+TEST(PerCpuSeqlocked, ReadsWhatWasUpdated) {
+  rseq::PerCpuSeqlocked<Pair> pairs;
+  for (int shard = 0; shard < pairs.numShards(); ++shard) {
+    switchToCpu(shard);
+    std::uint64_t before = pairs.sequence(shard);
+    for (int i = 0; i <= shard; ++i) {
+      pairs.update(increment);
+    }
+    EXPECT_LE(before + 2 * (shard + 1), pairs.sequence(shard));
+  }
+  for (int shard = 0; shard < pairs.numShards(); ++shard) {
+    std::uint64_t first;
+    std::uint64_t second;
+    pairs.read(shard, [&](const Pair& pair) {
+      first = pair.first.load();
+      second = pair.second.load();
+    });
+    EXPECT_EQ(shard + 1, first);
+    EXPECT_EQ(shard + 1, second);
+  }
+}
+
+TEST(PerCpuSeqlocked, RecoversFromUnclosedUpdates) {
+  rseq::PerCpuSeqlocked<Pair> pairs;
+  switchToCpu(0);
+  // Ending the rseq right after the committing store leaves the count odd.
+  pairs.update([](Pair& pair) {
+    bool committed = increment(pair);
+    rseq::end();
+    return committed;
+  });
+  std::uint64_t sequence = pairs.sequence(0);
+  EXPECT_NE(0, sequence);
+  std::uint64_t first = 0;
+  pairs.read(0, [&](const Pair& pair) { first = pair.first.load(); });
+  EXPECT_EQ(1, first);
+  EXPECT_EQ(sequence, pairs.sequence(0));
+  pairs.update(increment);
+  EXPECT_LT(sequence, pairs.sequence(0));
+  pairs.read(0, [&](const Pair& pair) { first = pair.first.load(); });
+  EXPECT_EQ(2, first);
+}
+
+TEST(PerCpuSeqlocked, ConcurrentReadsAreConsistent) {
+  const int kNumThreads = 2 * numCpus();
+  const int kUpdatesPerThread = 200000;
+  rseq::PerCpuSeqlocked<Pair> pairs;
+  std::atomic<bool> done(false);
+  std::atomic<std::uint64_t> numTorn(0);
+  std::thread monitor([&]() {
+    while (!done.load()) {
+      for (int shard = 0; shard < pairs.numShards(); ++shard) {
+        std::uint64_t first;
+        std::uint64_t second;
+        pairs.read(shard, [&](const Pair& pair) {
+          first = pair.first.load();
+          second = pair.second.load();
+        });
+        // A reader can see an ended update's prefix, but never one that's
+        // still going.
+        if (first != second && first != second + 1) {
+          ++numTorn;
+        }
+      }
+    }
+  });
+  std::vector<std::thread> threads;
+  for (int i = 0; i < kNumThreads; ++i) {
+    threads.emplace_back([&, i]() {
+      for (int j = 0; j < kUpdatesPerThread; ++j) {
+        if (j % 1000 == 0) {
+          switchToCpu((i + j / 1000) % numCpus());
+        }
+        pairs.update(increment);
+      }
+    });
+  }
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+  done.store(true);
+  monitor.join();
+  EXPECT_EQ(0, numTorn.load());
+  std::uint64_t total = 0;
+  for (int shard = 0; shard < pairs.numShards(); ++shard) {
+    pairs.read(shard, [&](const Pair& pair) { total += pair.first.load(); });
+  }
+  EXPECT_EQ(std::uint64_t(kNumThreads) * kUpdatesPerThread, total);
+}
@@ -0,0 +1,238 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "rseq/PerCpu.h"
+#include "rseq/Rseq.h"
+#include "rseq/internal/CachelinePadded.h"
+#include "rseq/internal/NumCpus.h"
+#include "rseq/internal/OsMem.h"
+#include "rseq/internal/ShardMode.h"
+
+namespace rseq {
+
+// Allocates small integer slots in [0, numSlots) (connection table indices,
+// ring buffer slots, ...) from a bitmap in which each cpu owns a contiguous
+// range of cachelines.
+//
+// The bitmap is split between the cpus the process can run on (see
+// internal::numActiveShards()), not all the possible ones, so a process
+// confined to a few cpus of a big host still gives each of them a range. When
+// there are fewer lines than cpus, ranges are split at word granularity
+// instead, so neighboring cpus may share a line but every cpu gets a range
+// while there's at least a word per cpu.
+//
+// tryAllocate() claims a clear bit in the calling cpu's range with an rseq
+// store, scanning from where it last found one. free() on the owning cpu
+// clears the bit the same way; on any other cpu, it sets the bit in the word's
+// remote-free mask with an atomic or instead, and the owner folds those back
+// in when it runs out of clear bits in that word. Only when the whole range is
+// full does tryAllocate() spill, claiming a bit in another cpu's range with a
+// remote rseq (see PerCpu::drain()); that's slow, so size the bitmap to leave
+// every cpu some headroom. Cpus outside the split (ones added to the affinity
+// mask later) always spill.
+class PerCpuSlotAllocator {
+ public:
+  explicit PerCpuSlotAllocator(std::size_t numSlots)
+      : numSlots_(numSlots),
+        numLines_((numSlots + kSlotsPerLine - 1) / kSlotsPerLine),
+        rangeBegin_(internal::numCpus()),
+        rangeEnd_(internal::numCpus()),
+        wordOwner_(numLines_ * kWordsPerLine) {
+    words_ = static_cast<Word*>(internal::os_mem::allocate(bytes()));
+    std::size_t numWords = numLines_ * kWordsPerLine;
+    for (std::size_t i = 0; i < numWords; ++i) {
+      std::size_t firstSlot = i * kBitsPerWord;
+      std::uint64_t used = 0;
+      // Bits past the end are permanently in use.
+      if (firstSlot >= numSlots) {
+        used = ~std::uint64_t(0);
+      } else if (numSlots - firstSlot < kBitsPerWord) {
+        used = ~std::uint64_t(0) << (numSlots - firstSlot);
+      }
+      words_[i].used.store(used);
+      words_[i].freed.store(0);
+    }
+    int numActive = internal::numActiveShards();
+    std::size_t unit =
+        numLines_ >= static_cast<std::size_t>(numActive) ? kWordsPerLine : 1;
+    std::size_t numUnits = numWords / unit;
+    for (int rank = 0; rank < numActive; ++rank) {
+      int shard = internal::activeShard(rank);
+      activeShards_.push_back(shard);
+      rangeBegin_[shard] = numUnits * rank / numActive * unit;
+      rangeEnd_[shard] = numUnits * (rank + 1) / numActive * unit;
+      for (std::size_t i = rangeBegin_[shard]; i < rangeEnd_[shard]; ++i) {
+        wordOwner_[i] = shard;
+      }
+      shards_.forShard(shard)->hint.store(rangeBegin_[shard]);
+    }
+  }
+
+  ~PerCpuSlotAllocator() {
+    internal::os_mem::free(words_, bytes());
+  }
+
+  PerCpuSlotAllocator(const PerCpuSlotAllocator&) = delete;
+  PerCpuSlotAllocator& operator=(const PerCpuSlotAllocator&) = delete;
+
+  std::size_t numSlots() const {
+    return numSlots_;
+  }
+
+  // Returns false if no slots were free anywhere when we looked.
+  bool tryAllocate(std::size_t* slot) {
+    while (true) {
+      Claim claim = claimFrom(rseq::begin(), slot);
+      if (claim == kClaimed) {
+        return true;
+      }
+      if (claim == kFull) {
+        break;
+      }
+    }
+    return allocateSlow(slot);
+  }
+
+  void free(std::size_t slot) {
+    Word* word = &words_[slot / kBitsPerWord];
+    std::uint64_t bit = std::uint64_t(1) << (slot % kBitsPerWord);
+    int owner = wordOwner_[slot / kBitsPerWord];
+    while (true) {
+      if (rseq::begin() != owner) {
+        word->freed.fetch_or(bit);
+        return;
+      }
+      if (rseq::store(&word->used, word->used.load() & ~bit)) {
+        return;
+      }
+    }
+  }
+
+ private:
+  constexpr static std::size_t kBitsPerWord = 64;
+
+  // used is only written by rseqs on the owning cpu's shard. freed collects
+  // the bits freed by other cpus.
+  struct Word {
+    rseq::Value<std::uint64_t> used;
+    std::atomic<std::uint64_t> freed;
+  };
+
+  constexpr static std::size_t kWordsPerLine =
+      internal::kCachelineSize / sizeof(Word);
+  constexpr static std::size_t kSlotsPerLine = kWordsPerLine * kBitsPerWord;
+
+  struct Shard {
+    // The word in the shard's range where the last allocation happened.
+    rseq::Value<std::uint64_t> hint;
+  };
+
+  enum Claim {
+    kClaimed,
+    kFull,
+    kEvicted,
+  };
+
+  std::size_t bytes() const {
+    return numLines_ * internal::kCachelineSize;
+  }
+
+  // Claims a bit in the range of the given shard, on which the caller must have
+  // an rseq (local or remote) going.
+  Claim claimFrom(int shard, std::size_t* slot) {
+    std::size_t begin = rangeBegin_[shard];
+    std::size_t end = rangeEnd_[shard];
+    if (begin == end) {
+      return kFull;
+    }
+    Shard* owner = shards_.forShard(shard);
+    std::size_t start = owner->hint.load();
+    std::size_t i = start;
+    do {
+      Word* word = &words_[i];
+      std::uint64_t used = word->used.load();
+      if (used == ~std::uint64_t(0)
+          && word->freed.load(std::memory_order_relaxed) != 0) {
+        std::uint64_t freed = word->freed.exchange(0);
+        used &= ~freed;
+        if (!rseq::store(&word->used, used)) {
+          word->freed.fetch_or(freed);
+          return kEvicted;
+        }
+      }
+      if (used != ~std::uint64_t(0)) {
+        int bit = __builtin_ctzl(~used);
+        if (!rseq::store(&word->used, used | (std::uint64_t(1) << bit))) {
+          return kEvicted;
+        }
+        // Just a hint; fine if it doesn't stick.
+        if (i != start) {
+          rseq::store(&owner->hint, i);
+        }
+        *slot = i * kBitsPerWord + bit;
+        return kClaimed;
+      }
+      if (++i == end) {
+        i = begin;
+      }
+    } while (i != start);
+    return kFull;
+  }
+
+  bool looksFree(int shard) {
+    for (std::size_t i = rangeBegin_[shard]; i < rangeEnd_[shard]; ++i) {
+      if (words_[i].used.load(std::memory_order_relaxed) != ~std::uint64_t(0)
+          || words_[i].freed.load(std::memory_order_relaxed) != 0) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // Our range is full (or we have none); take a bit from someone else's.
+  bool allocateSlow(std::size_t* slot) {
+    int numActive = static_cast<int>(activeShards_.size());
+    int self = rseq::begin();
+    for (int i = 0; i < numActive; ++i) {
+      int victim = activeShards_[(self + i) % numActive];
+      if (victim == self || !looksFree(victim)) {
+        continue;
+      }
+      Claim claim;
+      shards_.drain(victim, [&](Shard& /* shard */) {
+        claim = claimFrom(victim, slot);
+        return claim != kEvicted;
+      });
+      if (claim == kClaimed) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  const std::size_t numSlots_;
+  const std::size_t numLines_;
+  // Shard i owns words [rangeBegin_[i], rangeEnd_[i]); only the shards in
+  // activeShards_ own any.
+  std::vector<std::size_t> rangeBegin_;
+  std::vector<std::size_t> rangeEnd_;
+  std::vector<int> wordOwner_;
+  std::vector<int> activeShards_;
+  Word* words_;
+  PerCpu<Shard> shards_;
+};
+
+} // namespace rseq
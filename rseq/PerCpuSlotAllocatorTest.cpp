@@ -0,0 +1,148 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#include "rseq/PerCpuSlotAllocator.h"
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <set>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "rseq/internal/NumCpus.h"
+#include "rseq/internal/ShardMode.h"
+#include "rseq/internal/SwitchToCpu.h"
+
+using namespace rseq::internal;
+
+TEST(PerCpuSlotAllocator, AllocatesEverySlotOnce) {
+  // Not a multiple of a word, so that the tail bits get masked off.
+  const std::size_t kNumSlots = 1000 * numCpus() + 13;
+  rseq::PerCpuSlotAllocator allocator(kNumSlots);
+  std::vector<bool> allocated(kNumSlots);
+  std::size_t slot;
+  // Everything from one cpu, which has to spill into all the others.
+  switchToCpu(0);
+  for (std::size_t i = 0; i < kNumSlots; ++i) {
+    ASSERT_TRUE(allocator.tryAllocate(&slot));
+    ASSERT_GT(kNumSlots, slot);
+    ASSERT_FALSE(allocated[slot]);
+    allocated[slot] = true;
+  }
+  EXPECT_FALSE(allocator.tryAllocate(&slot));
+
+  allocator.free(17);
+  ASSERT_TRUE(allocator.tryAllocate(&slot));
+  EXPECT_EQ(17, slot);
+  EXPECT_FALSE(allocator.tryAllocate(&slot));
+}
+
+TEST(PerCpuSlotAllocator, FreesFromOtherCpus) {
+  const std::size_t kNumSlots = 512 * numCpus();
+  rseq::PerCpuSlotAllocator allocator(kNumSlots);
+  std::vector<std::size_t> slots(kNumSlots);
+  for (std::size_t i = 0; i < kNumSlots; ++i) {
+    switchToCpu(i % numCpus());
+    ASSERT_TRUE(allocator.tryAllocate(&slots[i]));
+  }
+  std::size_t slot;
+  EXPECT_FALSE(allocator.tryAllocate(&slot));
+  for (std::size_t i = 0; i < kNumSlots; ++i) {
+    switchToCpu((i + 1) % numCpus());
+    allocator.free(slots[i]);
+  }
+  // The remote frees get folded back in.
+  for (std::size_t i = 0; i < kNumSlots; ++i) {
+    switchToCpu(i % numCpus());
+    ASSERT_TRUE(allocator.tryAllocate(&slot));
+  }
+  EXPECT_FALSE(allocator.tryAllocate(&slot));
+}
+
+TEST(PerCpuSlotAllocator, TooFewSlotsForEveryCpu) {
+  rseq::PerCpuSlotAllocator allocator(3);
+  std::size_t slots[3];
+  for (int cpu = 0; cpu < numCpus(); ++cpu) {
+    switchToCpu(cpu);
+    for (int i = 0; i < 3; ++i) {
+      ASSERT_TRUE(allocator.tryAllocate(&slots[i]));
+    }
+    std::size_t slot;
+    EXPECT_FALSE(allocator.tryAllocate(&slot));
+    for (int i = 0; i < 3; ++i) {
+      allocator.free(slots[i]);
+    }
+  }
+}
+
+TEST(PerCpuSlotAllocator, SmallTablesStillGiveEveryCpuARange) {
+  // Fewer lines than cpus (with more than one cpu), but a word for each.
+  int numActive = numActiveShards();
+  rseq::PerCpuSlotAllocator allocator(64 * numActive);
+  std::set<std::size_t> words;
+  for (int rank = 0; rank < numActive; ++rank) {
+    switchToCpu(activeShard(rank));
+    std::size_t slot;
+    ASSERT_TRUE(allocator.tryAllocate(&slot));
+    // A cpu that had to spill would land in the word of an earlier one.
+    EXPECT_TRUE(words.insert(slot / 64).second);
+  }
+}
+
+TEST(PerCpuSlotAllocator, ConcurrentAllocateAndFree) {
+  const int kNumThreads = 2 * numCpus();
+  const int kIterations = 100000;
+  const std::size_t kSlotsPerThread = 50;
+  const std::size_t kNumSlots = kNumThreads * kSlotsPerThread;
+  rseq::PerCpuSlotAllocator allocator(kNumSlots);
+  std::unique_ptr<std::atomic<bool>[]> inUse(
+      new std::atomic<bool>[kNumSlots]);
+  for (std::size_t i = 0; i < kNumSlots; ++i) {
+    inUse[i].store(false);
+  }
+  std::vector<std::thread> threads;
+  for (int i = 0; i < kNumThreads; ++i) {
+    threads.emplace_back([&, i]() {
+      std::vector<std::size_t> held;
+      for (int j = 0; j < kIterations; ++j) {
+        if (j % 1000 == 0) {
+          switchToCpu((i + j / 1000) % numCpus());
+        }
+        // Every thread holds at most its share, so there's always room.
+        if (held.size() < kSlotsPerThread && j % 3 != 2) {
+          std::size_t slot;
+          ASSERT_TRUE(allocator.tryAllocate(&slot));
+          ASSERT_FALSE(inUse[slot].exchange(true));
+          held.push_back(slot);
+        } else if (!held.empty()) {
+          std::size_t slot = held[j % held.size()];
+          held[j % held.size()] = held.back();
+          held.pop_back();
+          inUse[slot].store(false);
+          allocator.free(slot);
+        }
+      }
+      for (std::size_t slot : held) {
+        inUse[slot].store(false);
+        allocator.free(slot);
+      }
+    });
+  }
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+  std::size_t slot;
+  for (std::size_t i = 0; i < kNumSlots; ++i) {
+    ASSERT_TRUE(allocator.tryAllocate(&slot));
+  }
+  EXPECT_FALSE(allocator.tryAllocate(&slot));
+}
@@ -0,0 +1,230 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+
+#include "rseq/PerCpu.h"
+#include "rseq/Rseq.h"
+#include "rseq/internal/Likely.h"
+#include "rseq/internal/OsMem.h"
+#include "rseq/internal/ShardMode.h"
+
+namespace rseq {
+
+// A table mapping handles to T*s (say, session ids to sessions), with handles
+// that go stale when their entry is erased.
+//
+// A handle packs a 32-bit generation above a 32-bit entry index. Entries start
+// out split into one contiguous range for each cpu the process can run on (see
+// internal::numActiveShards()), so the index of a fresh handle says which
+// cpu's range it came from, and none of the capacity is parked on cpus that
+// will never run us. Free entries sit on per-cpu free lists:
+// - tryInsert() pops an entry off the calling cpu's list with an rseq store,
+//   and, if that's empty, takes a batch of entries from another cpu's list
+//   with a remote rseq (see PerCpu::drain()).
+// - erase() bumps the entry's generation with a CAS (which is what makes the
+//   handle stale, and what stops two erases of the same handle from both
+//   succeeding), then pushes the entry onto the calling cpu's list.
+// - lookup() is lock-free: two loads and a comparison, and never blocks or
+//   retries.
+// 0 is never a valid handle, so it can be used as null. Generations wrap after
+// 2^32 reuses of an entry, at which point a very old handle could match again.
+template <typename T>
+class PerCpuSlotMap {
+ public:
+  typedef std::uint64_t Handle;
+
+  // capacity is the total, split evenly between the cpus' ranges.
+  explicit PerCpuSlotMap(std::uint32_t capacity) : capacity_(capacity) {
+    assert(capacity_ < (std::uint64_t(1) << 32));
+    entries_ = static_cast<Entry*>(internal::os_mem::allocate(bytes()));
+    for (std::size_t i = 0; i < capacity_; ++i) {
+      // Generation 0 is never handed out, so no handle is 0.
+      entries_[i].generation.store(1);
+      entries_[i].value.store(nullptr);
+    }
+    // Shards start out zeroed (CpuLocal memory comes from os_mem), so the
+    // ones outside the split have empty lists.
+    int numActive = internal::numActiveShards();
+    for (int rank = 0; rank < numActive; ++rank) {
+      std::size_t begin = capacity_ * rank / numActive;
+      std::size_t end = capacity_ * (rank + 1) / numActive;
+      if (begin == end) {
+        continue;
+      }
+      for (std::size_t i = begin; i < end; ++i) {
+        entries_[i].nextFree.store(i + 1 == end ? 0 : i + 2);
+      }
+      shards_.forShard(internal::activeShard(rank))->freeHead.store(begin + 1);
+    }
+  }
+
+  ~PerCpuSlotMap() {
+    internal::os_mem::free(entries_, bytes());
+  }
+
+  PerCpuSlotMap(const PerCpuSlotMap&) = delete;
+  PerCpuSlotMap& operator=(const PerCpuSlotMap&) = delete;
+
+  std::size_t capacity() const {
+    return capacity_;
+  }
+
+  // Returns false if no entries were free anywhere when we looked.
+  bool tryInsert(T* value, Handle* handle) {
+    std::size_t index;
+    if (RSEQ_UNLIKELY(!popLocal(&index)) && !steal(&index)) {
+      return false;
+    }
+    Entry* entry = &entries_[index];
+    // Pairs with the acquire in lookup(); see there.
+    entry->value.store(value, std::memory_order_release);
+    *handle =
+        (entry->generation.load(std::memory_order_relaxed) << 32) | index;
+    return true;
+  }
+
+  // Returns nullptr if the handle is stale (or was never valid).
+  T* lookup(Handle handle) {
+    std::size_t index = handle & 0xffffffff;
+    if (RSEQ_UNLIKELY(index >= capacity_)) {
+      return nullptr;
+    }
+    Entry* entry = &entries_[index];
+    // The value is loaded first. If it was stored by a later tryInsert() that
+    // reused the entry, then the erase() in between (which bumped the
+    // generation before freeing the entry) is visible too, and we return
+    // nullptr.
+    T* value = entry->value.load(std::memory_order_acquire);
+    if (entry->generation.load(std::memory_order_acquire) != handle >> 32) {
+      return nullptr;
+    }
+    return value;
+  }
+
+  // Returns false if the handle was already stale. The caller is responsible
+  // for the T itself.
+  bool erase(Handle handle) {
+    std::size_t index = handle & 0xffffffff;
+    if (index >= capacity_) {
+      return false;
+    }
+    Entry* entry = &entries_[index];
+    std::uint64_t generation = handle >> 32;
+    std::uint64_t next = (generation + 1) & 0xffffffff;
+    if (next == 0) {
+      next = 1;
+    }
+    if (!entry->generation.compare_exchange_strong(generation, next)) {
+      return false;
+    }
+    entry->value.store(nullptr, std::memory_order_relaxed);
+    pushLocal(index, index);
+    return true;
+  }
+
+ private:
+  // Free lists are linked through nextFree, with index + 1 as the link (so
+  // that 0 is null). An entry's nextFree is only written while its writer owns
+  // it (before it's pushed), and only read in rseqs on the shard of the list
+  // it's on.
+  struct Entry {
+    std::atomic<std::uint64_t> generation;
+    std::atomic<T*> value;
+    rseq::Value<std::uint64_t> nextFree;
+  };
+
+  struct Shard {
+    rseq::Value<std::uint64_t> freeHead;
+  };
+
+  // The most entries taken from another cpu's list at once.
+  constexpr static int kStealBatch = 32;
+
+  std::size_t bytes() const {
+    return capacity_ * sizeof(Entry);
+  }
+
+  bool popLocal(std::size_t* index) {
+    while (true) {
+      Shard* shard = shards_.forShard(rseq::begin());
+      std::uint64_t head = shard->freeHead.load();
+      if (head == 0) {
+        return false;
+      }
+      std::uint64_t next = entries_[head - 1].nextFree.load();
+      if (rseq::store(&shard->freeHead, next)) {
+        *index = head - 1;
+        return true;
+      }
+    }
+  }
+
+  // Pushes the chain first -> ... -> last (already linked) onto the local list.
+  void pushLocal(std::size_t first, std::size_t last) {
+    shards_.withLocal([&](Shard& shard) {
+      // The chain isn't reachable until the second store.
+      return rseq::store(&entries_[last].nextFree, shard.freeHead.load())
+          && rseq::store(&shard.freeHead, first + 1);
+    });
+  }
+
+  // Takes up to kStealBatch entries off the front of another shard's list,
+  // keeps one, and moves the rest to ours.
+  bool steal(std::size_t* index) {
+    int numShards = shards_.numShards();
+    int self = rseq::begin();
+    for (int i = 1; i < numShards; ++i) {
+      int victim = (self + i) % numShards;
+      Shard* victimShard = shards_.forShard(victim);
+      // Don't pay for a remote rseq on lists that look empty.
+      if (victimShard->freeHead.load(std::memory_order_relaxed) == 0) {
+        continue;
+      }
+      std::uint64_t first = 0;
+      std::uint64_t last = 0;
+      shards_.drain(victim, [&](Shard& shard) {
+        first = shard.freeHead.load();
+        if (first == 0) {
+          return true;
+        }
+        last = first;
+        for (int n = 1; n < kStealBatch; ++n) {
+          std::uint64_t next = entries_[last - 1].nextFree.load();
+          if (next == 0) {
+            break;
+          }
+          last = next;
+        }
+        return rseq::store(
+            &shard.freeHead, entries_[last - 1].nextFree.load());
+      });
+      if (first == 0) {
+        continue;
+      }
+      *index = first - 1;
+      if (first != last) {
+        pushLocal(entries_[first - 1].nextFree.load() - 1, last - 1);
+      }
+      return true;
+    }
+    return false;
+  }
+
+  const std::size_t capacity_;
+  Entry* entries_;
+  PerCpu<Shard> shards_;
+};
+
+} // namespace rseq
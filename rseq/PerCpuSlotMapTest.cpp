@@ -0,0 +1,132 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#include "rseq/PerCpuSlotMap.h"
+
+#include <cstdint>
+#include <set>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "rseq/internal/NumCpus.h"
+#include "rseq/internal/ShardMode.h"
+#include "rseq/internal/SwitchToCpu.h"
+
+using namespace rseq::internal;
+
+typedef rseq::PerCpuSlotMap<int> Map;
+
+TEST(PerCpuSlotMap, InsertsLooksUpAndErases) {
+  Map map(4);
+  int a = 1;
+  int b = 2;
+  Map::Handle ha;
+  Map::Handle hb;
+  ASSERT_TRUE(map.tryInsert(&a, &ha));
+  ASSERT_TRUE(map.tryInsert(&b, &hb));
+  EXPECT_NE(0, ha);
+  EXPECT_NE(ha, hb);
+  EXPECT_EQ(&a, map.lookup(ha));
+  EXPECT_EQ(&b, map.lookup(hb));
+  EXPECT_EQ(nullptr, map.lookup(0));
+  EXPECT_EQ(nullptr, map.lookup(~Map::Handle(0)));
+
+  EXPECT_TRUE(map.erase(ha));
+  EXPECT_FALSE(map.erase(ha));
+  EXPECT_EQ(nullptr, map.lookup(ha));
+  EXPECT_EQ(&b, map.lookup(hb));
+
+  // The entry gets reused, under a new generation.
+  Map::Handle hc;
+  ASSERT_TRUE(map.tryInsert(&a, &hc));
+  EXPECT_EQ(ha & 0xffffffff, hc & 0xffffffff);
+  EXPECT_NE(ha, hc);
+  EXPECT_EQ(nullptr, map.lookup(ha));
+  EXPECT_EQ(&a, map.lookup(hc));
+}
+
+TEST(PerCpuSlotMap, HandlesComeFromTheLocalRange) {
+  int numActive = numActiveShards();
+  Map map(8 * numActive);
+  int value = 0;
+  for (int rank = 0; rank < numActive; ++rank) {
+    switchToCpu(activeShard(rank));
+    Map::Handle handle;
+    ASSERT_TRUE(map.tryInsert(&value, &handle));
+    EXPECT_EQ(rank, (handle & 0xffffffff) / 8);
+  }
+}
+
+TEST(PerCpuSlotMap, FillsUpFromAnyCpu) {
+  Map map(16 * numActiveShards());
+  int value = 0;
+  std::set<Map::Handle> handles;
+  // Drain every cpu's entries from cpu 0, erase them all from the last cpu,
+  // and do it again.
+  for (int round = 0; round < 2; ++round) {
+    std::vector<Map::Handle> inserted;
+    switchToCpu(0);
+    for (std::size_t i = 0; i < map.capacity(); ++i) {
+      Map::Handle handle;
+      ASSERT_TRUE(map.tryInsert(&value, &handle));
+      ASSERT_TRUE(handles.insert(handle).second);
+      inserted.push_back(handle);
+    }
+    Map::Handle handle;
+    EXPECT_FALSE(map.tryInsert(&value, &handle));
+    switchToCpu(numCpus() - 1);
+    for (Map::Handle h : inserted) {
+      ASSERT_TRUE(map.erase(h));
+    }
+  }
+  EXPECT_EQ(2 * map.capacity(), handles.size());
+}
+
+TEST(PerCpuSlotMap, ConcurrentChurn) {
+  const int kNumThreads = 2 * numCpus();
+  const int kIterations = 100000;
+  const int kHeldPerThread = 20;
+  Map map(kNumThreads * kHeldPerThread);
+  std::vector<std::thread> threads;
+  for (int i = 0; i < kNumThreads; ++i) {
+    threads.emplace_back([&, i]() {
+      std::vector<std::pair<Map::Handle, int*>> held;
+      std::vector<int> values(kIterations);
+      for (int j = 0; j < kIterations; ++j) {
+        if (j % 1000 == 0) {
+          switchToCpu((i + j / 1000) % numCpus());
+        }
+        if (held.size() < kHeldPerThread && j % 3 != 2) {
+          Map::Handle handle;
+          ASSERT_TRUE(map.tryInsert(&values[j], &handle));
+          held.emplace_back(handle, &values[j]);
+        } else if (!held.empty()) {
+          std::pair<Map::Handle, int*> victim = held[j % held.size()];
+          held[j % held.size()] = held.back();
+          held.pop_back();
+          ASSERT_EQ(victim.second, map.lookup(victim.first));
+          ASSERT_TRUE(map.erase(victim.first));
+          ASSERT_EQ(nullptr, map.lookup(victim.first));
+        }
+        for (auto& entry : held) {
+          ASSERT_EQ(entry.second, map.lookup(entry.first));
+        }
+      }
+      for (auto& entry : held) {
+        ASSERT_TRUE(map.erase(entry.first));
+      }
+    });
+  }
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+}
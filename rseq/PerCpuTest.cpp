@@ -0,0 +1,120 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#include "rseq/PerCpu.h"
+
+#include <atomic>
+#include <cstdint>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "rseq/internal/NumCpus.h"
+#include "rseq/internal/SwitchToCpu.h"
+
+using namespace rseq::internal;
+
+struct Counter {
+  rseq::Value<std::uint64_t> count;
+};
+
+static bool increment(Counter& counter) {
+  return rseq::store(&counter.count, counter.count.load() + 1);
+}
+
+TEST(PerCpu, VisitsEveryShard) {
+  rseq::PerCpu<Counter> perCpu;
+  EXPECT_EQ(numCpus(), perCpu.numShards());
+  std::vector<int> visits(perCpu.numShards());
+  perCpu.forEach([&](int shard, Counter& counter) {
+    EXPECT_EQ(perCpu.forShard(shard), &counter);
+    EXPECT_EQ(0, counter.count.load());
+    ++visits[shard];
+  });
+  for (int i = 0; i < perCpu.numShards(); ++i) {
+    EXPECT_EQ(1, visits[i]);
+  }
+}
+
+TEST(PerCpu, WithLocalCountsExactly) {
+  const int kNumThreads = 4 * numCpus();
+  const int kIncrementsPerThread = 100000;
+  rseq::PerCpu<Counter> perCpu;
+
+  std::vector<std::thread> threads(kNumThreads);
+  for (int i = 0; i < kNumThreads; ++i) {
+    threads[i] = std::thread([&, i]() {
+      switchToCpu(i % numCpus());
+      for (int j = 0; j < kIncrementsPerThread; ++j) {
+        perCpu.withLocal(increment);
+      }
+    });
+  }
+  for (int i = 0; i < kNumThreads; ++i) {
+    threads[i].join();
+  }
+
+  rseq::fence();
+  std::uint64_t sum = 0;
+  perCpu.forEach([&](int /* shard */, Counter& counter) {
+    sum += counter.count.load();
+  });
+  EXPECT_EQ(
+      static_cast<std::uint64_t>(kNumThreads) * kIncrementsPerThread, sum);
+}
+
+TEST(PerCpu, DrainsWhileInUse) {
+  const int kNumThreads = 2 * numCpus();
+  const int kIncrementsPerThread = 100000;
+  rseq::PerCpu<Counter> perCpu;
+  std::atomic<bool> done(false);
+
+  std::vector<std::thread> threads(kNumThreads);
+  for (int i = 0; i < kNumThreads; ++i) {
+    threads[i] = std::thread([&, i]() {
+      switchToCpu(i % numCpus());
+      for (int j = 0; j < kIncrementsPerThread; ++j) {
+        perCpu.withLocal(increment);
+      }
+    });
+  }
+
+  // Move counts out of the shards while they're being incremented; nothing
+  // should get lost or double-counted.
+  std::uint64_t drained = 0;
+  std::thread drainer([&]() {
+    while (!done.load()) {
+      for (int shard = 0; shard < perCpu.numShards(); ++shard) {
+        perCpu.drain(shard, [&](Counter& counter) {
+          std::uint64_t count = counter.count.load();
+          if (!rseq::store(&counter.count, 0)) {
+            return false;
+          }
+          drained += count;
+          return true;
+        });
+      }
+    }
+  });
+  for (int i = 0; i < kNumThreads; ++i) {
+    threads[i].join();
+  }
+  done.store(true);
+  drainer.join();
+
+  rseq::fence();
+  std::uint64_t remaining = 0;
+  perCpu.forEach([&](int /* shard */, Counter& counter) {
+    remaining += counter.count.load();
+  });
+  EXPECT_EQ(
+      static_cast<std::uint64_t>(kNumThreads) * kIncrementsPerThread,
+      drained + remaining);
+}
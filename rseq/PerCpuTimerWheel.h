@@ -0,0 +1,382 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+#include "rseq/PerCpu.h"
+#include "rseq/Rseq.h"
+#include "rseq/internal/Mutex.h"
+
+namespace rseq {
+
+// A hierarchical timer wheel (kLevels levels of kSlots slots, each level's
+// slots kSlots times as wide as the one below) per shard, for timeouts that
+// are armed and cancelled far more often than they fire.
+//
+// schedule() puts a timer into the calling thread's shard's wheel; the slot is
+// a singly-linked list, so this is a push committed with a single rseq store.
+// cancel() may be called from any cpu. It claims the timer with a CAS on the
+// timer's own state (so it knows for sure whether it beat the expiry) and then
+// pushes the timer onto a cancel list on the canceller's shard, again with one
+// rseq store; the timer isn't unlinked from its wheel right away.
+//
+// All the rest is done by advance(), which the owner calls every tick or so
+// from a reaper thread (or a pool of them; the wheel work is serialized, but
+// the hooks of different calls may run concurrently). For each
+// shard with something to do, it moves the wheel's current tick forward and
+// takes the slots that are due and the cancel list, with a remote rseq on the
+// shard (see PerCpu::drain(); this evicts any insert that read the old tick).
+// It then unlinks cancelled timers, fires expired ones, and cascades the rest
+// down to finer-grained slots. Timers fire at or after their deadline, within
+// a tick of the advance() that reaches it.
+class PerCpuTimerWheel {
+ public:
+  static constexpr int kSlotBits = 6;
+  static constexpr int kSlots = 1 << kSlotBits;
+  static constexpr int kLevels = 4;
+
+  typedef std::chrono::steady_clock Clock;
+
+  // Users derive from this. A timer belongs to the wheel from schedule() until
+  // the wheel calls one of its hooks; after that, the wheel doesn't touch it
+  // again, and it can be freed or scheduled again.
+  class Timer {
+   public:
+    Timer() : state_(kIdle) {}
+    Timer(const Timer&) = delete;
+    Timer& operator=(const Timer&) = delete;
+    virtual ~Timer() {}
+
+    // Called (from advance()) once the deadline has passed.
+    virtual void expired() = 0;
+    // Called (from advance()) after a successful cancel(), once the timer is
+    // out of the wheel.
+    virtual void cancelled() {}
+
+   private:
+    friend class PerCpuTimerWheel;
+
+    // Only accessed by whoever holds the timer: the scheduling thread before
+    // its insert commits, then advance().
+    Timer* next_;
+    Timer* cancelNext_;
+    std::uint64_t deadline_;
+    int shard_;
+    int level_;
+    int slot_;
+    std::atomic<int> state_;
+  };
+
+  explicit PerCpuTimerWheel(
+      Clock::duration tickDuration = std::chrono::milliseconds(1))
+      : tickDuration_(tickDuration), start_(Clock::now()) {
+    reaperMu_.init();
+  }
+
+  PerCpuTimerWheel(const PerCpuTimerWheel&) = delete;
+  PerCpuTimerWheel& operator=(const PerCpuTimerWheel&) = delete;
+
+  // Timers still in the wheel are abandoned, without calling any hooks.
+  ~PerCpuTimerWheel() {}
+
+  // Ticks since the wheel was created.
+  std::uint64_t now() const {
+    return (Clock::now() - start_) / tickDuration_;
+  }
+
+  // The timer must not already be scheduled.
+  void schedule(Timer* timer, Clock::duration delay) {
+    std::uint64_t ticks = (delay + tickDuration_ - Clock::duration(1))
+        / tickDuration_;
+    scheduleAt(timer, now() + ticks);
+  }
+
+  // As above, with a deadline in ticks.
+  void scheduleAt(Timer* timer, std::uint64_t deadline) {
+    timer->deadline_ = deadline;
+    timer->state_.store(kPending, std::memory_order_relaxed);
+    while (true) {
+      int cpu = rseq::begin();
+      Shard* shard = shards_.forShard(cpu);
+      timer->shard_ = cpu;
+      placeTimer(timer, shard->curTick.load());
+      rseq::Value<Timer*>* head = &shard->slots[timer->level_][timer->slot_];
+      timer->next_ = head->load();
+      if (rseq::store(head, timer)) {
+        return;
+      }
+    }
+  }
+
+  // Returns true if the timer won't expire; its cancelled() hook is called
+  // later. Returns false if it has expired (or is about to). Must not race
+  // with the schedule() of the same timer.
+  bool cancel(Timer* timer) {
+    int expected = kPending;
+    if (!timer->state_.compare_exchange_strong(expected, kCancelled)) {
+      return false;
+    }
+    while (true) {
+      Shard* shard = shards_.forShard(rseq::begin());
+      timer->cancelNext_ = shard->cancelled.load();
+      if (rseq::store(&shard->cancelled, timer)) {
+        return true;
+      }
+    }
+  }
+
+  // Processes every shard up to the current tick; returns the number of
+  // timers that expired. Hooks run on the calling thread, and may schedule
+  // and cancel timers.
+  int advance() {
+    return advanceTo(now());
+  }
+
+  // As above, processing deadlines up to and including tick.
+  int advanceTo(std::uint64_t tick) {
+    std::vector<Timer*> expired;
+    std::vector<Timer*> cancelled;
+    {
+      internal::mutex::LockGuard<internal::mutex::Mutex> lg(reaperMu_);
+      std::vector<Timer*> taken;
+      for (int i = 0; i < shards_.numShards(); ++i) {
+        takeDue(i, tick, &taken, &cancelled);
+      }
+      takeCancelledSlots(cancelled, &taken);
+      std::vector<Timer*> reinsert;
+      for (Timer* timer : taken) {
+        int expected = kPending;
+        if (timer->deadline_ > tick) {
+          if (timer->state_.load() == kPending) {
+            reinsert.push_back(timer);
+          }
+        } else if (timer->state_.compare_exchange_strong(expected, kIdle)) {
+          expired.push_back(timer);
+        }
+        // Anything else was cancelled; it's on (or on its way to) a cancel
+        // list, and gets its hook called from there.
+      }
+      reinsertAll(&reinsert);
+    }
+    std::sort(
+        expired.begin(), expired.end(), [](Timer* lhs, Timer* rhs) {
+          return lhs->deadline_ < rhs->deadline_;
+        });
+    for (Timer* timer : cancelled) {
+      timer->state_.store(kIdle);
+      timer->cancelled();
+    }
+    for (Timer* timer : expired) {
+      timer->expired();
+    }
+    return static_cast<int>(expired.size());
+  }
+
+ private:
+  enum State {
+    kIdle,
+    kPending,
+    kCancelled,
+  };
+
+  struct Shard {
+    // Every tick before this one has been processed.
+    rseq::Value<std::uint64_t> curTick;
+    rseq::Value<Timer*> cancelled;
+    rseq::Value<Timer*> slots[kLevels][kSlots];
+  };
+
+  // Level l holds timers whose deadline agrees with the current tick in every
+  // bit above the lowest kSlotBits * (l + 1), indexed by the next kSlotBits
+  // bits up; the top level takes everything else, modulo its size. Past-due
+  // deadlines go in the current tick's slot.
+  static void placeTimer(Timer* timer, std::uint64_t curTick) {
+    std::uint64_t deadline = std::max(timer->deadline_, curTick);
+    std::uint64_t diff = deadline ^ curTick;
+    int level = 0;
+    while (level < kLevels - 1 && (diff >> (kSlotBits * (level + 1))) != 0) {
+      ++level;
+    }
+    timer->level_ = level;
+    timer->slot_ = (deadline >> (kSlotBits * level)) & (kSlots - 1);
+  }
+
+  // Calls f(level, slot) for every slot that might hold a timer due in
+  // [from, to]: at each level, those covering that range.
+  template <typename Func>
+  static void forEachDueSlot(std::uint64_t from, std::uint64_t to, Func f) {
+    for (int level = 0; level < kLevels; ++level) {
+      std::uint64_t first = from >> (kSlotBits * level);
+      std::uint64_t last = to >> (kSlotBits * level);
+      if (last - first >= static_cast<std::uint64_t>(kSlots - 1)) {
+        first = 0;
+        last = kSlots - 1;
+      }
+      for (std::uint64_t i = first; i <= last; ++i) {
+        f(level, static_cast<int>(i & (kSlots - 1)));
+      }
+    }
+  }
+
+  static void appendList(Timer* head, std::vector<Timer*>* out) {
+    for (; head != nullptr; head = head->next_) {
+      out->push_back(head);
+    }
+  }
+
+  // Advances the shard to tick + 1, and takes its due slots and cancel list.
+  // Shards with nothing due are left alone; their next call covers the range
+  // this one would have.
+  void takeDue(
+      int shardIndex,
+      std::uint64_t tick,
+      std::vector<Timer*>* taken,
+      std::vector<Timer*>* cancelled) {
+    Shard* shard = shards_.forShard(shardIndex);
+    // Only we modify curTick, so this is current.
+    std::uint64_t from = shard->curTick.load();
+    if (from > tick) {
+      return;
+    }
+    std::vector<std::pair<int, int>> slots;
+    bool busy =
+        shard->cancelled.load(std::memory_order_relaxed) != nullptr;
+    forEachDueSlot(from, tick, [&](int level, int slot) {
+      slots.emplace_back(level, slot);
+      busy = busy
+          || shard->slots[level][slot].load(std::memory_order_relaxed)
+              != nullptr;
+    });
+    if (!busy) {
+      return;
+    }
+    // Each store commits part of the work, so a retry picks up where the last
+    // attempt left off.
+    bool tickStored = false;
+    std::size_t nextSlot = 0;
+    bool cancelsTaken = false;
+    shards_.drain(shardIndex, [&](Shard& target) {
+      if (!tickStored) {
+        if (!rseq::store(&target.curTick, tick + 1)) {
+          return false;
+        }
+        tickStored = true;
+      }
+      for (; nextSlot < slots.size(); ++nextSlot) {
+        rseq::Value<Timer*>* head =
+            &target.slots[slots[nextSlot].first][slots[nextSlot].second];
+        Timer* list = head->load();
+        if (list == nullptr) {
+          continue;
+        }
+        if (!rseq::store(head, nullptr)) {
+          return false;
+        }
+        appendList(list, taken);
+      }
+      if (!cancelsTaken) {
+        Timer* list = target.cancelled.load();
+        if (list != nullptr && !rseq::store(&target.cancelled, nullptr)) {
+          return false;
+        }
+        for (; list != nullptr; list = list->cancelNext_) {
+          cancelled->push_back(list);
+        }
+        cancelsTaken = true;
+      }
+      return true;
+    });
+  }
+
+  // Unlinks cancelled timers that are still in their wheels, by taking the
+  // slots they're in (and everything else in them).
+  void takeCancelledSlots(
+      const std::vector<Timer*>& cancelled,
+      std::vector<Timer*>* taken) {
+    std::vector<std::pair<int, std::pair<int, int>>> slots;
+    for (Timer* timer : cancelled) {
+      slots.emplace_back(
+          timer->shard_, std::make_pair(timer->level_, timer->slot_));
+    }
+    std::sort(slots.begin(), slots.end());
+    slots.erase(std::unique(slots.begin(), slots.end()), slots.end());
+    std::size_t begin = 0;
+    while (begin < slots.size()) {
+      int shardIndex = slots[begin].first;
+      std::size_t end = begin;
+      while (end < slots.size() && slots[end].first == shardIndex) {
+        ++end;
+      }
+      std::size_t next = begin;
+      shards_.drain(shardIndex, [&](Shard& target) {
+        for (; next < end; ++next) {
+          const std::pair<int, int>& slot = slots[next].second;
+          rseq::Value<Timer*>* head = &target.slots[slot.first][slot.second];
+          Timer* list = head->load();
+          if (list == nullptr) {
+            continue;
+          }
+          if (!rseq::store(head, nullptr)) {
+            return false;
+          }
+          appendList(list, taken);
+        }
+        return true;
+      });
+      begin = end;
+    }
+  }
+
+  // Puts timers back into the wheels they came from, relative to those
+  // wheels' current ticks.
+  void reinsertAll(std::vector<Timer*>* timers) {
+    std::sort(timers->begin(), timers->end(), [](Timer* lhs, Timer* rhs) {
+      return lhs->shard_ < rhs->shard_;
+    });
+    std::size_t begin = 0;
+    while (begin < timers->size()) {
+      int shardIndex = (*timers)[begin]->shard_;
+      std::size_t end = begin;
+      while (end < timers->size() && (*timers)[end]->shard_ == shardIndex) {
+        ++end;
+      }
+      std::size_t next = begin;
+      shards_.drain(shardIndex, [&](Shard& target) {
+        std::uint64_t curTick = target.curTick.load();
+        for (; next < end; ++next) {
+          Timer* timer = (*timers)[next];
+          placeTimer(timer, curTick);
+          rseq::Value<Timer*>* head =
+              &target.slots[timer->level_][timer->slot_];
+          timer->next_ = head->load();
+          if (!rseq::store(head, timer)) {
+            return false;
+          }
+        }
+        return true;
+      });
+      begin = end;
+    }
+  }
+
+  const Clock::duration tickDuration_;
+  const Clock::time_point start_;
+  PerCpu<Shard> shards_;
+  // Serializes advance() calls.
+  internal::mutex::Mutex reaperMu_;
+};
+
+} // namespace rseq
@@ -0,0 +1,239 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#include "rseq/PerCpuTimerWheel.h"
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "rseq/internal/NumCpus.h"
+#include "rseq/internal/SwitchToCpu.h"
+
+using namespace rseq::internal;
+
+typedef rseq::PerCpuTimerWheel Wheel;
+
+struct TestTimer : Wheel::Timer {
+  TestTimer() : numExpired(0), numCancelled(0), expiredAt(0) {}
+
+  void expired() override {
+    ++numExpired;
+    expiredAt = *currentTick;
+  }
+
+  void cancelled() override {
+    ++numCancelled;
+  }
+
+  std::atomic<int> numExpired;
+  std::atomic<int> numCancelled;
+  std::uint64_t expiredAt;
+  const std::uint64_t* currentTick = nullptr;
+};
+
+TEST(PerCpuTimerWheel, FiresAtDeadline) {
+  Wheel wheel;
+  std::uint64_t tick = 0;
+  TestTimer timer;
+  timer.currentTick = &tick;
+  wheel.scheduleAt(&timer, 10);
+  tick = 9;
+  EXPECT_EQ(0, wheel.advanceTo(tick));
+  EXPECT_EQ(0, timer.numExpired.load());
+  tick = 10;
+  EXPECT_EQ(1, wheel.advanceTo(tick));
+  EXPECT_EQ(1, timer.numExpired.load());
+  tick = 1000;
+  EXPECT_EQ(0, wheel.advanceTo(tick));
+  EXPECT_EQ(1, timer.numExpired.load());
+}
+
+TEST(PerCpuTimerWheel, FiresPastDueTimersRightAway) {
+  Wheel wheel;
+  std::uint64_t tick = 100;
+  TestTimer timer;
+  timer.currentTick = &tick;
+  EXPECT_EQ(0, wheel.advanceTo(tick));
+  wheel.scheduleAt(&timer, 5);
+  EXPECT_EQ(1, wheel.advanceTo(tick));
+}
+
+// Deadlines across every level of the wheel, reached with irregular steps.
+TEST(PerCpuTimerWheel, NeverFiresEarlyOrLate) {
+  const int kNumTimers = 5000;
+  Wheel wheel;
+  std::uint64_t tick = 0;
+  std::vector<std::unique_ptr<TestTimer>> timers;
+  std::mt19937_64 rng(1234);
+  for (int i = 0; i < kNumTimers; ++i) {
+    timers.emplace_back(new TestTimer);
+    timers.back()->currentTick = &tick;
+    int bits = static_cast<int>(rng() % 27);
+    wheel.scheduleAt(timers.back().get(), rng() % (std::uint64_t(1) << bits));
+  }
+  int numExpired = 0;
+  while (numExpired < kNumTimers) {
+    tick += 1 + rng() % 5000;
+    numExpired += wheel.advanceTo(tick);
+  }
+  for (auto& timer : timers) {
+    EXPECT_EQ(1, timer->numExpired.load());
+  }
+  // Each timer fired in the first advance that reached its deadline. We can't
+  // see the deadline through the base class, so recompute it.
+  std::mt19937_64 replay(1234);
+  for (auto& timer : timers) {
+    int bits = static_cast<int>(replay() % 27);
+    std::uint64_t deadline = replay() % (std::uint64_t(1) << bits);
+    EXPECT_LE(deadline, timer->expiredAt);
+    EXPECT_GT(deadline + 5000, timer->expiredAt);
+  }
+}
+
+TEST(PerCpuTimerWheel, Cancels) {
+  Wheel wheel;
+  std::uint64_t tick = 0;
+  TestTimer timer;
+  timer.currentTick = &tick;
+  wheel.scheduleAt(&timer, 100);
+  EXPECT_TRUE(wheel.cancel(&timer));
+  EXPECT_FALSE(wheel.cancel(&timer));
+  // Unlinked well before the deadline.
+  tick = 1;
+  EXPECT_EQ(0, wheel.advanceTo(tick));
+  EXPECT_EQ(1, timer.numCancelled.load());
+  tick = 200;
+  EXPECT_EQ(0, wheel.advanceTo(tick));
+  EXPECT_EQ(0, timer.numExpired.load());
+  EXPECT_EQ(1, timer.numCancelled.load());
+
+  // Now it can be reused.
+  wheel.scheduleAt(&timer, 300);
+  tick = 300;
+  EXPECT_EQ(1, wheel.advanceTo(tick));
+  EXPECT_FALSE(wheel.cancel(&timer));
+  EXPECT_EQ(1, timer.numExpired.load());
+  EXPECT_EQ(1, timer.numCancelled.load());
+}
+
+TEST(PerCpuTimerWheel, CancelsFromOtherCpus) {
+  if (numCpus() < 2) {
+    return;
+  }
+  Wheel wheel;
+  std::uint64_t tick = 0;
+  TestTimer timer;
+  timer.currentTick = &tick;
+  switchToCpu(0);
+  wheel.scheduleAt(&timer, 100000);
+  switchToCpu(1);
+  EXPECT_TRUE(wheel.cancel(&timer));
+  tick = 1;
+  wheel.advanceTo(tick);
+  EXPECT_EQ(1, timer.numCancelled.load());
+}
+
+struct PeriodicTimer : Wheel::Timer {
+  void expired() override {
+    if (++numExpired < 10) {
+      wheel->scheduleAt(this, *currentTick + 7);
+    }
+  }
+  Wheel* wheel;
+  const std::uint64_t* currentTick;
+  int numExpired = 0;
+};
+
+TEST(PerCpuTimerWheel, ReschedulesFromHook) {
+  Wheel wheel;
+  std::uint64_t tick = 0;
+  PeriodicTimer timer;
+  timer.wheel = &wheel;
+  timer.currentTick = &tick;
+  wheel.scheduleAt(&timer, 0);
+  for (tick = 0; tick < 1000; ++tick) {
+    wheel.advanceTo(tick);
+  }
+  EXPECT_EQ(10, timer.numExpired);
+}
+
+TEST(PerCpuTimerWheel, UsesRealTime) {
+  Wheel wheel(std::chrono::microseconds(100));
+  std::uint64_t tick = 0;
+  TestTimer timer;
+  timer.currentTick = &tick;
+  wheel.schedule(&timer, std::chrono::milliseconds(2));
+  while (timer.numExpired.load() == 0) {
+    tick = wheel.now();
+    wheel.advanceTo(tick);
+  }
+  EXPECT_LE(20, timer.expiredAt);
+}
+
+TEST(PerCpuTimerWheel, ConcurrentScheduleAndCancel) {
+  const int kNumThreads = 2 * numCpus();
+  const int kTimersPerThread = 20000;
+  Wheel wheel;
+  std::atomic<std::uint64_t> tick(0);
+  std::atomic<bool> done(false);
+  std::vector<std::vector<std::unique_ptr<TestTimer>>> timers(kNumThreads);
+  std::vector<std::vector<bool>> wasCancelled(kNumThreads);
+  std::uint64_t unusedTick = 0;
+  std::thread reaper([&]() {
+    while (!done.load()) {
+      wheel.advanceTo(++tick);
+    }
+  });
+  std::vector<std::thread> threads;
+  for (int i = 0; i < kNumThreads; ++i) {
+    threads.emplace_back([&, i]() {
+      std::mt19937 rng(i);
+      for (int j = 0; j < kTimersPerThread; ++j) {
+        if (j % 1000 == 0) {
+          switchToCpu((i + j / 1000) % numCpus());
+        }
+        timers[i].emplace_back(new TestTimer);
+        TestTimer* timer = timers[i].back().get();
+        timer->currentTick = &unusedTick;
+        wheel.scheduleAt(timer, tick.load() + rng() % 200);
+        // Cancel some of them, maybe from another cpu, maybe too late.
+        if (j >= 10 && rng() % 2 == 0) {
+          wasCancelled[i].push_back(wheel.cancel(timers[i][j - 10].get()));
+        } else {
+          wasCancelled[i].push_back(false);
+        }
+      }
+    });
+  }
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+  // Let everything expire or be unlinked.
+  std::uint64_t lastTick = tick.load() + 1000;
+  while (tick.load() < lastTick) {
+    std::this_thread::yield();
+  }
+  done.store(true);
+  reaper.join();
+  for (int i = 0; i < kNumThreads; ++i) {
+    for (int j = 0; j < kTimersPerThread; ++j) {
+      TestTimer* timer = timers[i][j].get();
+      ASSERT_EQ(1, timer->numExpired.load() + timer->numCancelled.load());
+      if (j + 10 < kTimersPerThread && wasCancelled[i][j + 10]) {
+        ASSERT_EQ(1, timer->numCancelled.load());
+      }
+    }
+  }
+}
@@ -0,0 +1,137 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+#include "rseq/PerCpu.h"
+#include "rseq/Rseq.h"
+
+namespace rseq {
+
+// Heavy-hitter tracking with a SpaceSaving summary of kCapacity entries per
+// cpu. add() scans the calling cpu's entries inside an rseq and bumps the
+// key's count, or, if the key isn't tracked, takes over the entry with the
+// smallest count (as SpaceSaving does).
+//
+// Taking over an entry is three rseq stores: the entry's error, then its key,
+// then its count. Each prefix leaves a valid (if looser) summary behind, so a
+// sequence that ends early needs no cleanup, and its retry finds the key
+// already in place.
+//
+// top() merges the cpus' summaries in the way of Agarwal et al.'s mergeable
+// summaries: a key missing from a full summary could have occurred up to that
+// summary's minimum count times there, so that much is added to both its count
+// and its error.
+template <int kCapacity = 32>
+class PerCpuTopK {
+ public:
+  struct Entry {
+    std::uint64_t key;
+    // The key occurred between count - error and count times.
+    std::uint64_t count;
+    std::uint64_t error;
+  };
+
+  PerCpuTopK() = default;
+
+  PerCpuTopK(const PerCpuTopK&) = delete;
+  PerCpuTopK& operator=(const PerCpuTopK&) = delete;
+
+  void add(std::uint64_t key, std::uint64_t count = 1) {
+    shards_.withLocal([&](Shard& shard) {
+      // Entries with a zero count are empty, whatever their key.
+      int minEntry = 0;
+      std::uint64_t minCount = ~std::uint64_t(0);
+      for (int i = 0; i < kCapacity; ++i) {
+        std::uint64_t entryCount = shard.counts[i].load();
+        if (entryCount != 0 && shard.keys[i].load() == key) {
+          return rseq::store(&shard.counts[i], entryCount + count);
+        }
+        if (entryCount < minCount) {
+          minEntry = i;
+          minCount = entryCount;
+        }
+      }
+      return rseq::store(&shard.errors[minEntry], minCount)
+          && rseq::store(&shard.keys[minEntry], key)
+          && rseq::store(&shard.counts[minEntry], minCount + count);
+    });
+  }
+
+  // Up to kCapacity entries, with the largest counts first. If exact is true,
+  // this reflects every add() that completed before the call; otherwise,
+  // recent ones may be missed, and an entry concurrently being taken over may
+  // be seen with a mix of its old and new fields.
+  std::vector<Entry> top(bool exact = true) {
+    if (exact) {
+      rseq::fence();
+    }
+    struct Merged {
+      Entry entry;
+      // The sum of the minimum counts of the summaries the key was found in.
+      std::uint64_t minsWherePresent;
+    };
+    std::unordered_map<std::uint64_t, Merged> merged;
+    std::uint64_t sumOfMins = 0;
+    shards_.forEach([&](int /* shard */, Shard& shard) {
+      Entry entries[kCapacity];
+      int numEntries = 0;
+      std::uint64_t minCount = ~std::uint64_t(0);
+      for (int i = 0; i < kCapacity; ++i) {
+        std::uint64_t count = shard.counts[i].load();
+        minCount = std::min(minCount, count);
+        if (count != 0) {
+          entries[numEntries++] =
+              Entry{shard.keys[i].load(), count, shard.errors[i].load()};
+        }
+      }
+      sumOfMins += minCount;
+      for (int i = 0; i < numEntries; ++i) {
+        Merged& m = merged.emplace(
+            entries[i].key, Merged{{entries[i].key, 0, 0}, 0}).first->second;
+        m.entry.count += entries[i].count;
+        m.entry.error += entries[i].error;
+        m.minsWherePresent += minCount;
+      }
+    });
+    std::vector<Entry> result;
+    for (auto& kv : merged) {
+      Entry entry = kv.second.entry;
+      std::uint64_t missed = sumOfMins - kv.second.minsWherePresent;
+      entry.count += missed;
+      entry.error += missed;
+      result.push_back(entry);
+    }
+    std::size_t resultSize =
+        std::min(result.size(), static_cast<std::size_t>(kCapacity));
+    std::partial_sort(
+        result.begin(),
+        result.begin() + resultSize,
+        result.end(),
+        [](const Entry& a, const Entry& b) { return a.count > b.count; });
+    result.resize(resultSize);
+    return result;
+  }
+
+ private:
+  struct Shard {
+    rseq::Value<std::uint64_t> keys[kCapacity];
+    rseq::Value<std::uint64_t> counts[kCapacity];
+    rseq::Value<std::uint64_t> errors[kCapacity];
+  };
+
+  PerCpu<Shard> shards_;
+};
+
+} // namespace rseq
@@ -0,0 +1,72 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#include "rseq/PerCpuTopK.h"
+
+#include <cstdint>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "rseq/internal/NumCpus.h"
+#include "rseq/internal/SwitchToCpu.h"
+
+using namespace rseq::internal;
+
+TEST(PerCpuTopK, ExactWhenEverythingFits) {
+  rseq::PerCpuTopK<8> topK;
+  EXPECT_TRUE(topK.top().empty());
+  for (int cpu = 0; cpu < numCpus(); ++cpu) {
+    switchToCpu(cpu);
+    for (std::uint64_t key = 1; key <= 4; ++key) {
+      topK.add(key, key);
+    }
+  }
+  std::vector<rseq::PerCpuTopK<8>::Entry> top = topK.top();
+  ASSERT_EQ(4, top.size());
+  for (int i = 0; i < 4; ++i) {
+    EXPECT_EQ(4 - i, top[i].key);
+    EXPECT_EQ((4 - i) * numCpus(), top[i].count);
+    EXPECT_EQ(0, top[i].error);
+  }
+}
+
+TEST(PerCpuTopK, FindsHeavyHitters) {
+  const int kNumThreads = 2 * numCpus();
+  const int kAddsPerThread = 100000;
+  rseq::PerCpuTopK<16> topK;
+  std::vector<std::thread> threads;
+  for (int i = 0; i < kNumThreads; ++i) {
+    threads.emplace_back([&, i]() {
+      std::mt19937 rng(i);
+      for (int j = 0; j < kAddsPerThread; ++j) {
+        if (j % 1000 == 0) {
+          switchToCpu((i + j / 1000) % numCpus());
+        }
+        // Keys 1 to 3 make up 30% of the stream; the rest is spread over a
+        // million keys.
+        std::uint64_t key = j % 10 < 3 ? j % 10 + 1 : 100 + rng() % 1000000;
+        topK.add(key);
+      }
+    });
+  }
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+  std::uint64_t trueCount = std::uint64_t(kNumThreads) * kAddsPerThread / 10;
+  std::vector<rseq::PerCpuTopK<16>::Entry> top = topK.top();
+  ASSERT_LE(3, top.size());
+  for (int i = 0; i < 3; ++i) {
+    EXPECT_GE(3, top[i].key);
+    EXPECT_LE(trueCount, top[i].count);
+    EXPECT_GE(trueCount, top[i].count - top[i].error);
+  }
+}
@@ -0,0 +1,158 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#pragma once
+
+#include <cassert>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+#include "rseq/PerCpuArray.h"
+#include "rseq/Rseq.h"
+
+namespace rseq {
+
+// Counts events over a sliding window of time (e.g. one bucket per second for
+// the last minute), for QPS and error-rate style metrics. Each cpu has its own
+// ring of buckets; add() is an rseq increment of the calling cpu's bucket for
+// the current tick.
+//
+// Buckets are recycled lazily: each one is a single word holding the low bits
+// of the tick it counts for alongside the count, so an add() that finds a
+// bucket left over from an earlier lap of the ring restarts it at its own
+// delta, in the same store. Queries merge the cpus, skipping buckets that are
+// stale. (Tags are 24 bits, so a bucket untouched for a multiple of 2^24
+// ticks could be mistaken for a current one; counts are 40 bits per bucket per
+// cpu.)
+class PerCpuWindowedCounter {
+ public:
+  typedef std::chrono::steady_clock Clock;
+
+  explicit PerCpuWindowedCounter(
+      int numBuckets = 60,
+      Clock::duration tickDuration = std::chrono::seconds(1))
+      : numBuckets_(numBuckets),
+        tickDuration_(tickDuration),
+        start_(Clock::now()),
+        buckets_(numBuckets) {
+    assert(numBuckets > 0);
+    // Nothing to initialize: os_mem memory starts out zeroed, which reads as a
+    // count of 0 for tick 0 (and for the ticks its tag aliases with).
+  }
+
+  PerCpuWindowedCounter(const PerCpuWindowedCounter&) = delete;
+  PerCpuWindowedCounter& operator=(const PerCpuWindowedCounter&) = delete;
+
+  int numBuckets() const {
+    return numBuckets_;
+  }
+
+  Clock::duration tickDuration() const {
+    return tickDuration_;
+  }
+
+  // Ticks since the counter was created.
+  std::uint64_t now() const {
+    return (Clock::now() - start_) / tickDuration_;
+  }
+
+  void add(std::uint64_t delta = 1) {
+    addAt(now(), delta);
+  }
+
+  // As above, at a given tick rather than the current one. Adding at a tick
+  // that has fallen out of the window (i.e. whose bucket has since been reused)
+  // throws away the later tick's count.
+  void addAt(std::uint64_t tick, std::uint64_t delta = 1) {
+    std::size_t index = tick % numBuckets_;
+    while (true) {
+      Value<std::uint64_t>* bucket = buckets_.forCpu(rseq::begin(), index);
+      std::uint64_t word = bucket->load();
+      std::uint64_t updated = tagOf(word) == tagFor(tick)
+          ? word + delta
+          : pack(tick, delta);
+      if (rseq::store(bucket, updated)) {
+        return;
+      }
+    }
+  }
+
+  // The count over the current tick (which is still in progress) and the
+  // numTicks - 1 before it. numTicks must be in [1, numBuckets()]. If exact is
+  // true, the result includes every add() that completed before the call;
+  // otherwise, recent ones may be missed.
+  std::uint64_t sum(int numTicks, bool exact = true) {
+    return sumEndingAt(now(), numTicks, exact);
+  }
+
+  // The average rate per second over the numTicks complete ticks before the
+  // current one. numTicks must be in [1, numBuckets() - 1], since the current
+  // tick takes up a bucket.
+  double ratePerSecond(int numTicks, bool exact = true) {
+    std::uint64_t tick = now();
+    if (tick == 0) {
+      return 0.0;
+    }
+    std::uint64_t count = sumEndingAt(tick - 1, numTicks, exact);
+    std::chrono::duration<double> window = numTicks * tickDuration_;
+    return count / window.count();
+  }
+
+  // The count over ticks (lastTick - numTicks, lastTick]. Ticks before the
+  // creation of the counter, or out of the window, count as 0.
+  std::uint64_t sumEndingAt(
+      std::uint64_t lastTick,
+      int numTicks,
+      bool exact = true) {
+    assert(numTicks > 0 && numTicks <= numBuckets_);
+    if (exact) {
+      rseq::fence();
+    }
+    std::uint64_t result = 0;
+    for (int i = 0; i < numTicks && i <= static_cast<std::int64_t>(lastTick);
+         ++i) {
+      std::uint64_t tick = lastTick - i;
+      std::size_t index = tick % numBuckets_;
+      for (int cpu = 0; cpu < internal::numCpus(); ++cpu) {
+        std::uint64_t word = buckets_.forCpu(cpu, index)->load();
+        if (tagOf(word) == tagFor(tick)) {
+          result += word & kCountMask;
+        }
+      }
+    }
+    return result;
+  }
+
+ private:
+  constexpr static int kCountBits = 40;
+  constexpr static std::uint64_t kCountMask =
+      (std::uint64_t(1) << kCountBits) - 1;
+  constexpr static std::uint64_t kTagMask =
+      (std::uint64_t(1) << (64 - kCountBits)) - 1;
+
+  static std::uint64_t tagFor(std::uint64_t tick) {
+    return tick & kTagMask;
+  }
+
+  static std::uint64_t tagOf(std::uint64_t word) {
+    return word >> kCountBits;
+  }
+
+  static std::uint64_t pack(std::uint64_t tick, std::uint64_t count) {
+    return (tagFor(tick) << kCountBits) | count;
+  }
+
+  const int numBuckets_;
+  const Clock::duration tickDuration_;
+  const Clock::time_point start_;
+  PerCpuArray<std::uint64_t> buckets_;
+};
+
+} // namespace rseq
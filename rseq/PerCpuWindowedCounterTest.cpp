@@ -0,0 +1,97 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#include "rseq/PerCpuWindowedCounter.h"
+
+#include <chrono>
+#include <cstdint>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "rseq/internal/NumCpus.h"
+#include "rseq/internal/SwitchToCpu.h"
+
+using namespace rseq::internal;
+
+TEST(PerCpuWindowedCounter, SumsOverTheWindow) {
+  rseq::PerCpuWindowedCounter counter(10);
+  EXPECT_EQ(0, counter.sumEndingAt(0, 10));
+  // Tick t gets t + 1 per cpu.
+  for (std::uint64_t tick = 0; tick < 5; ++tick) {
+    for (int cpu = 0; cpu < numCpus(); ++cpu) {
+      switchToCpu(cpu);
+      counter.addAt(tick, tick + 1);
+    }
+  }
+  EXPECT_EQ(5 * numCpus(), counter.sumEndingAt(4, 1));
+  EXPECT_EQ((5 + 4 + 3) * numCpus(), counter.sumEndingAt(4, 3));
+  EXPECT_EQ(15 * numCpus(), counter.sumEndingAt(4, 10));
+  EXPECT_EQ((3 + 2) * numCpus(), counter.sumEndingAt(2, 2));
+}
+
+TEST(PerCpuWindowedCounter, RecyclesStaleBuckets) {
+  rseq::PerCpuWindowedCounter counter(4);
+  for (std::uint64_t tick = 0; tick < 4; ++tick) {
+    counter.addAt(tick, 100);
+  }
+  // Tick 5 reuses tick 1's bucket; ticks 2 and 3 are still in the window.
+  counter.addAt(5, 1);
+  EXPECT_EQ(201, counter.sumEndingAt(5, 4));
+  // Tick 4's bucket still holds tick 0's count, which doesn't show up.
+  EXPECT_EQ(1, counter.sumEndingAt(5, 2));
+  // Much later, nothing is left.
+  EXPECT_EQ(0, counter.sumEndingAt(1000, 4));
+  counter.addAt(1000, 7);
+  EXPECT_EQ(7, counter.sumEndingAt(1000, 4));
+  // Not even a bucket that's a whole number of laps behind.
+  EXPECT_EQ(0, counter.sumEndingAt(1004, 1));
+}
+
+TEST(PerCpuWindowedCounter, UsesRealTime) {
+  rseq::PerCpuWindowedCounter counter(
+      100, std::chrono::milliseconds(10));
+  std::uint64_t numAdded = 0;
+  std::uint64_t firstTick = counter.now();
+  // Add for a few ticks.
+  while (counter.now() < firstTick + 5) {
+    counter.add();
+    ++numAdded;
+  }
+  EXPECT_EQ(numAdded, counter.sum(100));
+  EXPECT_LT(0.0, counter.ratePerSecond(10));
+  // Once more than the window has passed, it all falls out.
+  std::this_thread::sleep_for(std::chrono::milliseconds(1100));
+  EXPECT_EQ(0, counter.sum(100));
+  EXPECT_EQ(0.0, counter.ratePerSecond(10));
+}
+
+TEST(PerCpuWindowedCounter, ConcurrentAdds) {
+  const int kNumThreads = 2 * numCpus();
+  const int kAddsPerThread = 100000;
+  rseq::PerCpuWindowedCounter counter(16);
+  std::vector<std::thread> threads;
+  for (int i = 0; i < kNumThreads; ++i) {
+    threads.emplace_back([&, i]() {
+      for (int j = 0; j < kAddsPerThread; ++j) {
+        if (j % 1000 == 0) {
+          switchToCpu((i + j / 1000) % numCpus());
+        }
+        counter.addAt(j % 8);
+      }
+    });
+  }
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+  EXPECT_EQ(
+      std::uint64_t(kNumThreads) * kAddsPerThread,
+      counter.sumEndingAt(7, 8));
+}
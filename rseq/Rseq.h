@@ -304,6 +304,17 @@ inline int begin() {
   return ret;
 }
 
+// Begins an rseq on the given shard, regardless of which cpu the calling thread
+// is running on. Ends any rseq ongoing on that shard (so that it can be used to
+// take over another cpu's data, e.g. to drain it). Stores visible to rseqs on
+// the shard before this call are visible to the rseq it begins. Like any rseq,
+// this one lasts until some other thread begins an rseq on the same shard;
+// until then (or until end() is called), begin() keeps returning shard.
+// This is slow (it always does a heavy fence); it's not meant for fast paths.
+inline int beginRemote(int shard) {
+  return internal::beginRemoteWrapper(shard);
+}
+
 // Tries to do "*dst = *src;" in the rseq last started by this thread, with
 // memory_order_seq_cst semantics.
 // If this returns true, then the load was successful and the rseq was not yet
@@ -404,4 +415,24 @@ inline void fence() {
   internal::fenceWrapper();
 }
 
+// Switches the process to handing out concurrency ids instead of cpu ids as
+// shard indices. Must be called before any thread calls an rseq function, and
+// before anything asks for the topology of a shard (constructing per-cpu data
+// does, on a machine with several NUMA nodes, to place each shard on its cpu's
+// node); returns false (and does nothing) otherwise.
+//
+// In this mode, rseq::begin() returns a dense id in [0, numCpus - 1], and the
+// ids in use at any one time are bounded by the number of threads running
+// rseqs concurrently (not by the number of cpus they happen to run on); a few
+// busy threads on a large host keep their sharded data in the first few shards.
+// Ids are exclusive in exactly the sense that cpus otherwise are, so the API
+// and memory model specifics above are unchanged. Ids are sticky: a thread
+// usually gets back the id last used on its cpu. But they aren't cpu ids, so
+// anything derived from the cpu (like its NUMA node) no longer follows from
+// the shard index; the containers here that use the topology of their shards
+// fall back to treating the machine as flat.
+inline bool useConcurrencyIds() {
+  return internal::useConcurrencyIds();
+}
+
 } // namespace rseq
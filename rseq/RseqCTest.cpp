@@ -58,3 +58,17 @@ TEST(RseqC, SanityChecks) {
   EXPECT_TRUE(rseq_load(&rseqValue, &rseqItem));
   EXPECT_EQ(5, rseqValue);
 }
+
+TEST(RseqC, AllocatesPerCpu) {
+  rseq_percpu_t handle = rseq_percpu_alloc(sizeof(rseq_repr_t), 8);
+  ASSERT_NE(0, handle);
+  int cpu = rseq_begin();
+  rseq_repr_t* item = static_cast<rseq_repr_t*>(rseq_percpu_ptr(handle, cpu));
+  rseq_value_t value;
+  EXPECT_TRUE(rseq_load(&value, item));
+  EXPECT_EQ(0, value);
+  EXPECT_TRUE(rseq_store(item, 6));
+  EXPECT_TRUE(rseq_load(&value, item));
+  EXPECT_EQ(6, value);
+  rseq_percpu_free(handle);
+}
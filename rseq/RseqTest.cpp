@@ -22,6 +22,7 @@
 #include <gtest/gtest.h>
 
 #include "rseq/internal/CpuLocal.h"
+#include "rseq/internal/NumCpus.h"
 #include "rseq/internal/SwitchToCpu.h"
 
 TEST(RseqMemberAddr, GetsAddresses) {
@@ -409,6 +410,32 @@ TEST(Rseq, FencesCorrectly) {
   runFenceTest(40, 10000, 100000, false);
 }
 
+TEST(Rseq, BeginsRemotely) {
+  rseq::internal::switchToCpu(0);
+  rseq::Value<std::uint64_t> value(0);
+  int shard = rseq::begin();
+  EXPECT_EQ(0, shard);
+  EXPECT_TRUE(rseq::store(&value, 1));
+
+  std::thread t([&]() {
+    // Wherever this thread runs, it takes over our shard.
+    EXPECT_EQ(shard, rseq::beginRemote(shard));
+    EXPECT_EQ(shard, rseq::begin());
+    EXPECT_EQ(1, value.load());
+    EXPECT_TRUE(rseq::store(&value, 2));
+    rseq::end();
+  });
+  t.join();
+
+  EXPECT_FALSE(rseq::store(&value, 3));
+  EXPECT_EQ(2, value.load());
+}
+
+TEST(Rseq, CantSwitchToConcurrencyIdsLate) {
+  rseq::begin();
+  EXPECT_FALSE(rseq::useConcurrencyIds());
+}
+
 TEST(Rseq, ReinitializesCorrectly) {
   static pthread_key_t key1;
   static pthread_key_t key2;
@@ -0,0 +1,116 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#include "rseq/internal/CompactCpus.h"
+
+#include <sched.h>
+
+#include <cstddef>
+
+#include "rseq/internal/Mutex.h"
+#include "rseq/internal/NumCpus.h"
+#include "rseq/internal/OsMem.h"
+
+namespace rseq {
+namespace internal {
+
+namespace detail {
+std::atomic<std::atomic<int>*> compactIndexPlusOneByCpu;
+} // namespace detail
+
+// Protects everything below, and all assignments of indices.
+static mutex::Mutex mu;
+static std::atomic<int>* indexPlusOneByCpu;
+static int* cpuByIndex;
+static std::atomic<int> numAssigned;
+// We can't use CPU_ALLOC (it mallocs), so we keep our own affinity mask buffer
+// around, sized for numCpus().
+static cpu_set_t* affinityMask;
+static std::size_t affinityMaskBytes;
+
+static void assignLocked(int cpu) {
+  if (indexPlusOneByCpu[cpu].load(std::memory_order_relaxed) != 0) {
+    return;
+  }
+  int index = numAssigned.load(std::memory_order_relaxed);
+  cpuByIndex[index] = cpu;
+  indexPlusOneByCpu[cpu].store(index + 1, std::memory_order_release);
+  // seq_cst, so that fence() (which reads this after its own seq_cst fence)
+  // either sees the new cpu, or is ordered before the beginning of any rseq on
+  // it. Rseq.cpp relies on this.
+  numAssigned.store(index + 1, std::memory_order_seq_cst);
+}
+
+static void assignAllowedCpusLocked() {
+  if (sched_getaffinity(0, affinityMaskBytes, affinityMask) != 0) {
+    return;
+  }
+  for (int cpu = 0; cpu < numCpus(); ++cpu) {
+    if (CPU_ISSET_S(cpu, affinityMaskBytes, affinityMask)) {
+      assignLocked(cpu);
+    }
+  }
+}
+
+static void ensureInitializedLocked() {
+  if (indexPlusOneByCpu != nullptr) {
+    return;
+  }
+  // os_mem memory is zeroed, which is what we want everywhere here.
+  indexPlusOneByCpu = static_cast<std::atomic<int>*>(
+      os_mem::allocate(sizeof(std::atomic<int>) * numCpus()));
+  cpuByIndex = static_cast<int*>(os_mem::allocate(sizeof(int) * numCpus()));
+  affinityMaskBytes = CPU_ALLOC_SIZE(numCpus());
+  if (affinityMaskBytes < sizeof(cpu_set_t)) {
+    affinityMaskBytes = sizeof(cpu_set_t);
+  }
+  affinityMask = static_cast<cpu_set_t*>(os_mem::allocate(affinityMaskBytes));
+
+  assignAllowedCpusLocked();
+  detail::compactIndexPlusOneByCpu.store(
+      indexPlusOneByCpu, std::memory_order_release);
+}
+
+int compactIndexForCpuSlowPath(int cpu) {
+  mutex::LockGuard<mutex::Mutex> lg(mu);
+  ensureInitializedLocked();
+  if (indexPlusOneByCpu[cpu].load(std::memory_order_relaxed) == 0) {
+    // Something changed since we last looked at the mask.
+    assignAllowedCpusLocked();
+    // The cpu may still not be in our mask (if the calling thread has a wider
+    // mask than the main thread, say). We're running on it regardless.
+    assignLocked(cpu);
+  }
+  return indexPlusOneByCpu[cpu].load(std::memory_order_relaxed) - 1;
+}
+
+int numCompactCpus() {
+  if (RSEQ_UNLIKELY(
+        detail::compactIndexPlusOneByCpu.load(std::memory_order_acquire)
+            == nullptr)) {
+    mutex::LockGuard<mutex::Mutex> lg(mu);
+    ensureInitializedLocked();
+  }
+  return numAssigned.load(std::memory_order_seq_cst);
+}
+
+int cpuForCompactIndex(int index) {
+  // The caller got index either from compactIndexForCpu or by being less than
+  // numCompactCpus(); either way, it synchronized with the assignment.
+  return cpuByIndex[index];
+}
+
+void refreshCompactCpus() {
+  mutex::LockGuard<mutex::Mutex> lg(mu);
+  ensureInitializedLocked();
+  assignAllowedCpusLocked();
+}
+
+} // namespace internal
+} // namespace rseq
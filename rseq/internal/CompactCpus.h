@@ -0,0 +1,75 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#pragma once
+
+#include <atomic>
+
+#include "rseq/internal/Likely.h"
+
+namespace rseq {
+namespace internal {
+
+// A dense, stable numbering of the cpus this process runs on.
+//
+// numCpus() counts every cpu id the kernel might hand out, but a process that
+// a cpuset (or affinity mask) confines to a handful of cpus on a big host only
+// ever runs on a few of them. Rseq.cpp registers every cpu it acquires here,
+// so that fence() only has to visit cpus that could have rseqs to end, and
+// containers that split a fixed budget between cpus split it between these
+// (see numActiveShards() in ShardMode.h). Other per-cpu containers still size
+// and walk their data by numCpus(); their untouched shards cost address space,
+// not memory (see PerCpu.h), but are still visited when summed.
+//
+// Indices are seeded from the affinity mask when the mapping is first used (so
+// that the allowed cpus get indices [0, number of allowed cpus)). When asked
+// about a cpu with no index yet (because the mask has since grown, or some
+// thread has a wider mask than the one we were seeded from), we re-read the
+// mask and hand out indices to every newly allowed cpu.
+// Indices are never reassigned or reclaimed, so two cpus never share one; that
+// keeps the mapping safe to use for indexing rseq-protected data.
+
+namespace detail {
+// Maps cpu -> index + 1 (0 means "no index yet"). Null until initialized.
+extern std::atomic<std::atomic<int>*> compactIndexPlusOneByCpu;
+} // namespace detail
+
+// Returns -1 if the cpu hasn't been assigned an index yet.
+inline int tryCompactIndexForCpu(int cpu) {
+  std::atomic<int>* table =
+      detail::compactIndexPlusOneByCpu.load(std::memory_order_acquire);
+  if (RSEQ_UNLIKELY(table == nullptr)) {
+    return -1;
+  }
+  return table[cpu].load(std::memory_order_acquire) - 1;
+}
+
+// Assigns an index to the cpu (and to any other newly allowed cpus) if needed.
+int compactIndexForCpuSlowPath(int cpu);
+
+inline int compactIndexForCpu(int cpu) {
+  int result = tryCompactIndexForCpu(cpu);
+  if (RSEQ_UNLIKELY(result < 0)) {
+    result = compactIndexForCpuSlowPath(cpu);
+  }
+  return result;
+}
+
+// The number of indices handed out so far; this only ever grows. Indices are
+// in [0, numCompactCpus()), and numCompactCpus() <= numCpus().
+int numCompactCpus();
+
+// index must be in [0, numCompactCpus()).
+int cpuForCompactIndex(int index);
+
+// Re-reads the affinity mask, and hands out indices to any newly allowed cpus.
+void refreshCompactCpus();
+
+} // namespace internal
+} // namespace rseq
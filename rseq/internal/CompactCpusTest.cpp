@@ -0,0 +1,64 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#include "rseq/internal/CompactCpus.h"
+
+#include <sched.h>
+
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "rseq/internal/NumCpus.h"
+
+using namespace rseq::internal;
+
+// This has to run first; after that, every cpu has been given an index.
+TEST(CompactCpus, AllowedCpusComeFirst) {
+  cpu_set_t set;
+  ASSERT_EQ(0, sched_getaffinity(0, sizeof(set), &set));
+  int numAllowed = 0;
+  for (int cpu = 0; cpu < numCpus() && cpu < CPU_SETSIZE; ++cpu) {
+    if (CPU_ISSET(cpu, &set)) {
+      ++numAllowed;
+    }
+  }
+
+  EXPECT_EQ(numAllowed, numCompactCpus());
+  for (int cpu = 0; cpu < numCpus() && cpu < CPU_SETSIZE; ++cpu) {
+    if (CPU_ISSET(cpu, &set)) {
+      EXPECT_EQ(cpu, tryCompactIndexForCpu(cpu) >= 0
+          ? cpuForCompactIndex(tryCompactIndexForCpu(cpu)) : -1);
+      EXPECT_GT(numAllowed, compactIndexForCpu(cpu));
+    } else {
+      EXPECT_EQ(-1, tryCompactIndexForCpu(cpu));
+    }
+  }
+}
+
+TEST(CompactCpus, IndicesAreDenseAndInjective) {
+  std::vector<bool> seen(numCpus());
+  for (int cpu = 0; cpu < numCpus(); ++cpu) {
+    int index = compactIndexForCpu(cpu);
+    ASSERT_LE(0, index);
+    ASSERT_GT(numCpus(), index);
+    EXPECT_FALSE(seen[index]);
+    seen[index] = true;
+    EXPECT_EQ(cpu, cpuForCompactIndex(index));
+    EXPECT_EQ(index, tryCompactIndexForCpu(cpu));
+  }
+  EXPECT_EQ(numCpus(), numCompactCpus());
+
+  // Refreshing doesn't change anything that's already been handed out.
+  refreshCompactCpus();
+  EXPECT_EQ(numCpus(), numCompactCpus());
+  for (int cpu = 0; cpu < numCpus(); ++cpu) {
+    EXPECT_EQ(cpu, cpuForCompactIndex(compactIndexForCpu(cpu)));
+  }
+}
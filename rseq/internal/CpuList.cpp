@@ -0,0 +1,56 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#include "rseq/internal/CpuList.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace rseq {
+namespace internal {
+
+bool readSysfsFile(const char* path, char* buf, int bufSize) {
+  int fd = open(path, O_RDONLY);
+  if (fd == -1) {
+    return false;
+  }
+  ssize_t length = -1;
+  // Retry in case a signal interrupts us.
+  for (int i = 0; i < 10 && length == -1; ++i) {
+    length = read(fd, buf, bufSize);
+  }
+  close(fd);
+  if (length < 0 || length >= bufSize) {
+    return false;
+  }
+  buf[length] = '\0';
+  return true;
+}
+
+char* appendInt(int i, char* a) {
+  char* cur = a;
+  if (i == 0) {
+    *cur++ = '0';
+  }
+  while (i != 0) {
+    *cur++ = '0' + i % 10;
+    i /= 10;
+  }
+  // We printed the number least-significant digit first; reverse it.
+  for (char* left = a, *right = cur - 1; left < right; ++left, --right) {
+    char temp = *right;
+    *right = *left;
+    *left = temp;
+  }
+  *cur = '\0';
+  return cur;
+}
+
+} // namespace internal
+} // namespace rseq
@@ -0,0 +1,65 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#pragma once
+
+namespace rseq {
+namespace internal {
+
+// Parses the list format the kernel uses for sets of cpus and nodes in sysfs
+// (e.g. "0-7,16-23\n"), calling func(first, last) for each inclusive range.
+// Returns false (possibly after calling func on some prefix of the ranges) if
+// the string is malformed.
+template <typename Func>
+bool parseCpuList(const char* str, Func&& func) {
+  const char* cur = str;
+  while (*cur != '\0' && *cur != '\n') {
+    int first = 0;
+    if (*cur < '0' || *cur > '9') {
+      return false;
+    }
+    while (*cur >= '0' && *cur <= '9') {
+      first = first * 10 + (*cur++ - '0');
+    }
+    int last = first;
+    if (*cur == '-') {
+      ++cur;
+      if (*cur < '0' || *cur > '9') {
+        return false;
+      }
+      last = 0;
+      while (*cur >= '0' && *cur <= '9') {
+        last = last * 10 + (*cur++ - '0');
+      }
+    }
+    if (last < first) {
+      return false;
+    }
+    func(first, last);
+    if (*cur == ',') {
+      ++cur;
+    } else if (*cur != '\0' && *cur != '\n') {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Reads a (small) sysfs file into buf, null-terminating it. Returns false if
+// the file couldn't be opened or read, or didn't fit into buf.
+// This does only raw syscalls, and so is safe to call from inside malloc.
+bool readSysfsFile(const char* path, char* buf, int bufSize);
+
+// Writes the decimal representation of i (which must be nonnegative) to a,
+// returning a pointer to the first character after it. Like readSysfsFile,
+// this exists so that we can build sysfs paths without calling snprintf.
+char* appendInt(int i, char* a);
+
+} // namespace internal
+} // namespace rseq
@@ -0,0 +1,81 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#include "rseq/internal/CpuList.h"
+
+#include <utility>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+using namespace rseq::internal;
+
+static std::vector<std::pair<int, int>> parse(const char* str, bool* ok) {
+  std::vector<std::pair<int, int>> result;
+  *ok = parseCpuList(str, [&](int first, int last) {
+    result.push_back(std::make_pair(first, last));
+  });
+  return result;
+}
+
+TEST(CpuList, ParsesRanges) {
+  bool ok;
+  std::vector<std::pair<int, int>> ranges = parse("0-7,16-23\n", &ok);
+  EXPECT_TRUE(ok);
+  ASSERT_EQ(2, ranges.size());
+  EXPECT_EQ(std::make_pair(0, 7), ranges[0]);
+  EXPECT_EQ(std::make_pair(16, 23), ranges[1]);
+
+  ranges = parse("3,5-5,100", &ok);
+  EXPECT_TRUE(ok);
+  ASSERT_EQ(3, ranges.size());
+  EXPECT_EQ(std::make_pair(3, 3), ranges[0]);
+  EXPECT_EQ(std::make_pair(5, 5), ranges[1]);
+  EXPECT_EQ(std::make_pair(100, 100), ranges[2]);
+
+  ranges = parse("\n", &ok);
+  EXPECT_TRUE(ok);
+  EXPECT_EQ(0, ranges.size());
+}
+
+TEST(CpuList, RejectsGarbage) {
+  bool ok;
+  parse("0-", &ok);
+  EXPECT_FALSE(ok);
+  parse("7-3", &ok);
+  EXPECT_FALSE(ok);
+  parse("1,,2", &ok);
+  EXPECT_FALSE(ok);
+  parse("abc", &ok);
+  EXPECT_FALSE(ok);
+}
+
+TEST(CpuList, ReadsSysfs) {
+  char buf[4096];
+  // Every Linux system we care about has this file.
+  ASSERT_TRUE(
+      readSysfsFile("/sys/devices/system/cpu/online", buf, sizeof(buf)));
+  bool ok;
+  std::vector<std::pair<int, int>> ranges = parse(buf, &ok);
+  EXPECT_TRUE(ok);
+  EXPECT_LT(0, ranges.size());
+
+  EXPECT_FALSE(
+      readSysfsFile("/sys/this/file/does/not/exist", buf, sizeof(buf)));
+}
+
+TEST(CpuList, AppendsInts) {
+  char buf[16];
+  char* end = appendInt(0, buf);
+  EXPECT_STREQ("0", buf);
+  EXPECT_EQ(buf + 1, end);
+  end = appendInt(1234567, buf);
+  EXPECT_STREQ("1234567", buf);
+  EXPECT_EQ(buf + 7, end);
+}
@@ -9,32 +9,44 @@
 
 #pragma once
 
+#include <cstddef>
 #include <new>
 
 #include "rseq/internal/CachelinePadded.h"
+#include "rseq/internal/Likely.h"
 #include "rseq/internal/NumCpus.h"
 #include "rseq/internal/OsMem.h"
+#include "rseq/internal/ShardMode.h"
+#include "rseq/internal/Topology.h"
 
 
 namespace rseq {
 namespace internal {
 
+// Each cpu's element is placed on that cpu's NUMA node, as far as page
+// granularity allows. Elements are indexed by shard (see ShardMode.h); in
+// concurrency id mode, where shards have no cpu, placement is left to the
+// kernel.
 template <typename T>
 class CpuLocal {
  public:
   CpuLocal() {
-    void* mem = os_mem::allocate(sizeof(ElemType) * numCpus());
+    int cpus = numCpus();
+    void* mem = os_mem::allocate(sizeof(ElemType) * cpus);
     elements_ = static_cast<ElemType*>(mem);
-    for (int i = 0; i < numCpus(); ++i) {
+    // Has to happen before the constructors below touch the memory.
+    placeOnNodes(cpus);
+    for (int i = 0; i < cpus; ++i) {
       new (&elements_[i]) ElemType;
     }
   }
 
   ~CpuLocal() {
-    for (int i = 0; i < numCpus(); ++i) {
+    int cpus = numCpus();
+    for (int i = 0; i < cpus; ++i) {
       elements_[i].~ElemType();
     }
-    os_mem::free(elements_, sizeof(ElemType) * numCpus());
+    os_mem::free(elements_, sizeof(ElemType) * cpus);
   }
 
   T* forCpu(int i) {
@@ -45,8 +57,111 @@ class CpuLocal {
   // This saves us some typing, and is needed for explicit destructor invocation
   // (which doesn't parse with template types).
   typedef CachelinePadded<T> ElemType;
+
+  // Binds each page whose elements all belong to cpus of a single node to that
+  // node. Pages shared between nodes are left to the default policy. Runs of
+  // pages on the same node are bound with a single call, so with the usual
+  // contiguous numbering of each node's cpus this is a handful of syscalls.
+  void placeOnNodes(int cpus) {
+    if (numNodes() <= 1 || !shardsAreCpus()) {
+      return;
+    }
+    const std::size_t kPageSize = 4096;
+    std::size_t bytes = sizeof(ElemType) * cpus;
+    char* base = reinterpret_cast<char*>(elements_);
+    int runNode = -1;
+    std::size_t runBegin = 0;
+    for (std::size_t page = 0; page < bytes; page += kPageSize) {
+      int firstCpu = page / sizeof(ElemType);
+      int lastCpu = (page + kPageSize - 1) / sizeof(ElemType);
+      if (lastCpu >= cpus) {
+        lastCpu = cpus - 1;
+      }
+      int node = nodeForShard(firstCpu);
+      for (int cpu = firstCpu + 1; cpu <= lastCpu; ++cpu) {
+        if (nodeForShard(cpu) != node) {
+          node = -1;
+          break;
+        }
+      }
+      if (node != runNode) {
+        if (runNode >= 0) {
+          os_mem::bindToNode(base + runBegin, page - runBegin, runNode);
+        }
+        runNode = node;
+        runBegin = page;
+      }
+    }
+    if (runNode >= 0) {
+      os_mem::bindToNode(base + runBegin, bytes - runBegin, runNode);
+    }
+  }
+
   ElemType* elements_;
 };
 
+// Like CpuLocal, but with storage for the first kMaxCpus cpus inline in the
+// object rather than behind a heap pointer. forCpu() on those cpus is then a
+// constant-offset index from "this" (or, for an object with static storage
+// duration, from a link-time constant), which the compiler can fold into the
+// addressing of the surrounding rseq operations. numCpus() counts possible
+// cpus, which can outnumber any bound picked with the online ones in mind, so
+// cpus past kMaxCpus get their elements from a separate allocation, behind a
+// predictable branch.
+// Elements are cacheline aligned only if the object itself is; that's
+// guaranteed for static and automatic storage, but not by a C++11 operator
+// new.
+template <typename T, int kMaxCpus>
+class BoundedCpuLocal {
+ public:
+  BoundedCpuLocal() : overflow_(nullptr) {
+    int extra = numOverflowCpus();
+    if (extra == 0) {
+      return;
+    }
+    void* mem = os_mem::allocate(sizeof(ElemType) * extra);
+    overflow_ = static_cast<ElemType*>(mem);
+    for (int i = 0; i < extra; ++i) {
+      new (&overflow_[i]) ElemType;
+    }
+  }
+
+  ~BoundedCpuLocal() {
+    int extra = numOverflowCpus();
+    if (extra == 0) {
+      return;
+    }
+    for (int i = 0; i < extra; ++i) {
+      overflow_[i].~ElemType();
+    }
+    os_mem::free(overflow_, sizeof(ElemType) * extra);
+  }
+
+  BoundedCpuLocal(const BoundedCpuLocal&) = delete;
+  BoundedCpuLocal& operator=(const BoundedCpuLocal&) = delete;
+
+  T* forCpu(int i) {
+    if (RSEQ_LIKELY(i < kMaxCpus)) {
+      return elements_[i].get();
+    }
+    return overflow_[i - kMaxCpus].get();
+  }
+
+  constexpr static int maxCpus() {
+    return kMaxCpus;
+  }
+
+ private:
+  typedef CachelinePadded<T> ElemType;
+
+  static int numOverflowCpus() {
+    int cpus = numCpus();
+    return cpus > kMaxCpus ? cpus - kMaxCpus : 0;
+  }
+
+  alignas(kCachelineSize) ElemType elements_[kMaxCpus];
+  ElemType* overflow_;
+};
+
 } // namespace internal
 } // namespace rseq
@@ -9,6 +9,8 @@
 
 #include "rseq/internal/CpuLocal.h"
 
+#include <cstdint>
+
 #include <gtest/gtest.h>
 
 #include "rseq/internal/NumCpus.h"
@@ -40,3 +42,48 @@ TEST(CpuLocal, CanAccessAnotherCpusData) {
     EXPECT_EQ(i, *data.forCpu(i));
   }
 }
+
+// Bigger than any machine we'll run on.
+static BoundedCpuLocal<int, 1024> staticData;
+
+TEST(BoundedCpuLocal, DataIsPerCpu) {
+  for (int i = 0; i < numCpus(); ++i) {
+    switchToCpu(i);
+    *staticData.forCpu(i) = i;
+  }
+
+  for (int i = 0; i < numCpus(); ++i) {
+    switchToCpu(i);
+    EXPECT_EQ(i, *staticData.forCpu(i));
+  }
+}
+
+TEST(BoundedCpuLocal, StorageIsInlineAndPadded) {
+  EXPECT_EQ(1024, staticData.maxCpus());
+  std::uintptr_t begin = reinterpret_cast<std::uintptr_t>(&staticData);
+  std::uintptr_t end = begin + sizeof(staticData);
+  for (int i = 0; i < numCpus(); ++i) {
+    std::uintptr_t elem = reinterpret_cast<std::uintptr_t>(
+        staticData.forCpu(i));
+    EXPECT_LE(begin, elem);
+    EXPECT_GT(end, elem);
+    EXPECT_EQ(0, elem % kCachelineSize);
+    EXPECT_EQ(begin + i * kCachelineSize, elem);
+  }
+}
+
+TEST(BoundedCpuLocal, CpusPastTheBoundOverflow) {
+  // Every cpu but the first overflows.
+  BoundedCpuLocal<int, 1> data;
+  for (int i = 0; i < numCpus(); ++i) {
+    *data.forCpu(i) = i;
+  }
+  for (int i = 0; i < numCpus(); ++i) {
+    EXPECT_EQ(i, *data.forCpu(i));
+    if (i > 0) {
+      EXPECT_NE(data.forCpu(i - 1), data.forCpu(i));
+      EXPECT_EQ(0,
+          reinterpret_cast<std::uintptr_t>(data.forCpu(i)) % kCachelineSize);
+    }
+  }
+}
@@ -0,0 +1,30 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#pragma once
+
+#include <cstdint>
+
+namespace rseq {
+namespace internal {
+
+// MurmurHash3's 64-bit finalizer: a bijection on 64-bit values in which every
+// input bit affects every output bit. Good enough to spread keys (ids,
+// pointers, or hashes of unknown quality) over the buckets of a sketch.
+inline std::uint64_t mixHash(std::uint64_t key) {
+  key ^= key >> 33;
+  key *= 0xff51afd7ed558ccdULL;
+  key ^= key >> 33;
+  key *= 0xc4ceb9fe1a85ec53ULL;
+  key ^= key >> 33;
+  return key;
+}
+
+} // namespace internal
+} // namespace rseq
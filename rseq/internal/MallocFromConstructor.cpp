@@ -0,0 +1,35 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+// A shared library that allocates from its constructor, the way plenty of
+// system libraries do. Run under LD_PRELOAD=librseq_malloc.so, that can be
+// before librseq_malloc's own static initializers have run; test-only.
+
+#include <stdlib.h>
+#include <string.h>
+
+extern "C" {
+
+char* mallocFromConstructorResult;
+
+__attribute__((constructor)) static void mallocFromConstructor() {
+  void* scratch[16];
+  for (int i = 0; i < 16; ++i) {
+    scratch[i] = malloc(i * 100);
+  }
+  for (int i = 0; i < 16; ++i) {
+    free(scratch[i]);
+  }
+  mallocFromConstructorResult = static_cast<char*>(malloc(64));
+  if (mallocFromConstructorResult != nullptr) {
+    strcpy(mallocFromConstructorResult, "allocated");
+  }
+}
+
+} /* extern "C" */
@@ -0,0 +1,107 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+// The malloc entry points of librseq_malloc.so. This file is only linked into
+// that library; everything else that wants per_cpu_malloc calls it directly.
+
+#include <errno.h>
+#include <malloc.h>
+#include <stdlib.h>
+
+#include <cstddef>
+
+#include "rseq/internal/PerCpuMalloc.h"
+
+using namespace rseq::internal;
+
+// The library is built with hidden visibility; these are what it exports.
+#define RSEQ_EXPORT __attribute__((visibility("default")))
+
+static bool isPowerOfTwo(std::size_t n) {
+  return n != 0 && (n & (n - 1)) == 0;
+}
+
+extern "C" {
+
+RSEQ_EXPORT void* malloc(std::size_t size) noexcept {
+  void* result = per_cpu_malloc::allocate(size);
+  if (result == nullptr) {
+    errno = ENOMEM;
+  }
+  return result;
+}
+
+RSEQ_EXPORT void free(void* ptr) noexcept {
+  per_cpu_malloc::deallocate(ptr);
+}
+
+RSEQ_EXPORT void* calloc(std::size_t num, std::size_t size) noexcept {
+  std::size_t bytes;
+  if (__builtin_mul_overflow(num, size, &bytes)) {
+    errno = ENOMEM;
+    return nullptr;
+  }
+  void* result = malloc(bytes);
+  if (result != nullptr) {
+    __builtin_memset(result, 0, bytes);
+  }
+  return result;
+}
+
+RSEQ_EXPORT void* realloc(void* ptr, std::size_t size) noexcept {
+  void* result = per_cpu_malloc::reallocate(ptr, size);
+  if (result == nullptr && size != 0) {
+    errno = ENOMEM;
+  }
+  return result;
+}
+
+RSEQ_EXPORT void* memalign(std::size_t alignment, std::size_t size) noexcept {
+  if (!isPowerOfTwo(alignment)) {
+    errno = EINVAL;
+    return nullptr;
+  }
+  void* result = per_cpu_malloc::allocateAligned(alignment, size);
+  if (result == nullptr) {
+    errno = ENOMEM;
+  }
+  return result;
+}
+
+RSEQ_EXPORT int posix_memalign(
+    void** memptr, std::size_t alignment, std::size_t size) noexcept {
+  if (!isPowerOfTwo(alignment) || alignment % sizeof(void*) != 0) {
+    return EINVAL;
+  }
+  void* result = per_cpu_malloc::allocateAligned(alignment, size);
+  if (result == nullptr) {
+    return ENOMEM;
+  }
+  *memptr = result;
+  return 0;
+}
+
+RSEQ_EXPORT void* aligned_alloc(
+    std::size_t alignment, std::size_t size) noexcept {
+  return memalign(alignment, size);
+}
+
+RSEQ_EXPORT void* valloc(std::size_t size) noexcept {
+  return memalign(4096, size);
+}
+
+RSEQ_EXPORT void* pvalloc(std::size_t size) noexcept {
+  return memalign(4096, (size + 4095) & ~static_cast<std::size_t>(4095));
+}
+
+RSEQ_EXPORT std::size_t malloc_usable_size(void* ptr) noexcept {
+  return per_cpu_malloc::usableSize(ptr);
+}
+
+} /* extern "C" */
@@ -17,11 +17,11 @@ namespace rseq {
 namespace internal {
 namespace mutex {
 
-void Mutex::futexWait(std::uint32_t val) {
+void futexWait(std::atomic<std::uint32_t>* word, std::uint32_t val) {
   // We ignore errors here; it just means we'll spin a little extra.
   syscall(
       __NR_futex,
-      &state_,
+      word,
       FUTEX_WAIT | FUTEX_PRIVATE_FLAG,
       val,
       nullptr,
@@ -29,11 +29,11 @@ void Mutex::futexWait(std::uint32_t val) {
       0);
 }
 
-void Mutex::futexWake(int num) {
+void futexWake(std::atomic<std::uint32_t>* word, int num) {
   // Ignore errors here, too; it probably means a destructor race.
   syscall(
       __NR_futex,
-      &state_,
+      word,
       FUTEX_WAKE | FUTEX_PRIVATE_FLAG,
       num,
       nullptr,
@@ -31,6 +31,12 @@ namespace rseq {
 namespace internal {
 namespace mutex {
 
+// Thin wrappers around the futex syscall, for the few places that block on
+// something other than a Mutex. Waiting returns immediately if *word != val,
+// and may also return spuriously; callers should recheck their condition.
+void futexWait(std::atomic<std::uint32_t>* word, std::uint32_t val);
+void futexWake(std::atomic<std::uint32_t>* word, int num);
+
 template <typename Lock>
 class LockGuard {
  public:
@@ -74,8 +80,12 @@ class Mutex {
   constexpr static std::uint32_t kHeldNoWaiter = 1;
   constexpr static std::uint32_t kHeldPossibleWaiter = 2;
 
-  void futexWait(std::uint32_t val);
-  void futexWake(int num);
+  void futexWait(std::uint32_t val) {
+    ::rseq::internal::mutex::futexWait(&state_, val);
+  }
+  void futexWake(int num) {
+    ::rseq::internal::mutex::futexWake(&state_, num);
+  }
 
   std::atomic<std::uint32_t> state_;
 };
@@ -0,0 +1,50 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#pragma once
+
+#include <new>
+
+#include "rseq/internal/CachelinePadded.h"
+#include "rseq/internal/OsMem.h"
+#include "rseq/internal/Topology.h"
+
+namespace rseq {
+namespace internal {
+
+// Like CpuLocal, but with one element per NUMA node.
+template <typename T>
+class NodeLocal {
+ public:
+  NodeLocal() {
+    void* mem = os_mem::allocate(sizeof(ElemType) * numNodes());
+    elements_ = static_cast<ElemType*>(mem);
+    for (int i = 0; i < numNodes(); ++i) {
+      new (&elements_[i]) ElemType;
+    }
+  }
+
+  ~NodeLocal() {
+    for (int i = 0; i < numNodes(); ++i) {
+      elements_[i].~ElemType();
+    }
+    os_mem::free(elements_, sizeof(ElemType) * numNodes());
+  }
+
+  T* forNode(int i) {
+    return elements_[i].get();
+  }
+
+ private:
+  typedef CachelinePadded<T> ElemType;
+  ElemType* elements_;
+};
+
+} // namespace internal
+} // namespace rseq
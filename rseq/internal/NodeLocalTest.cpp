@@ -0,0 +1,37 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#include "rseq/internal/NodeLocal.h"
+
+#include <cstdint>
+
+#include <gtest/gtest.h>
+
+#include "rseq/internal/Topology.h"
+
+using namespace rseq::internal;
+
+TEST(NodeLocal, DataIsPerNode) {
+  NodeLocal<int> data;
+  for (int i = 0; i < numNodes(); ++i) {
+    *data.forNode(i) = i;
+  }
+  for (int i = 0; i < numNodes(); ++i) {
+    EXPECT_EQ(i, *data.forNode(i));
+  }
+}
+
+TEST(NodeLocal, ElementsDontShareCachelines) {
+  NodeLocal<char> data;
+  for (int i = 1; i < numNodes(); ++i) {
+    std::uintptr_t prev = reinterpret_cast<std::uintptr_t>(data.forNode(i - 1));
+    std::uintptr_t cur = reinterpret_cast<std::uintptr_t>(data.forNode(i));
+    EXPECT_LE(kCachelineSize, cur - prev);
+  }
+}
@@ -9,11 +9,33 @@
 
 #include "rseq/internal/NumCpus.h"
 
+#include <unistd.h>
+
+#include "rseq/internal/CpuList.h"
+
 namespace rseq {
 namespace internal {
 
 namespace detail {
 mutex::OnceFlag numCpusOnceFlag;
+std::atomic<int> numCpusResult;
+
+int computeNumCpus() {
+  char buf[256];
+  if (readSysfsFile("/sys/devices/system/cpu/possible", buf, sizeof(buf))) {
+    int maxCpu = -1;
+    bool parsed = parseCpuList(buf, [&](int /* first */, int last) {
+      if (last > maxCpu) {
+        maxCpu = last;
+      }
+    });
+    if (parsed && maxCpu >= 0) {
+      return maxCpu + 1;
+    }
+  }
+  // Includes offline cpus, which is the best we can do without sysfs.
+  return sysconf(_SC_NPROCESSORS_CONF);
+}
 } // namespace detail
 
 } // namespace internal
@@ -9,8 +9,9 @@
 
 #pragma once
 
-#include <unistd.h>
+#include <atomic>
 
+#include "rseq/internal/Likely.h"
 #include "rseq/internal/Mutex.h"
 
 namespace rseq {
@@ -18,16 +19,28 @@ namespace internal {
 
 namespace detail {
 extern mutex::OnceFlag numCpusOnceFlag;
+extern std::atomic<int> numCpusResult;
+int computeNumCpus();
 } // namespace detail
 
-// std::thread::hardware_concurrency() is surprisingly slow. This just caches
-// the result.
+// One more than the largest cpu id the kernel could ever hand out (i.e. the
+// "possible" cpus, which include offline and not-yet-hotplugged ones), so that
+// anything indexed by the result of sched_getcpu() is sized correctly even when
+// some cpus are offline. Note that this can be much bigger than the number of
+// cpus this process is allowed to run on; see CompactCpus.h.
+// Finding this out is surprisingly slow, so we cache the result. It never
+// changes once set, so the fast path can get away with a relaxed load instead
+// of going through callOnce's acquire.
 inline int numCpus() {
-  static int result;
+  int result = detail::numCpusResult.load(std::memory_order_relaxed);
+  if (RSEQ_LIKELY(result != 0)) {
+    return result;
+  }
   mutex::callOnce(detail::numCpusOnceFlag, []() {
-    result = sysconf(_SC_NPROCESSORS_ONLN);
+    detail::numCpusResult.store(
+        detail::computeNumCpus(), std::memory_order_relaxed);
   });
-  return result;
+  return detail::numCpusResult.load(std::memory_order_relaxed);
 }
 
 } // namespace internal
@@ -8,6 +8,8 @@
  */
 
 #include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
 
 #include <cstdint>
 #include <stdexcept>
@@ -18,7 +20,8 @@ namespace rseq {
 namespace internal {
 namespace os_mem {
 
-static void* mmapWithPermissions(std::size_t bytes, int prot) {
+static void* mmapWithPermissions(
+    std::size_t bytes, int prot, int extraFlags = 0) {
   // If we die in this method, it'd be helpful to know the arguments; make sure
   // they're available in the debugger.
   volatile int bytesCopy = bytes;
@@ -28,7 +31,7 @@ static void* mmapWithPermissions(std::size_t bytes, int prot) {
     nullptr,
     bytes,
     prot,
-    MAP_PRIVATE | MAP_ANONYMOUS,
+    MAP_PRIVATE | MAP_ANONYMOUS | extraFlags,
     -1,
     0);
   if (alloc == MAP_FAILED) {
@@ -45,6 +48,21 @@ void* allocateExecutable(std::size_t bytes) {
   return mmapWithPermissions(bytes, PROT_READ | PROT_WRITE | PROT_EXEC);
 }
 
+void* reserve(std::size_t bytes) {
+  return mmapWithPermissions(bytes, PROT_READ | PROT_WRITE, MAP_NORESERVE);
+}
+
+void* tryAllocate(std::size_t bytes) {
+  void* alloc = mmap(
+    nullptr,
+    bytes,
+    PROT_READ | PROT_WRITE,
+    MAP_PRIVATE | MAP_ANONYMOUS,
+    -1,
+    0);
+  return alloc == MAP_FAILED ? nullptr : alloc;
+}
+
 void free(void* ptr, std::size_t bytes) {
   // Note that we may throw, even though this is on a deallocation path. So if
   // we get called with an invalid argument during exception unwinding, we'll
@@ -61,6 +79,29 @@ void free(void* ptr, std::size_t bytes) {
   }
 }
 
+bool isMapped(const void* ptr) {
+  const std::uintptr_t kPageSize = 4096;
+  std::uintptr_t ptrInt = reinterpret_cast<std::uintptr_t>(ptr);
+  void* page = reinterpret_cast<void*>(ptrInt & ~(kPageSize - 1));
+  // Fails with ENOMEM if the page isn't mapped.
+  unsigned char residency;
+  return mincore(page, 1, &residency) == 0;
+}
+
+void bindToNode(void* ptr, std::size_t bytes, int node) {
+  // From <numaif.h>, which we'd rather not depend on just for this.
+  const int kMpolPreferred = 1;
+  const int kMaxNodes = 1024;
+  const int kBitsPerLong = 8 * sizeof(unsigned long);
+  if (node < 0 || node >= kMaxNodes) {
+    return;
+  }
+  unsigned long nodeMask[kMaxNodes / kBitsPerLong] = {};
+  nodeMask[node / kBitsPerLong] = 1UL << (node % kBitsPerLong);
+  // The kernel ignores the last bit of the mask it's told about, hence the +1.
+  syscall(SYS_mbind, ptr, bytes, kMpolPreferred, nodeMask, kMaxNodes + 1, 0);
+}
+
 } // namespace os_mem
 } // namespace internal
 } // namespace rseq
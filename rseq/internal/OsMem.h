@@ -18,7 +18,22 @@ namespace os_mem {
 // Allocation functions throw a std::runtime_exception on failure.
 void* allocate(std::size_t bytes);
 void* allocateExecutable(std::size_t bytes);
+// Like allocate, but doesn't reserve swap space for the mapping; for large
+// regions that will be only sparsely touched.
+void* reserve(std::size_t bytes);
+// Like allocate, but returns nullptr instead of failing; for callers (like
+// malloc) that have their own way of reporting running out of memory.
+void* tryAllocate(std::size_t bytes);
 void free(void* ptr, std::size_t bytes);
+// Whether the page containing ptr is mapped. For sanity-checking pointers of
+// unknown origin before reading through them.
+bool isMapped(const void* ptr);
+
+// Asks that the pages in [ptr, ptr + bytes) be placed on the given NUMA node
+// when they're first touched. ptr must be page-aligned. Best-effort: on failure
+// (no NUMA support in the kernel, or the node has no memory), placement is left
+// up to the kernel's default policy.
+void bindToNode(void* ptr, std::size_t bytes, int node);
 
 
 } // namespace os_mem
@@ -140,3 +140,18 @@ TEST(OsMem, Frees) {
   // Go back to the previous signal handler (probably crashing).
   sigaction(SIGSEGV, &oldHandler, nullptr);
 }
+
+TEST(OsMem, BindsToNode) {
+  // There's no portable way to check where the pages ended up; we just make
+  // sure that binding (including to nodes that don't exist) leaves the memory
+  // usable.
+  const int kBytes = 4 * 4096;
+  char* mem = static_cast<char*>(allocate(kBytes));
+  bindToNode(mem, kBytes / 2, 0);
+  bindToNode(mem + kBytes / 2, kBytes / 2, 1000);
+  for (int i = 0; i < kBytes; ++i) {
+    EXPECT_EQ(0, mem[i]);
+    mem[i] = 1;
+  }
+  free(mem, kBytes);
+}
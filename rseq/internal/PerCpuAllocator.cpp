@@ -0,0 +1,225 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#include "rseq/internal/PerCpuAllocator.h"
+
+#include <cstdint>
+#include <cstring>
+
+#include "rseq/internal/Errors.h"
+#include "rseq/internal/Mutex.h"
+#include "rseq/internal/NumCpus.h"
+#include "rseq/internal/OsMem.h"
+#include "rseq/internal/rseq_c.h"
+
+extern "C" {
+
+char* rseq_percpu_base;
+unsigned long rseq_percpu_stride;
+
+} /* extern "C" */
+
+namespace rseq {
+namespace internal {
+namespace per_cpu_allocator {
+
+namespace {
+
+struct Range {
+  std::size_t offset;
+  std::size_t size;
+};
+
+} // namespace
+
+constexpr static std::size_t kPageSize = 4096;
+
+static mutex::Mutex mu;
+static bool initialized;
+// Free ranges, sorted by offset, never adjacent (we coalesce).
+static Range* freeRanges;
+static std::size_t numFreeRanges;
+static std::size_t freeRangesCapacity;
+// The size of the allocation starting at each granule (or 0). This is as big as
+// a chunk divided by kGranule / sizeof(uint32_t), which we reserve lazily.
+static std::uint32_t* sizeByGranule;
+
+static std::size_t roundUp(std::size_t n, std::size_t multiple) {
+  return (n + multiple - 1) & ~(multiple - 1);
+}
+
+static bool isZero(const char* begin, const char* end) {
+  char any = 0;
+  for (const char* p = begin; p != end; ++p) {
+    any |= *p;
+  }
+  return any == 0;
+}
+
+// Zeroes [begin, end), but only writes to the pages in it that hold something
+// nonzero. Reading a page that was never written maps the kernel's shared zero
+// page instead of committing memory, so the copies of cpus that never touched
+// the allocation stay uncommitted.
+static void zeroWrittenPages(char* begin, char* end) {
+  while (begin != end) {
+    char* pageEnd = reinterpret_cast<char*>(
+        roundUp(reinterpret_cast<std::uintptr_t>(begin) + 1, kPageSize));
+    if (pageEnd > end) {
+      pageEnd = end;
+    }
+    if (!isZero(begin, pageEnd)) {
+      std::memset(begin, 0, pageEnd - begin);
+    }
+    begin = pageEnd;
+  }
+}
+
+static void ensureInitializedLocked() {
+  if (initialized) {
+    return;
+  }
+  rseq_percpu_base = static_cast<char*>(
+      os_mem::reserve(kChunkSize * numCpus()));
+  rseq_percpu_stride = kChunkSize;
+  sizeByGranule = static_cast<std::uint32_t*>(
+      os_mem::reserve(kChunkSize / kGranule * sizeof(std::uint32_t)));
+  freeRangesCapacity = 4096 / sizeof(Range);
+  freeRanges = static_cast<Range*>(
+      os_mem::allocate(freeRangesCapacity * sizeof(Range)));
+  // Offset 0 is the null handle, so the first granule is never handed out.
+  freeRanges[0].offset = kGranule;
+  freeRanges[0].size = kChunkSize - kGranule;
+  numFreeRanges = 1;
+  initialized = true;
+}
+
+static void insertRangeLocked(std::size_t index, Range range) {
+  if (numFreeRanges == freeRangesCapacity) {
+    std::size_t newCapacity = 2 * freeRangesCapacity;
+    Range* newRanges = static_cast<Range*>(
+        os_mem::allocate(newCapacity * sizeof(Range)));
+    std::memcpy(newRanges, freeRanges, numFreeRanges * sizeof(Range));
+    os_mem::free(freeRanges, freeRangesCapacity * sizeof(Range));
+    freeRanges = newRanges;
+    freeRangesCapacity = newCapacity;
+  }
+  std::memmove(
+      &freeRanges[index + 1],
+      &freeRanges[index],
+      (numFreeRanges - index) * sizeof(Range));
+  freeRanges[index] = range;
+  ++numFreeRanges;
+}
+
+static void eraseRangeLocked(std::size_t index) {
+  std::memmove(
+      &freeRanges[index],
+      &freeRanges[index + 1],
+      (numFreeRanges - index - 1) * sizeof(Range));
+  --numFreeRanges;
+}
+
+std::size_t allocate(std::size_t size, std::size_t align) {
+  if (align == 0 || (align & (align - 1)) != 0 || align > kMaxAlign) {
+    errors::fatalError("Invalid per-cpu allocation alignment.\n");
+  }
+  if (size > kChunkSize) {
+    return 0;
+  }
+  size = roundUp(size == 0 ? 1 : size, kGranule);
+  if (align < kGranule) {
+    align = kGranule;
+  }
+
+  mutex::LockGuard<mutex::Mutex> lg(mu);
+  ensureInitializedLocked();
+  for (std::size_t i = 0; i < numFreeRanges; ++i) {
+    Range range = freeRanges[i];
+    std::size_t offset = roundUp(range.offset, align);
+    std::size_t rangeEnd = range.offset + range.size;
+    if (offset + size > rangeEnd) {
+      continue;
+    }
+    std::size_t prefix = offset - range.offset;
+    std::size_t suffix = rangeEnd - (offset + size);
+    if (prefix != 0) {
+      freeRanges[i].size = prefix;
+      if (suffix != 0) {
+        insertRangeLocked(i + 1, { offset + size, suffix });
+      }
+    } else if (suffix != 0) {
+      freeRanges[i].offset = offset + size;
+      freeRanges[i].size = suffix;
+    } else {
+      eraseRangeLocked(i);
+    }
+    sizeByGranule[offset / kGranule] = size;
+    return offset;
+  }
+  return 0;
+}
+
+void free(std::size_t offset) {
+  if (offset == 0) {
+    return;
+  }
+  std::size_t size;
+  {
+    mutex::LockGuard<mutex::Mutex> lg(mu);
+    if (!initialized || offset % kGranule != 0 || offset >= kChunkSize
+        || sizeByGranule[offset / kGranule] == 0) {
+      errors::fatalError("Invalid per-cpu allocation handle.\n");
+    }
+    size = sizeByGranule[offset / kGranule];
+    sizeByGranule[offset / kGranule] = 0;
+  }
+
+  // The range isn't on the free list yet, so we can do this without the lock.
+  for (int i = 0; i < numCpus(); ++i) {
+    char* begin = rseq_percpu_base + i * kChunkSize + offset;
+    zeroWrittenPages(begin, begin + size);
+  }
+
+  mutex::LockGuard<mutex::Mutex> lg(mu);
+  // The first range after the one we're freeing.
+  std::size_t lo = 0;
+  std::size_t hi = numFreeRanges;
+  while (lo < hi) {
+    std::size_t mid = lo + (hi - lo) / 2;
+    if (freeRanges[mid].offset < offset) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  std::size_t next = lo;
+  bool mergesWithPrev = next > 0
+      && freeRanges[next - 1].offset + freeRanges[next - 1].size == offset;
+  bool mergesWithNext = next < numFreeRanges
+      && offset + size == freeRanges[next].offset;
+  if (mergesWithPrev && mergesWithNext) {
+    freeRanges[next - 1].size += size + freeRanges[next].size;
+    eraseRangeLocked(next);
+  } else if (mergesWithPrev) {
+    freeRanges[next - 1].size += size;
+  } else if (mergesWithNext) {
+    freeRanges[next].offset = offset;
+    freeRanges[next].size += size;
+  } else {
+    insertRangeLocked(next, { offset, size });
+  }
+}
+
+char* base() {
+  return rseq_percpu_base;
+}
+
+} // namespace per_cpu_allocator
+} // namespace internal
+} // namespace rseq
@@ -0,0 +1,52 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#pragma once
+
+#include <cstddef>
+
+namespace rseq {
+namespace internal {
+namespace per_cpu_allocator {
+
+// A dense allocator for small per-cpu objects, in the style of the kernel's
+// alloc_percpu.
+//
+// We reserve (but don't commit) one big region of address space, carved into
+// numCpus() chunks of kChunkSize bytes each. An allocation is an offset into a
+// chunk, and is valid in every chunk at once: cpu N's copy of the object at
+// offset O lives at base() + N * kChunkSize + O. So objects of different sizes
+// pack together without per-object padding, and the only memory that gets
+// committed is the pages that objects (or their neighbors) actually touch.
+//
+// Offsets are managed by a single address-ordered, first-fit free list, with
+// coalescing on free. This is all slow-path stuff, protected by a mutex.
+// Memory is zero on allocation; we maintain that by zeroing on free, so that
+// allocating out of never-used space touches no memory at all. Freeing only
+// writes to the pages of each cpu's copy that hold nonzero data, so it doesn't
+// commit memory for cpus that never touched the allocation.
+
+constexpr std::size_t kChunkSize = 4 * 1024 * 1024;
+// Every allocation is aligned to (and its size rounded up to) this.
+constexpr std::size_t kGranule = 8;
+constexpr std::size_t kMaxAlign = 4096;
+
+// Returns 0 if there's no room left. align must be a power of two no larger
+// than kMaxAlign.
+std::size_t allocate(std::size_t size, std::size_t align);
+// offset must have come from allocate (or be 0, in which case this does
+// nothing). The caller must ensure no one is using any cpu's copy.
+void free(std::size_t offset);
+
+// Only valid once some allocation has succeeded.
+char* base();
+
+} // namespace per_cpu_allocator
+} // namespace internal
+} // namespace rseq
@@ -0,0 +1,132 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#include "rseq/internal/PerCpuAllocator.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <utility>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "rseq/internal/NumCpus.h"
+
+using namespace rseq::internal;
+using namespace rseq::internal::per_cpu_allocator;
+
+static char* forCpu(std::size_t offset, int cpu) {
+  return base() + cpu * kChunkSize + offset;
+}
+
+static bool isZero(std::size_t offset, std::size_t size) {
+  for (int cpu = 0; cpu < numCpus(); ++cpu) {
+    for (std::size_t i = 0; i < size; ++i) {
+      if (forCpu(offset, cpu)[i] != 0) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+TEST(PerCpuAllocator, AllocatesAlignedDisjointZeroedMemory) {
+  std::vector<std::pair<std::size_t, std::size_t>> allocs;
+  for (int i = 0; i < 1000; ++i) {
+    std::size_t size = 1 + (i * 37) % 200;
+    std::size_t align = std::size_t(1) << (i % 8);
+    std::size_t offset = allocate(size, align);
+    ASSERT_NE(0, offset);
+    EXPECT_EQ(0, offset % align);
+    EXPECT_TRUE(isZero(offset, size));
+    for (int cpu = 0; cpu < numCpus(); ++cpu) {
+      std::memset(forCpu(offset, cpu), 0xFF, size);
+    }
+    allocs.emplace_back(offset, size);
+  }
+
+  std::vector<std::pair<std::size_t, std::size_t>> sorted = allocs;
+  std::sort(sorted.begin(), sorted.end());
+  for (std::size_t i = 1; i < sorted.size(); ++i) {
+    EXPECT_LE(sorted[i - 1].first + sorted[i - 1].second, sorted[i].first);
+  }
+
+  // Freed memory comes back zeroed.
+  for (std::size_t i = 0; i < allocs.size(); i += 2) {
+    free(allocs[i].first);
+  }
+  for (std::size_t i = 0; i < allocs.size(); i += 2) {
+    std::size_t offset = allocate(allocs[i].second, 1);
+    ASSERT_NE(0, offset);
+    EXPECT_TRUE(isZero(offset, allocs[i].second));
+    allocs[i].first = offset;
+  }
+  for (std::size_t i = 0; i < allocs.size(); ++i) {
+    free(allocs[i].first);
+  }
+}
+
+// In kB, as the kernel reports it.
+static long residentAnonymousMemory() {
+  std::FILE* status = std::fopen("/proc/self/status", "r");
+  long result = -1;
+  char line[256];
+  while (status != nullptr && std::fgets(line, sizeof(line), status)) {
+    if (std::sscanf(line, "RssAnon: %ld", &result) == 1) {
+      break;
+    }
+  }
+  if (status != nullptr) {
+    std::fclose(status);
+  }
+  return result;
+}
+
+TEST(PerCpuAllocator, FreeLeavesUntouchedCopiesUncommitted) {
+  const std::size_t kBytes = 1024 * 1024;
+  std::size_t offset = allocate(kBytes, kMaxAlign);
+  ASSERT_NE(0, offset);
+  // Only cpu 0's copy gets written (and so committed).
+  std::memset(forCpu(offset, 0), 0xFF, kBytes);
+  long before = residentAnonymousMemory();
+  free(offset);
+  long after = residentAnonymousMemory();
+  ASSERT_LE(0, before);
+  // Zeroing every copy would commit a megabyte per other cpu.
+  EXPECT_GT(before + 512, after);
+  EXPECT_TRUE(isZero(offset, kBytes));
+}
+
+TEST(PerCpuAllocator, CoalescesFreedRanges) {
+  std::size_t first = allocate(64, 64);
+  std::size_t second = allocate(64, 64);
+  std::size_t third = allocate(64, 64);
+  ASSERT_EQ(first + 64, second);
+  ASSERT_EQ(second + 64, third);
+
+  // Free out of order; the three ranges (and whatever follows) should merge
+  // back into one.
+  free(first);
+  free(third);
+  free(second);
+  EXPECT_EQ(first, allocate(192, 64));
+  free(first);
+}
+
+TEST(PerCpuAllocator, RunsOutOfSpace) {
+  EXPECT_EQ(0, allocate(kChunkSize, 8));
+  std::size_t big = allocate(kChunkSize / 2, kMaxAlign);
+  ASSERT_NE(0, big);
+  EXPECT_EQ(0, allocate(kChunkSize / 2, kMaxAlign));
+  free(big);
+  big = allocate(kChunkSize / 2, kMaxAlign);
+  EXPECT_NE(0, big);
+  free(big);
+}
@@ -0,0 +1,496 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#include "rseq/internal/PerCpuMalloc.h"
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <new>
+
+#include <pthread.h>
+
+#include "rseq/Rseq.h"
+#include "rseq/internal/CachelinePadded.h"
+#include "rseq/internal/CpuLocal.h"
+#include "rseq/internal/Errors.h"
+#include "rseq/internal/Likely.h"
+#include "rseq/internal/Mutex.h"
+#include "rseq/internal/OsMem.h"
+#include "rseq/internal/Rseq.h"
+
+namespace rseq {
+namespace internal {
+namespace per_cpu_malloc {
+
+namespace {
+
+// What a free small object looks like. The smallest size class is big enough
+// to hold one.
+struct FreeObject {
+  rseq::Value<FreeObject*> next;
+  // The number of objects in the list starting at this one.
+  rseq::Value<std::uint64_t> depth;
+};
+
+struct CpuCache {
+  rseq::Value<FreeObject*> heads[kNumSizeClasses];
+};
+
+struct alignas(kCachelineSize) CentralList {
+  mutex::Mutex mu;
+  FreeObject* head;
+  // The never-allocated tail end of the size class's region.
+  char* bumpNext;
+  char* bumpEnd;
+};
+
+struct LargeHeader {
+  void* mapping;
+  std::size_t mappingBytes;
+  // See largeCheck() below.
+  std::uintptr_t check;
+};
+
+} // namespace
+
+constexpr std::size_t kRegionSize = std::size_t(1) << 30;
+constexpr std::size_t kPageSize = 4096;
+constexpr std::size_t kMinAlignment = 16;
+// A per-cpu list holds at most this many bytes' worth of objects, or
+// kMinCachedObjects objects if that's more.
+constexpr std::size_t kCachedBytesPerClass = 64 * 1024;
+constexpr std::uint64_t kMinCachedObjects = 4;
+
+static mutex::OnceFlag initOnceFlag;
+static char* regionsBase;
+static std::uint64_t maxCachedByClass[kNumSizeClasses];
+static CentralList centralLists[kNumSizeClasses];
+// Set last during initialization, so that it doubles as the "initialized"
+// check on fast paths. Like Rseq.cpp's globals, never destroyed: threads may
+// free memory arbitrarily late in process shutdown.
+static std::atomic<CpuLocal<CpuCache>*> cpuCaches;
+static char cpuCachesStorage alignas(CpuLocal<CpuCache>) [
+    sizeof(CpuLocal<CpuCache>)];
+
+// Set while this thread is in rseq's own slow path, which may allocate (e.g.
+// glibc's pthread_setspecific can). Allocations made then bypass the per-cpu
+// lists.
+static __thread bool inRseqSlowPath;
+
+static std::size_t roundUp(std::size_t n, std::size_t multiple) {
+  return (n + multiple - 1) & ~(multiple - 1);
+}
+
+int sizeClassForSize(std::size_t size) {
+  // Multiples of 16 up to 128, then four classes per doubling.
+  if (size <= 128) {
+    return size == 0 ? 0 : static_cast<int>((size - 1) / 16);
+  }
+  std::size_t n = size - 1;
+  int log = 63 - __builtin_clzl(n);
+  return 8 + (log - 7) * 4 + static_cast<int>((n >> (log - 2)) & 3);
+}
+
+std::size_t sizeForSizeClass(int sizeClass) {
+  if (sizeClass < 8) {
+    return 16 * (sizeClass + 1);
+  }
+  int k = sizeClass - 8;
+  return static_cast<std::size_t>(5 + k % 4) << (5 + k / 4);
+}
+
+int sizeClassForPtr(void* ptr) {
+  std::uintptr_t offset = reinterpret_cast<std::uintptr_t>(ptr)
+      - reinterpret_cast<std::uintptr_t>(regionsBase);
+  if (regionsBase == nullptr || offset >= kNumSizeClasses * kRegionSize) {
+    return -1;
+  }
+  return static_cast<int>(offset / kRegionSize);
+}
+
+// A fork() while another thread holds a central list's lock would leave the
+// child's copy of it held forever, so we hold all of them across the fork.
+// Nothing ever takes two at once, so any order will do.
+static void lockCentralListsForFork() {
+  for (int i = 0; i < kNumSizeClasses; ++i) {
+    centralLists[i].mu.lock();
+  }
+}
+
+static void unlockCentralListsAfterFork() {
+  for (int i = 0; i < kNumSizeClasses; ++i) {
+    centralLists[i].mu.unlock();
+  }
+}
+
+static void reinitCentralListsInForkChild() {
+  // No one else in the child can be waiting on them.
+  for (int i = 0; i < kNumSizeClasses; ++i) {
+    centralLists[i].mu.init();
+  }
+}
+
+static CpuLocal<CpuCache>* caches() {
+  CpuLocal<CpuCache>* result = cpuCaches.load(std::memory_order_acquire);
+  if (RSEQ_LIKELY(result != nullptr)) {
+    return result;
+  }
+  mutex::callOnce(initOnceFlag, []() {
+    errors::AbortOnError aoe;
+    regionsBase = static_cast<char*>(
+        os_mem::reserve(kNumSizeClasses * kRegionSize));
+    for (int i = 0; i < kNumSizeClasses; ++i) {
+      centralLists[i].bumpNext = regionsBase + i * kRegionSize;
+      centralLists[i].bumpEnd = regionsBase + (i + 1) * kRegionSize;
+      std::uint64_t maxCached = kCachedBytesPerClass / sizeForSizeClass(i);
+      maxCachedByClass[i] =
+          maxCached < kMinCachedObjects ? kMinCachedObjects : maxCached;
+    }
+    if (pthread_atfork(
+            lockCentralListsForFork,
+            unlockCentralListsAfterFork,
+            reinitCentralListsInForkChild) != 0) {
+      errors::fatalError("per_cpu_malloc: pthread_atfork failed\n");
+    }
+    cpuCaches.store(
+        new (cpuCachesStorage) CpuLocal<CpuCache>, std::memory_order_release);
+  });
+  return cpuCaches.load(std::memory_order_acquire);
+}
+
+static CpuCache* beginCpuCache() {
+  int shard = threadCachedCpu()->load();
+  if (RSEQ_UNLIKELY(shard < 0)) {
+    errors::AbortOnError aoe;
+    inRseqSlowPath = true;
+    shard = beginSlowPath();
+    inRseqSlowPath = false;
+  }
+  return caches()->forCpu(shard);
+}
+
+// Takes up to count objects from the central list, as a nullptr-terminated
+// chain from *head to *tail. Returns how many it took; 0 means the class's
+// region is used up.
+static std::uint64_t takeFromCentral(
+    int sizeClass, std::uint64_t count, FreeObject** head, FreeObject** tail) {
+  CentralList& list = centralLists[sizeClass];
+  std::size_t size = sizeForSizeClass(sizeClass);
+  FreeObject* first = nullptr;
+  FreeObject* last = nullptr;
+  std::uint64_t taken = 0;
+  mutex::LockGuard<mutex::Mutex> lg(list.mu);
+  while (taken < count) {
+    FreeObject* obj = list.head;
+    if (obj != nullptr) {
+      list.head = obj->next.load(std::memory_order_relaxed);
+    } else if (list.bumpNext + size <= list.bumpEnd) {
+      obj = reinterpret_cast<FreeObject*>(list.bumpNext);
+      list.bumpNext += size;
+    } else {
+      break;
+    }
+    if (last == nullptr) {
+      first = obj;
+    } else {
+      last->next.store(obj, std::memory_order_relaxed);
+    }
+    last = obj;
+    ++taken;
+  }
+  if (last != nullptr) {
+    last->next.store(nullptr, std::memory_order_relaxed);
+  }
+  *head = first;
+  *tail = last;
+  return taken;
+}
+
+static void giveToCentral(int sizeClass, FreeObject* head, FreeObject* tail) {
+  CentralList& list = centralLists[sizeClass];
+  mutex::LockGuard<mutex::Mutex> lg(list.mu);
+  tail->next.store(list.head, std::memory_order_relaxed);
+  list.head = head;
+}
+
+// Moves about half of the local list for the class to the central list.
+static void flushLocal(int sizeClass) {
+  std::uint64_t count = maxCachedByClass[sizeClass] / 2;
+  FreeObject* head;
+  FreeObject* tail;
+  while (true) {
+    rseq::Value<FreeObject*>* top = &beginCpuCache()->heads[sizeClass];
+    head = top->load();
+    if (head == nullptr) {
+      return;
+    }
+    tail = head;
+    FreeObject* rest = nullptr;
+    bool success = rseq::load(&rest, &tail->next);
+    for (std::uint64_t i = 1; i < count && success && rest != nullptr; ++i) {
+      tail = rest;
+      success = rseq::load(&rest, &tail->next);
+    }
+    // The objects from rest down keep their depths, which are still right.
+    if (success && rseq::store(top, rest)) {
+      break;
+    }
+  }
+  giveToCentral(sizeClass, head, tail);
+}
+
+// Pushes a chain of count objects onto the local list, or onto the central one
+// if the local list has no room.
+static void pushLocal(
+    int sizeClass, FreeObject* head, FreeObject* tail, std::uint64_t count) {
+  while (true) {
+    rseq::Value<FreeObject*>* top = &beginCpuCache()->heads[sizeClass];
+    FreeObject* oldHead = top->load();
+    std::uint64_t depth = 0;
+    if (oldHead != nullptr && !rseq::load(&depth, &oldHead->depth)) {
+      continue;
+    }
+    if (depth + count > maxCachedByClass[sizeClass]) {
+      giveToCentral(sizeClass, head, tail);
+      return;
+    }
+    depth += count;
+    for (FreeObject* obj = head; obj != tail;
+        obj = obj->next.load(std::memory_order_relaxed)) {
+      obj->depth.store(depth--, std::memory_order_relaxed);
+    }
+    tail->depth.store(depth, std::memory_order_relaxed);
+    tail->next.store(oldHead, std::memory_order_relaxed);
+    if (rseq::store(top, head)) {
+      return;
+    }
+  }
+}
+
+// The local list was empty; get a batch from the central list, keep one for
+// the caller and stash the rest locally.
+static void* refillLocal(int sizeClass) {
+  std::uint64_t count =
+      inRseqSlowPath ? 1 : maxCachedByClass[sizeClass] / 2;
+  FreeObject* head;
+  FreeObject* tail;
+  count = takeFromCentral(sizeClass, count, &head, &tail);
+  if (count == 0) {
+    return nullptr;
+  }
+  if (count > 1) {
+    pushLocal(
+        sizeClass, head->next.load(std::memory_order_relaxed), tail, count - 1);
+  }
+  return head;
+}
+
+static void* allocateSmall(int sizeClass) {
+  while (RSEQ_LIKELY(!inRseqSlowPath)) {
+    rseq::Value<FreeObject*>* top = &beginCpuCache()->heads[sizeClass];
+    FreeObject* head = top->load();
+    if (head == nullptr) {
+      break;
+    }
+    FreeObject* next;
+    if (!rseq::load(&next, &head->next)) {
+      continue;
+    }
+    if (rseq::store(top, next)) {
+      return head;
+    }
+  }
+  return refillLocal(sizeClass);
+}
+
+static void deallocateSmall(void* ptr, int sizeClass) {
+  FreeObject* obj = static_cast<FreeObject*>(ptr);
+  if (RSEQ_UNLIKELY(inRseqSlowPath)) {
+    giveToCentral(sizeClass, obj, obj);
+    return;
+  }
+  while (true) {
+    rseq::Value<FreeObject*>* top = &beginCpuCache()->heads[sizeClass];
+    FreeObject* head = top->load();
+    std::uint64_t depth = 0;
+    if (head != nullptr && !rseq::load(&depth, &head->depth)) {
+      continue;
+    }
+    if (depth >= maxCachedByClass[sizeClass]) {
+      flushLocal(sizeClass);
+      continue;
+    }
+    obj->next.store(head, std::memory_order_relaxed);
+    obj->depth.store(depth + 1, std::memory_order_relaxed);
+    if (rseq::store(top, obj)) {
+      return;
+    }
+  }
+}
+
+static LargeHeader* largeHeader(void* ptr) {
+  return static_cast<LargeHeader*>(ptr) - 1;
+}
+
+// Stored in each large object's header, so that we can tell our large objects
+// from pointers we never handed out: memory allocated before we were loaded,
+// or by some other allocator (say, via a memalign-style entry point we don't
+// override).
+static std::uintptr_t largeCheck(void* ptr, LargeHeader* header) {
+  const std::uintptr_t kLargeMagic = 0x72736571206d616cULL;
+  return reinterpret_cast<std::uintptr_t>(ptr)
+      ^ reinterpret_cast<std::uintptr_t>(header->mapping)
+      ^ header->mappingBytes ^ kLargeMagic;
+}
+
+// Returns nullptr if ptr (which isn't in any size class's region) isn't one of
+// our large objects.
+static LargeHeader* findLargeHeader(void* ptr) {
+  std::uintptr_t ptrInt = reinterpret_cast<std::uintptr_t>(ptr);
+  if (ptrInt % kMinAlignment != 0 || ptrInt < kPageSize) {
+    return nullptr;
+  }
+  LargeHeader* header = largeHeader(ptr);
+  // The header of a foreign pointer may not be readable (and neither is ours
+  // after a double free). This costs a syscall, but so does the munmap() that
+  // freeing a large object ends in.
+  if (!os_mem::isMapped(header) || header->check != largeCheck(ptr, header)) {
+    return nullptr;
+  }
+  return header;
+}
+
+static LargeHeader* checkedLargeHeader(void* ptr) {
+  LargeHeader* header = findLargeHeader(ptr);
+  if (RSEQ_UNLIKELY(header == nullptr)) {
+    errors::AbortOnError aoe;
+    errors::fatalError("per_cpu_malloc: pointer not from this allocator\n");
+  }
+  return header;
+}
+
+static void* allocateLarge(std::size_t size, std::size_t alignment) {
+  if (alignment < kMinAlignment) {
+    alignment = kMinAlignment;
+  }
+  std::size_t overhead = sizeof(LargeHeader) + alignment + kPageSize;
+  if (size > SIZE_MAX - overhead) {
+    return nullptr;
+  }
+  std::size_t bytes =
+      roundUp(size + sizeof(LargeHeader) + alignment, kPageSize);
+  char* mapping = static_cast<char*>(os_mem::tryAllocate(bytes));
+  if (mapping == nullptr) {
+    return nullptr;
+  }
+  void* result = reinterpret_cast<void*>(roundUp(
+      reinterpret_cast<std::uintptr_t>(mapping) + sizeof(LargeHeader),
+      alignment));
+  LargeHeader* header = largeHeader(result);
+  header->mapping = mapping;
+  header->mappingBytes = bytes;
+  header->check = largeCheck(result, header);
+  return result;
+}
+
+void* allocate(std::size_t size) {
+  if (size <= kMaxSmallSize) {
+    caches();
+    void* result = allocateSmall(sizeClassForSize(size));
+    if (RSEQ_LIKELY(result != nullptr)) {
+      return result;
+    }
+  }
+  return allocateLarge(size, kMinAlignment);
+}
+
+void* allocateAligned(std::size_t alignment, std::size_t size) {
+  if (alignment <= kMinAlignment) {
+    return allocate(size);
+  }
+  // Objects in a size class are aligned to the largest power of two (up to a
+  // page) dividing the class size, so we look for a class that's a multiple of
+  // the alignment.
+  if (alignment <= kPageSize && size <= kMaxSmallSize) {
+    caches();
+    int sizeClass = sizeClassForSize(size < alignment ? alignment : size);
+    for (; sizeClass < kNumSizeClasses; ++sizeClass) {
+      if (sizeForSizeClass(sizeClass) % alignment == 0) {
+        void* result = allocateSmall(sizeClass);
+        if (result != nullptr) {
+          return result;
+        }
+        break;
+      }
+    }
+  }
+  return allocateLarge(size, alignment);
+}
+
+void* reallocate(void* ptr, std::size_t size) {
+  if (ptr == nullptr) {
+    return allocate(size);
+  }
+  if (size == 0) {
+    deallocate(ptr);
+    return nullptr;
+  }
+  std::size_t oldSize = usableSize(ptr);
+  int sizeClass = sizeClassForPtr(ptr);
+  if (sizeClass >= 0) {
+    if (size <= kMaxSmallSize && sizeClassForSize(size) == sizeClass) {
+      return ptr;
+    }
+  } else if (size <= oldSize && size > oldSize / 2) {
+    return ptr;
+  }
+  void* result = allocate(size);
+  if (result == nullptr) {
+    return nullptr;
+  }
+  std::memcpy(result, ptr, size < oldSize ? size : oldSize);
+  deallocate(ptr);
+  return result;
+}
+
+void deallocate(void* ptr) {
+  if (ptr == nullptr) {
+    return;
+  }
+  int sizeClass = sizeClassForPtr(ptr);
+  if (RSEQ_LIKELY(sizeClass >= 0)) {
+    deallocateSmall(ptr, sizeClass);
+    return;
+  }
+  LargeHeader* header = findLargeHeader(ptr);
+  if (RSEQ_UNLIKELY(header == nullptr)) {
+    // Not ours, so there's no one we could give it back to; leak it.
+    return;
+  }
+  errors::AbortOnError aoe;
+  os_mem::free(header->mapping, header->mappingBytes);
+}
+
+std::size_t usableSize(void* ptr) {
+  if (ptr == nullptr) {
+    return 0;
+  }
+  int sizeClass = sizeClassForPtr(ptr);
+  if (sizeClass >= 0) {
+    return sizeForSizeClass(sizeClass);
+  }
+  LargeHeader* header = checkedLargeHeader(ptr);
+  return static_cast<char*>(header->mapping) + header->mappingBytes
+      - static_cast<char*>(ptr);
+}
+
+} // namespace per_cpu_malloc
+} // namespace internal
+} // namespace rseq
@@ -0,0 +1,63 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#pragma once
+
+#include <cstddef>
+
+namespace rseq {
+namespace internal {
+namespace per_cpu_malloc {
+
+// The malloc sketched out in Rseq.md's usage example, fleshed out enough to
+// stand in for the system one (librseq_malloc.so overrides malloc and friends
+// with these, for use with LD_PRELOAD).
+//
+// Small sizes are rounded up to one of kNumSizeClasses size classes. Each class
+// gets its own region of address space, reserved up front; objects are carved
+// off the start of it, so the class of a pointer is a subtraction and a shift
+// away. Freed objects go onto a per-cpu free list for their class, which is a
+// linked stack threaded through the objects themselves; allocation and free
+// are an rseq load and an rseq store on the stack head when they hit it. Each
+// free object also records how many objects are below it on the stack, which
+// lets us bound the per-cpu lists without a separate count that would need a
+// second store to keep in sync. Lists that grow past their bound give half
+// their objects to a mutex-protected central list for the class; empty ones
+// take a batch from it. The central locks are all held across fork(), so a
+// child never inherits one that some other thread had.
+//
+// So cached memory is proportional to the number of cpus, not threads, which
+// is the point. We never give small-object memory back to the OS, though.
+//
+// Bigger objects (and small ones whose region is exhausted) get their own
+// mapping.
+
+constexpr int kNumSizeClasses = 40;
+constexpr std::size_t kMaxSmallSize = 32 * 1024;
+
+// Returns nullptr on failure.
+void* allocate(std::size_t size);
+// alignment must be a power of two.
+void* allocateAligned(std::size_t alignment, std::size_t size);
+// reallocate() and usableSize() die on pointers that didn't come from us;
+// deallocate() leaks them (it may get memory allocated before we were loaded).
+void* reallocate(void* ptr, std::size_t size);
+// ptr may be nullptr.
+void deallocate(void* ptr);
+std::size_t usableSize(void* ptr);
+
+// Exposed for testing.
+int sizeClassForSize(std::size_t size);
+std::size_t sizeForSizeClass(int sizeClass);
+// Returns -1 for pointers not in any size class's region.
+int sizeClassForPtr(void* ptr);
+
+} // namespace per_cpu_malloc
+} // namespace internal
+} // namespace rseq
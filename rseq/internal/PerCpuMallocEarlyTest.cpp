@@ -0,0 +1,23 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#include <stdlib.h>
+
+#include <cstring>
+
+#include <gtest/gtest.h>
+
+// Set by MallocFromConstructor.cpp's constructor, which ran before main().
+extern "C" char* mallocFromConstructorResult;
+
+TEST(PerCpuMallocEarly, AllocatesBeforeStaticInitializers) {
+  ASSERT_NE(nullptr, mallocFromConstructorResult);
+  EXPECT_STREQ("allocated", mallocFromConstructorResult);
+  free(mallocFromConstructorResult);
+}
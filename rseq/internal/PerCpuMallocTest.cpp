@@ -0,0 +1,197 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#include "rseq/internal/PerCpuMalloc.h"
+
+#include <cstdint>
+#include <atomic>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <gtest/gtest.h>
+
+#include "rseq/internal/NumCpus.h"
+#include "rseq/internal/OsMem.h"
+#include "rseq/internal/SwitchToCpu.h"
+
+using namespace rseq::internal;
+using namespace rseq::internal::per_cpu_malloc;
+
+TEST(PerCpuMalloc, SizeClasses) {
+  EXPECT_EQ(16, sizeForSizeClass(0));
+  EXPECT_EQ(kMaxSmallSize, sizeForSizeClass(kNumSizeClasses - 1));
+  for (int i = 1; i < kNumSizeClasses; ++i) {
+    EXPECT_LT(sizeForSizeClass(i - 1), sizeForSizeClass(i));
+  }
+  for (std::size_t size = 0; size <= kMaxSmallSize; ++size) {
+    int sizeClass = sizeClassForSize(size);
+    ASSERT_LE(size, sizeForSizeClass(sizeClass));
+    if (sizeClass > 0) {
+      ASSERT_GT(size, sizeForSizeClass(sizeClass - 1));
+    }
+  }
+}
+
+TEST(PerCpuMalloc, AllocatesDisjointMemory) {
+  std::vector<std::pair<unsigned char*, std::size_t>> allocs;
+  for (int i = 0; i < 10000; ++i) {
+    std::size_t size = (i * 7919) % (2 * kMaxSmallSize);
+    unsigned char* ptr = static_cast<unsigned char*>(allocate(size));
+    ASSERT_NE(nullptr, ptr);
+    EXPECT_EQ(0, reinterpret_cast<std::uintptr_t>(ptr) % 16);
+    EXPECT_LE(size, usableSize(ptr));
+    EXPECT_EQ(size <= kMaxSmallSize, sizeClassForPtr(ptr) >= 0);
+    std::memset(ptr, i % 256, size);
+    allocs.emplace_back(ptr, size);
+  }
+  for (std::size_t i = 0; i < allocs.size(); ++i) {
+    for (std::size_t j = 0; j < allocs[i].second; ++j) {
+      ASSERT_EQ(i % 256, allocs[i].first[j]);
+    }
+    deallocate(allocs[i].first);
+  }
+}
+
+TEST(PerCpuMalloc, AllocatesAligned) {
+  for (std::size_t alignment = 1; alignment <= 64 * 1024; alignment *= 2) {
+    for (std::size_t size : {1, 100, 5000, 100000}) {
+      void* ptr = allocateAligned(alignment, size);
+      ASSERT_NE(nullptr, ptr);
+      EXPECT_EQ(0, reinterpret_cast<std::uintptr_t>(ptr) % alignment);
+      EXPECT_LE(size, usableSize(ptr));
+      std::memset(ptr, 0, size);
+      deallocate(ptr);
+    }
+  }
+}
+
+TEST(PerCpuMalloc, LeaksForeignPointers) {
+  // Page-aligned, so the would-be header is on an unmapped page.
+  char* page = static_cast<char*>(os_mem::allocate(2 * 4096));
+  os_mem::free(page, 4096);
+  char* foreign[] = {page + 4096, page + 4096 + 64};
+  for (char* ptr : foreign) {
+    std::memset(ptr, 'x', 16);
+    deallocate(ptr);
+    EXPECT_EQ('x', ptr[15]);
+  }
+  alignas(16) char local[64];
+  std::memset(local, 'y', sizeof(local));
+  deallocate(local + 32);
+  EXPECT_EQ('y', local[0]);
+  os_mem::free(page + 4096, 4096);
+}
+
+TEST(PerCpuMalloc, Reallocates) {
+  char* ptr = static_cast<char*>(reallocate(nullptr, 10));
+  ASSERT_NE(nullptr, ptr);
+  std::strcpy(ptr, "rseq");
+  for (std::size_t size = 10; size < 1000000; size *= 3) {
+    ptr = static_cast<char*>(reallocate(ptr, size));
+    ASSERT_NE(nullptr, ptr);
+    EXPECT_STREQ("rseq", ptr);
+  }
+  ptr = static_cast<char*>(reallocate(ptr, 5));
+  EXPECT_STREQ("rseq", ptr);
+  EXPECT_EQ(nullptr, reallocate(ptr, 0));
+}
+
+TEST(PerCpuMalloc, ReusesFreedMemory) {
+  switchToCpu(0);
+  void* ptr = allocate(100);
+  deallocate(ptr);
+  // Nothing else is running on this cpu, so we get the same object back.
+  EXPECT_EQ(ptr, allocate(100));
+  deallocate(ptr);
+}
+
+TEST(PerCpuMalloc, ConcurrentAllocations) {
+  const int kNumThreads = 4 * numCpus();
+  const int kIterations = 100000;
+  const int kLiveObjects = 100;
+  std::vector<std::thread> threads(kNumThreads);
+  for (int i = 0; i < kNumThreads; ++i) {
+    threads[i] = std::thread([i]() {
+      switchToCpu(i % numCpus());
+      std::vector<std::uint64_t*> live(kLiveObjects);
+      for (int j = 0; j < kIterations; ++j) {
+        std::uint64_t*& slot = live[j % kLiveObjects];
+        if (slot != nullptr) {
+          // If anyone else got handed our object, this would be clobbered.
+          ASSERT_EQ(static_cast<std::uint64_t>(i), slot[0]);
+          ASSERT_EQ(static_cast<std::uint64_t>(j - kLiveObjects), slot[1]);
+          deallocate(slot);
+        }
+        slot = static_cast<std::uint64_t*>(allocate(16 + (j % 7) * 48));
+        ASSERT_NE(nullptr, slot);
+        slot[0] = i;
+        slot[1] = j;
+      }
+      for (std::uint64_t* ptr : live) {
+        deallocate(ptr);
+      }
+    });
+  }
+  for (int i = 0; i < kNumThreads; ++i) {
+    threads[i].join();
+  }
+}
+
+TEST(PerCpuMalloc, ForksWhileOtherThreadsAllocate) {
+  std::atomic<bool> done(false);
+  std::vector<std::thread> threads;
+  for (int i = 0; i < numCpus(); ++i) {
+    threads.emplace_back([&done]() {
+      // The largest class caches only a few objects per cpu, so this is in
+      // and out of the central lists all the time.
+      std::vector<void*> batch(16);
+      while (!done.load()) {
+        for (void*& ptr : batch) {
+          ptr = allocate(kMaxSmallSize);
+        }
+        for (void* ptr : batch) {
+          deallocate(ptr);
+        }
+      }
+    });
+  }
+  for (int i = 0; i < 200; ++i) {
+    pid_t pid = fork();
+    ASSERT_LE(0, pid);
+    if (pid == 0) {
+      // A lock held by some other thread at the fork would hang us here.
+      std::vector<void*> batch(16);
+      for (int sizeClass = 0; sizeClass < kNumSizeClasses; ++sizeClass) {
+        for (void*& ptr : batch) {
+          ptr = allocate(sizeForSizeClass(sizeClass));
+          if (ptr == nullptr) {
+            _exit(1);
+          }
+        }
+        for (void* ptr : batch) {
+          deallocate(ptr);
+        }
+      }
+      _exit(0);
+    }
+    int status;
+    ASSERT_EQ(pid, waitpid(pid, &status, 0));
+    ASSERT_TRUE(WIFEXITED(status));
+    ASSERT_EQ(0, WEXITSTATUS(status));
+  }
+  done.store(true);
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+}
@@ -17,15 +17,21 @@
 #include "rseq/internal/AsymmetricThreadFence.h"
 #include "rseq/internal/Code.h"
 #include "rseq/internal/CleanUpOnThreadDeath.h"
+#include "rseq/internal/CompactCpus.h"
 #include "rseq/internal/CpuLocal.h"
 #include "rseq/internal/Mutex.h"
 #include "rseq/internal/NumCpus.h"
+#include "rseq/internal/ShardMode.h"
 #include "rseq/internal/ThreadControl.h"
 
 namespace rseq {
 namespace internal {
 
+// The cpu we were on the last time we acquired a shard.
 static __thread int lastCpu;
+// The shard we last acquired. Equal to lastCpu, unless we're handing out
+// concurrency ids.
+static __thread int lastShard;
 
 static __thread ThreadControl* me;
 
@@ -72,61 +78,165 @@ static CpuLocal<AtomicOwnerAndEvictor>* ownerAndEvictor;
 static char ownerAndEvictorStorage alignas(CpuLocal<AtomicOwnerAndEvictor>) [
     sizeof(*ownerAndEvictor)];
 
-static int acquireCpuOwnership() {
-  while (true) {
-    lastCpu = sched_getcpu();
-    threadCachedCpu()->store(lastCpu, std::memory_order_relaxed);
-
-    OwnerAndEvictor curOwnerAndEvictor
-      = ownerAndEvictor->forCpu(lastCpu)->load();
-    if (curOwnerAndEvictor.ownerId == 0) {
-      if (ownerAndEvictor->forCpu(lastCpu)->cas(
-            curOwnerAndEvictor, { me->id(), 0 } )) {
-        return lastCpu;
-      } else {
-        continue;
-      }
-    }
+// Set (once, under ownerAndEvictorOnceFlag) from the shard mode, which the
+// first thread to initialize its rseq state latches if nothing has already;
+// see ShardMode.h.
+static bool usingConcurrencyIds;
+
+// In concurrency id mode, the owner table is indexed by id rather than by cpu.
+// Ids are exclusive for the same reason cpus are: a thread has to win the
+// owner CAS for an id to use it. Which id a thread *asks* for is just a
+// heuristic: each cpu remembers the id last acquired on it, and each id the cpu
+// that last acquired it. A thread asks for its cpu's id (evicting whichever
+// thread had it, which has probably been descheduled in our favor), unless
+// that id has since moved to some other cpu, in which case it asks for the
+// lowest id not in use on another cpu. So the ids in use stay bounded by the
+// number of threads running rseqs at once, rather than by the number of cpus
+// the scheduler happened to spread them over.
+// Both tables store their values plus one, so that zero means "none".
+static CpuLocal<std::atomic<int>>* concurrencyIdForCpu;
+static CpuLocal<std::atomic<int>>* cpuForConcurrencyId;
+static char concurrencyIdForCpuStorage
+    alignas(CpuLocal<std::atomic<int>>) [sizeof(*concurrencyIdForCpu)];
+static char cpuForConcurrencyIdStorage
+    alignas(CpuLocal<std::atomic<int>>) [sizeof(*cpuForConcurrencyId)];
+// One more than the largest id ever handed out. fence() walks ids below this.
+static std::atomic<int> concurrencyIdHighWater;
+
+static int hintedConcurrencyId(int cpu) {
+  return concurrencyIdForCpu->forCpu(cpu)->load(std::memory_order_relaxed) - 1;
+}
 
-    me->accessing()->store(
-        curOwnerAndEvictor.ownerId, std::memory_order_relaxed);
-    if (!ownerAndEvictor->forCpu(lastCpu)->cas(
-          curOwnerAndEvictor, { curOwnerAndEvictor.ownerId, me->id() })) {
-      me->accessing()->store(0, std::memory_order_relaxed);
-      continue;
-    }
-    // The CAS succeeded, so we installed ourself as the evictor.
-    curOwnerAndEvictor.evictorId = me->id();
+static int hintedCpu(int id) {
+  return cpuForConcurrencyId->forCpu(id)->load(std::memory_order_relaxed) - 1;
+}
 
-    ThreadControl* victim = ThreadControl::forId(curOwnerAndEvictor.ownerId);
-    victim->blockRseqOps(); // A
+static bool inUseOnOtherCpu(int id, int cpu) {
+  int idCpu = hintedCpu(id);
+  return idCpu >= 0 && idCpu != cpu && hintedConcurrencyId(idCpu) == id;
+}
 
-    if (lastCpu != sched_getcpu()) { // B
-      me->accessing()->store(0, std::memory_order_relaxed);
+static int chooseConcurrencyId(int cpu) {
+  int hint = hintedConcurrencyId(cpu);
+  if (hint >= 0 && hintedCpu(hint) == cpu) {
+    return hint;
+  }
+  // Otherwise, take the lowest unowned id not in use on another cpu, or failing
+  // that, evict the owner of the lowest one not in use on another cpu (each
+  // cpu has at most one id in use, so there is such an id below numCpus()).
+  // Ids at or past the high water mark are all unowned, so we needn't look
+  // further than the first of them.
+  int limit = concurrencyIdHighWater.load(std::memory_order_relaxed) + 1;
+  if (limit > numCpus()) {
+    limit = numCpus();
+  }
+  int fallback = -1;
+  for (int id = 0; id < limit; ++id) {
+    if (inUseOnOtherCpu(id, cpu)) {
       continue;
     }
+    if (ownerAndEvictor->forCpu(id)->load().ownerId == 0) {
+      return id;
+    }
+    if (fallback < 0) {
+      fallback = id;
+    }
+  }
+  // The hints may be momentarily inconsistent under concurrent updates; any id
+  // is correct, just possibly not dense.
+  return fallback >= 0 ? fallback : cpu;
+}
 
-    // This is a little bit tricky; why don't we *always* need to do the
-    // asymmetricThreadFencyHeavy()?
-    // We did the stores blocking the victim's rseq ops above (A), and then
-    // viewed ourselves to be running on CPU lastCpu (B). So the blocking stores
-    // will be visible to all threads that run on CPU lastCpu in the future. If
-    // we observe victim->curCpu() == lastCpu below, we know that the victim is
-    // such a thread. So either the victim ran in between the blocking stores
-    // and now (in which case it did a CAS to lastCpu's OwnerEvictor from
-    // <victim, me> to <victim, 0>, so we'll retry below), or the victim hasn't
-    // run yet, in which case we don't need the heavy fence.
-    // This relies on the memory ordering guarantee of ThreadControl::curCpu()
-    // (which itself relies on the way the kernel handles thread migrations).
-    if (victim->curCpu() != lastCpu) {
-      asymmetricThreadFenceHeavy();
+static void noteConcurrencyIdInUse(int id) {
+  // seq_cst, so that a fence() that doesn't see the new high water mark is
+  // ordered before our owner CAS (as with compactIndexForCpu below).
+  int highWater = concurrencyIdHighWater.load(std::memory_order_seq_cst);
+  while (highWater <= id) {
+    if (concurrencyIdHighWater.compare_exchange_weak(highWater, id + 1)) {
+      break;
     }
+  }
+}
+
+static void noteConcurrencyIdAcquired(int id, int cpu) {
+  concurrencyIdForCpu->forCpu(cpu)->store(id + 1, std::memory_order_relaxed);
+  cpuForConcurrencyId->forCpu(id)->store(cpu + 1, std::memory_order_relaxed);
+}
+
+// Tries to take ownership of lastShard, evicting its current owner if it has
+// one. If remote is false, we're acquiring the shard for lastCpu, and give up
+// if we turn out to be running elsewhere; if it's true, we're acquiring some
+// other cpu's shard on purpose (see beginRemote below).
+static bool tryAcquireShard(bool remote) {
+  OwnerAndEvictor curOwnerAndEvictor
+    = ownerAndEvictor->forCpu(lastShard)->load();
+  if (curOwnerAndEvictor.ownerId == 0) {
+    return ownerAndEvictor->forCpu(lastShard)->cas(
+        curOwnerAndEvictor, { me->id(), 0 } );
+  }
+
+  me->accessing()->store(
+      curOwnerAndEvictor.ownerId, std::memory_order_relaxed);
+  if (!ownerAndEvictor->forCpu(lastShard)->cas(
+        curOwnerAndEvictor, { curOwnerAndEvictor.ownerId, me->id() })) {
+    me->accessing()->store(0, std::memory_order_relaxed);
+    return false;
+  }
+  // The CAS succeeded, so we installed ourself as the evictor.
+  curOwnerAndEvictor.evictorId = me->id();
+
+  ThreadControl* victim = ThreadControl::forId(curOwnerAndEvictor.ownerId);
+  victim->blockRseqOps(); // A
 
+  if (!remote && lastCpu != sched_getcpu()) { // B
     me->accessing()->store(0, std::memory_order_relaxed);
+    return false;
+  }
+
+  // This is a little bit tricky; why don't we *always* need to do the
+  // asymmetricThreadFencyHeavy()?
+  // We did the stores blocking the victim's rseq ops above (A), and then
+  // viewed ourselves to be running on CPU lastCpu (B). So the blocking stores
+  // will be visible to all threads that run on CPU lastCpu in the future. If
+  // we observe victim->curCpu() == lastCpu below, we know that the victim is
+  // such a thread. So either the victim ran in between the blocking stores
+  // and now (in which case it did a CAS to lastShard's OwnerEvictor from
+  // <victim, me> to <victim, 0>, so we'll retry below), or the victim hasn't
+  // run yet, in which case we don't need the heavy fence.
+  // Note that none of this depends on the victim having last owned lastCpu's
+  // shard; in concurrency id mode it could have acquired our id anywhere.
+  // This relies on the memory ordering guarantee of ThreadControl::curCpu()
+  // (which itself relies on the way the kernel handles thread migrations).
+  // A remote acquisition skips the check at B, so it always needs the fence.
+  if (remote || victim->curCpu() != lastCpu) {
+    asymmetricThreadFenceHeavy();
+  }
 
-    if (ownerAndEvictor->forCpu(lastCpu)->cas(
-          curOwnerAndEvictor, { me->id(), 0 })) {
-      return lastCpu;
+  me->accessing()->store(0, std::memory_order_relaxed);
+
+  return ownerAndEvictor->forCpu(lastShard)->cas(
+      curOwnerAndEvictor, { me->id(), 0 });
+}
+
+static int acquireCpuOwnership() {
+  while (true) {
+    lastCpu = sched_getcpu();
+    if (usingConcurrencyIds) {
+      lastShard = chooseConcurrencyId(lastCpu);
+      noteConcurrencyIdInUse(lastShard);
+    } else {
+      lastShard = lastCpu;
+      // Makes sure fence() visits this cpu. The registration is ordered before
+      // the CASes below, so a fence() that doesn't see it precedes our
+      // ownership.
+      compactIndexForCpu(lastCpu);
+    }
+    threadCachedCpu()->store(lastShard, std::memory_order_relaxed);
+    if (tryAcquireShard(false)) {
+      if (usingConcurrencyIds) {
+        noteConcurrencyIdAcquired(lastShard, lastCpu);
+      }
+      return lastShard;
     }
   }
 }
@@ -147,8 +257,15 @@ static void ensureMyThreadControlInitialized() {
     });
 
     mutex::callOnce(ownerAndEvictorOnceFlag, []() {
+      usingConcurrencyIds = !shardsAreCpus();
       ownerAndEvictor
           = new (ownerAndEvictorStorage) CpuLocal<AtomicOwnerAndEvictor>;
+      if (usingConcurrencyIds) {
+        concurrencyIdForCpu = new (concurrencyIdForCpuStorage)
+            CpuLocal<std::atomic<int>>;
+        cpuForConcurrencyId = new (cpuForConcurrencyIdStorage)
+            CpuLocal<std::atomic<int>>;
+      }
     });
   }
 }
@@ -160,15 +277,34 @@ int beginSlowPath() {
   return acquireCpuOwnership();
 }
 
+int beginRemote(int shard) {
+  ensureMyThreadControlInitialized();
+  end();
+  me->unblockRseqOps();
+  lastCpu = sched_getcpu();
+  lastShard = shard;
+  // As in acquireCpuOwnership; fence() has to know to look at the shard.
+  if (usingConcurrencyIds) {
+    noteConcurrencyIdInUse(shard);
+  } else {
+    compactIndexForCpu(shard);
+  }
+  threadCachedCpu()->store(shard, std::memory_order_relaxed);
+  while (!tryAcquireShard(true)) {
+  }
+  return shard;
+}
+
 void end() {
   threadCachedCpu()->store(-1, std::memory_order_relaxed);
   while (true) {
     OwnerAndEvictor curOwnerAndEvictor
-        = ownerAndEvictor->forCpu(lastCpu)->load();
+        = ownerAndEvictor->forCpu(lastShard)->load();
     if (curOwnerAndEvictor.ownerId != me->id()) {
       break;
     }
-    if (ownerAndEvictor->forCpu(lastCpu)->cas(curOwnerAndEvictor, { 0, 0 })) {
+    if (ownerAndEvictor->forCpu(lastShard)->cas(
+          curOwnerAndEvictor, { 0, 0 })) {
       break;
     }
   }
@@ -203,8 +339,20 @@ void fenceWith(int shard) {
 void fence() {
   std::atomic_thread_fence(std::memory_order_seq_cst);
   ensureMyThreadControlInitialized();
-  for (int i = 0; i < numCpus(); ++i) {
-    evictOwner(i);
+  if (usingConcurrencyIds) {
+    int highWater = concurrencyIdHighWater.load(std::memory_order_seq_cst);
+    for (int i = 0; i < highWater; ++i) {
+      evictOwner(i);
+    }
+    asymmetricThreadFenceHeavy();
+    return;
+  }
+  // Only cpus that some thread has run an rseq on can have an owner, so on a
+  // host with many more cpus than we're allowed to use, this saves us walking
+  // the rest.
+  int usedCpus = numCompactCpus();
+  for (int i = 0; i < usedCpus; ++i) {
+    evictOwner(cpuForCompactIndex(i));
   }
   asymmetricThreadFenceHeavy();
 }
@@ -12,6 +12,7 @@
 #include <atomic>
 
 #include "rseq/internal/Errors.h"
+#include "rseq/internal/ShardMode.h"
 #include "rseq/internal/rseq_c.h"
 
 namespace rseq {
@@ -23,6 +24,7 @@ namespace internal {
 
 
 int beginSlowPath();
+int beginRemote(int shard);
 void end();
 void fenceWith(int shard);
 void fence();
@@ -32,6 +34,11 @@ inline int beginSlowPathWrapper() {
   return beginSlowPath();
 };
 
+inline int beginRemoteWrapper(int shard) {
+  errors::ThrowOnError thrower;
+  return beginRemote(shard);
+}
+
 inline void endWrapper() {
   errors::ThrowOnError thrower;
   end();
@@ -0,0 +1,65 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#include "rseq/internal/ShardMode.h"
+
+#include <atomic>
+
+#include "rseq/internal/CompactCpus.h"
+#include "rseq/internal/Likely.h"
+#include "rseq/internal/Topology.h"
+
+namespace rseq {
+namespace internal {
+
+enum {
+  kShardModeUnset,
+  kShardModeCpu,
+  kShardModeConcurrencyId,
+};
+static std::atomic<int> shardMode;
+
+static int latchShardMode(int mode) {
+  int result = shardMode.load();
+  if (RSEQ_UNLIKELY(result == kShardModeUnset)) {
+    shardMode.compare_exchange_strong(result, mode);
+    result = shardMode.load();
+  }
+  return result;
+}
+
+bool useConcurrencyIds() {
+  return latchShardMode(kShardModeConcurrencyId) == kShardModeConcurrencyId;
+}
+
+bool shardsAreCpus() {
+  return latchShardMode(kShardModeCpu) == kShardModeCpu;
+}
+
+int nodeForShard(int shard) {
+  return shardsAreCpus() ? nodeForCpu(shard) : -1;
+}
+
+int llcForShard(int shard) {
+  return shardsAreCpus() ? llcForCpu(shard) : -1;
+}
+
+int numActiveShards() {
+  // Only 0 if we couldn't read the affinity mask; cpu 0 is as good a guess as
+  // any then.
+  int result = numCompactCpus();
+  return result > 0 ? result : 1;
+}
+
+int activeShard(int rank) {
+  return shardsAreCpus() ? cpuForCompactIndex(rank) : rank;
+}
+
+} // namespace internal
+} // namespace rseq
@@ -0,0 +1,46 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#pragma once
+
+namespace rseq {
+namespace internal {
+
+// Whether shard indices (the results of rseq::begin()) are cpu ids or
+// concurrency ids. The mode is latched by whichever comes first: the first
+// rseq of any thread, or the first question about the topology of a shard
+// (which a caller may act on, or remember, assuming the answer holds).
+// useConcurrencyIds() only has an effect before then.
+
+// Latches concurrency id mode if nothing has been latched yet. Returns whether
+// concurrency id mode is in effect.
+bool useConcurrencyIds();
+
+// Latches cpu mode if nothing has been latched yet. Returns whether cpu mode
+// is in effect.
+bool shardsAreCpus();
+
+// The NUMA node or last-level cache (see Topology.h) of the shard's cpu, or -1
+// if shard indices aren't cpu ids. shard must be in [0, numCpus()).
+int nodeForShard(int shard);
+int llcForShard(int shard);
+
+// The shards the process can expect to use, densely ranked, for containers
+// that split a fixed budget between shards rather than give each of the
+// numCpus() possible ones its own. In cpu mode, these are the cpus in the
+// affinity mask (see CompactCpus.h); in concurrency id mode, the first that
+// many ids (the ids in use are bounded by the threads running at once). Other
+// shards can still show up, if the mask grows; they get no share.
+int numActiveShards();
+// rank must be in [0, numActiveShards()). Latches cpu mode if nothing has been
+// latched yet.
+int activeShard(int rank);
+
+} // namespace internal
+} // namespace rseq
@@ -29,10 +29,13 @@ namespace internal {
 
 // ThreadControls are all kept in a global linked list. The list, including all
 // additions to and removals from the list, are protected by the mutex.
-// Theoretically we ought to worry about destructor order issues during
-// shutdown, but as a practical matter everything works fine for these types.
+// The list is constructed lazily (in ThreadControl::get below), like the id
+// allocator, rather than by a static initializer: librseq_malloc can get here
+// from another library's constructor, before ours have run.
 static mutex::Mutex allThreadControlsMu;
-static IntrusiveLinkedList<ThreadControl> allThreadControls;
+static IntrusiveLinkedList<ThreadControl>* allThreadControls;
+static char allThreadControlsStorage alignas(
+    IntrusiveLinkedList<ThreadControl>) [sizeof(*allThreadControls)];
 
 // Initialized in ThreadControl::get below.
 // Here we *do* care about destructors running during shutdown.
@@ -59,6 +62,8 @@ ThreadControl* ThreadControl::get(std::atomic<int>* threadCachedCpu) {
   }
 
   mutex::callOnce(idAllocatorOnceFlag, []() {
+    allThreadControls =
+        new (allThreadControlsStorage) IntrusiveLinkedList<ThreadControl>;
     idAllocator =
         new (idAllocatorStorage) IdAllocator<ThreadControl>(kMaxGlobalThreads);
   });
@@ -84,7 +89,7 @@ ThreadControl::ThreadControl(std::atomic<int>* threadCachedCpu) {
   // Insert the ThreadControl into the global list
   {
     mutex::LockGuard<mutex::Mutex> lg(allThreadControlsMu);
-    allThreadControls.link(this);
+    allThreadControls->link(this);
   }
   setThreadControlCleanup([]() {
     me->~ThreadControl();
@@ -98,7 +103,7 @@ ThreadControl::~ThreadControl() {
   // Remove ourselves from the list.
   {
     mutex::LockGuard<mutex::Mutex> lg(allThreadControlsMu);
-    allThreadControls.unlink(this);
+    allThreadControls->unlink(this);
   }
 
   // Wait until no one's trying to evict us.
@@ -108,7 +113,7 @@ ThreadControl::~ThreadControl() {
     beingAccessed = false;
     {
       mutex::LockGuard<mutex::Mutex> lg(allThreadControlsMu);
-      for (ThreadControl& thread : allThreadControls) {
+      for (ThreadControl& thread : *allThreadControls) {
         if (thread.accessing()->load() == id_) {
           beingAccessed = true;
           break;
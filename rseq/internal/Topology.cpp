@@ -0,0 +1,142 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#include "rseq/internal/Topology.h"
+
+#include <cstring>
+
+#include "rseq/internal/CpuList.h"
+#include "rseq/internal/Mutex.h"
+#include "rseq/internal/NumCpus.h"
+#include "rseq/internal/OsMem.h"
+
+namespace rseq {
+namespace internal {
+
+static mutex::OnceFlag topologyOnceFlag;
+static int numNodesFound;
+static int* nodeByCpu;
+static int* cpusByNode;
+// Cache information is read separately, since few callers need it and it
+// takes a handful of sysfs reads per cpu.
+static mutex::OnceFlag llcOnceFlag;
+static int* llcByCpu;
+
+// Big enough for the cpulist of a node on any machine we're likely to see.
+constexpr static int kSysfsBufSize = 4096;
+
+static void readNodeCpus(int node) {
+  char path[64];
+  const char* prefix = "/sys/devices/system/node/node";
+  std::strcpy(path, prefix);
+  char* end = appendInt(node, path + std::strlen(prefix));
+  std::strcpy(end, "/cpulist");
+
+  char buf[kSysfsBufSize];
+  if (!readSysfsFile(path, buf, sizeof(buf))) {
+    return;
+  }
+  parseCpuList(buf, [&](int first, int last) {
+    for (int cpu = first; cpu <= last && cpu < numCpus(); ++cpu) {
+      nodeByCpu[cpu] = node;
+    }
+  });
+}
+
+// The cache with the highest index is the last level.
+static void readLlc(int cpu) {
+  llcByCpu[cpu] = cpu;
+
+  char path[128];
+  const char* prefix = "/sys/devices/system/cpu/cpu";
+  std::strcpy(path, prefix);
+  char* indexEnd = appendInt(cpu, path + std::strlen(prefix));
+  std::strcpy(indexEnd, "/cache/index");
+  indexEnd += std::strlen("/cache/index");
+
+  char buf[kSysfsBufSize];
+  int lastIndex = -1;
+  while (true) {
+    char* end = appendInt(lastIndex + 1, indexEnd);
+    std::strcpy(end, "/shared_cpu_list");
+    if (!readSysfsFile(path, buf, sizeof(buf))) {
+      break;
+    }
+    ++lastIndex;
+  }
+  if (lastIndex < 0) {
+    return;
+  }
+  // The failed read may have clobbered buf.
+  std::strcpy(appendInt(lastIndex, indexEnd), "/shared_cpu_list");
+  if (!readSysfsFile(path, buf, sizeof(buf))) {
+    return;
+  }
+  bool first = true;
+  parseCpuList(buf, [&](int firstCpu, int /* lastCpu */) {
+    if (first && firstCpu < numCpus()) {
+      llcByCpu[cpu] = firstCpu;
+    }
+    first = false;
+  });
+}
+
+static void initTopology() {
+  nodeByCpu = static_cast<int*>(os_mem::allocate(sizeof(int) * numCpus()));
+  // os_mem memory is zeroed, so every cpu starts out on node 0.
+  numNodesFound = 1;
+
+  char buf[kSysfsBufSize];
+  if (readSysfsFile("/sys/devices/system/node/online", buf, sizeof(buf))) {
+    parseCpuList(buf, [&](int first, int last) {
+      for (int node = first; node <= last; ++node) {
+        readNodeCpus(node);
+        if (node + 1 > numNodesFound) {
+          numNodesFound = node + 1;
+        }
+      }
+    });
+  }
+
+  cpusByNode = static_cast<int*>(
+      os_mem::allocate(sizeof(int) * numNodesFound));
+  for (int i = 0; i < numCpus(); ++i) {
+    ++cpusByNode[nodeByCpu[i]];
+  }
+}
+
+static void initLlcs() {
+  llcByCpu = static_cast<int*>(os_mem::allocate(sizeof(int) * numCpus()));
+  for (int i = 0; i < numCpus(); ++i) {
+    readLlc(i);
+  }
+}
+
+int numNodes() {
+  mutex::callOnce(topologyOnceFlag, initTopology);
+  return numNodesFound;
+}
+
+int nodeForCpu(int cpu) {
+  mutex::callOnce(topologyOnceFlag, initTopology);
+  return nodeByCpu[cpu];
+}
+
+int numCpusInNode(int node) {
+  mutex::callOnce(topologyOnceFlag, initTopology);
+  return cpusByNode[node];
+}
+
+int llcForCpu(int cpu) {
+  mutex::callOnce(llcOnceFlag, initLlcs);
+  return llcByCpu[cpu];
+}
+
+} // namespace internal
+} // namespace rseq
@@ -0,0 +1,35 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#pragma once
+
+namespace rseq {
+namespace internal {
+
+// The NUMA layout of the machine, as read from sysfs the first time any of
+// these are called. On machines (or kernels) without NUMA information, we
+// pretend there is a single node containing every cpu.
+
+// Node ids are in [0, numNodes()).
+int numNodes();
+
+// cpu must be in [0, numCpus()).
+int nodeForCpu(int cpu);
+
+// The number of cpus in [0, numCpus()) that belong to the given node.
+int numCpusInNode(int node);
+
+// Identifies the last-level cache of the given cpu: the lowest-numbered cpu
+// sharing that cache. Cpus with the same value share a last-level cache. If
+// sysfs has no cache information for a cpu, it's treated as sharing with no
+// one (i.e. this returns the cpu itself).
+int llcForCpu(int cpu);
+
+} // namespace internal
+} // namespace rseq
@@ -0,0 +1,40 @@
+/**
+ * Copyright (c) 2016-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#include "rseq/internal/Topology.h"
+
+#include <gtest/gtest.h>
+
+#include "rseq/internal/NumCpus.h"
+
+using namespace rseq::internal;
+
+TEST(Topology, EveryCpuHasANode) {
+  ASSERT_LE(1, numNodes());
+  int totalCpus = 0;
+  for (int node = 0; node < numNodes(); ++node) {
+    totalCpus += numCpusInNode(node);
+  }
+  EXPECT_EQ(numCpus(), totalCpus);
+
+  for (int cpu = 0; cpu < numCpus(); ++cpu) {
+    EXPECT_LE(0, nodeForCpu(cpu));
+    EXPECT_GT(numNodes(), nodeForCpu(cpu));
+  }
+}
+
+TEST(Topology, LlcsAreConsistent) {
+  for (int cpu = 0; cpu < numCpus(); ++cpu) {
+    int llc = llcForCpu(cpu);
+    ASSERT_LE(0, llc);
+    ASSERT_GE(cpu, llc);
+    // The representative of a group belongs to it.
+    EXPECT_EQ(llc, llcForCpu(llc));
+  }
+}
@@ -15,7 +15,9 @@
 #include <exception>
 
 #include "rseq/internal/Errors.h"
+#include "rseq/internal/PerCpuAllocator.h"
 #include "rseq/internal/Rseq.h"
+#include "rseq/rseq_c.h"
 
 extern "C" {
 
@@ -30,6 +32,11 @@ int rseq_begin_slow_path() {
   return rseq::internal::beginSlowPath();
 }
 
+int rseq_begin_remote(int shard) {
+  rseq::internal::errors::AbortOnError aoe;
+  return rseq::internal::beginRemote(shard);
+}
+
 void rseq_end() {
   rseq::internal::errors::AbortOnError aoe;
   rseq::internal::end();
@@ -45,4 +52,18 @@ void rseq_fence() {
   rseq::internal::fence();
 }
 
+int rseq_use_concurrency_ids() {
+  return rseq::internal::useConcurrencyIds();
+}
+
+rseq_percpu_t rseq_percpu_alloc(unsigned long size, unsigned long align) {
+  rseq::internal::errors::AbortOnError aoe;
+  return rseq::internal::per_cpu_allocator::allocate(size, align);
+}
+
+void rseq_percpu_free(rseq_percpu_t handle) {
+  rseq::internal::errors::AbortOnError aoe;
+  rseq::internal::per_cpu_allocator::free(handle);
+}
+
 } /* extern "C" */
@@ -28,6 +28,10 @@ extern __thread volatile int rseq_thread_cached_cpu;
 
 int rseq_begin_slow_path();
 
+/* The per-cpu allocation area; see PerCpuAllocator.h. */
+extern char* rseq_percpu_base;
+extern unsigned long rseq_percpu_stride;
+
 #ifdef __cplusplus
 } /* extern "C" */
 #endif
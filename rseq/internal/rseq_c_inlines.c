@@ -14,3 +14,4 @@ extern inline int rseq_load(rseq_value_t *dst, rseq_repr_t *src);
 extern inline int rseq_store(rseq_repr_t *dst, rseq_value_t val);
 extern inline int rseq_store_fence(rseq_repr_t *dst, rseq_value_t val);
 extern inline int rseq_validate();
+extern inline void* rseq_percpu_ptr(rseq_percpu_t handle, int cpu);
@@ -63,9 +63,28 @@ inline int rseq_validate() {
   return rseq_store(&dummy, 0);
 }
 
+/* Per-cpu memory allocation, like the kernel's alloc_percpu.
+ * rseq_percpu_alloc returns a handle to a zero-filled object of the given size
+ * and alignment (a power of two, at most 4096) for each cpu, or 0 if we're out
+ * of per-cpu space (a few megabytes per cpu). rseq_percpu_ptr gives the address
+ * of a particular cpu's copy. Handles are freed with rseq_percpu_free; it's up
+ * to the caller to make sure no cpu's copy is in use at that point. */
+typedef unsigned long rseq_percpu_t;
+
+rseq_percpu_t rseq_percpu_alloc(unsigned long size, unsigned long align);
+void rseq_percpu_free(rseq_percpu_t handle);
+
+inline void* rseq_percpu_ptr(rseq_percpu_t handle, int cpu) {
+  return rseq_percpu_base + cpu * rseq_percpu_stride + handle;
+}
+
+/* See rseq::beginRemote(). */
+int rseq_begin_remote(int shard);
 void rseq_end();
 void rseq_fence_with(int shard);
 void rseq_fence();
+/* See rseq::useConcurrencyIds(). Returns nonzero on success. */
+int rseq_use_concurrency_ids();
 
 
 #ifdef __cplusplus